@@ -0,0 +1,270 @@
+/****************************************************************************
+ * thc-perft, count the leaf nodes of the move tree from a position to
+ *  check and time move generation
+ *  Author:  Bill Forster
+ *  License: MIT license. Full text of license is in associated file LICENSE
+ *  Copyright 2010-2014, Bill Forster <billforsternz at gmail dot com>
+ ****************************************************************************/
+#define _CRT_SECURE_NO_DEPRECATE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include "thc.h"
+using namespace std;
+using namespace thc;
+
+static const char *usage =
+    "Usage: thc-perft [options] depth [fen]\n"
+    "       thc-perft [options] -suite file\n"
+    "Options:\n"
+    "  -divide       show the count for each move from the position\n"
+    "  -threads N    split the moves from the position between N threads\n"
+    "  -hash MB      cache counts of positions already seen in a hash table\n"
+    "  -maxdepth N   (suite only) skip expected counts deeper than N\n"
+    "Suite files have one position per line, the FEN then the expected\n"
+    " counts as ;D1 20 ;D2 400 etc. Lines starting with # are ignored.\n"
+    "Exit status is 1 if any count is wrong\n";
+
+// Optional hash table of perft counts, shared between threads without
+//  locks. Each entry stores key^data alongside data, a torn write (two
+//  threads storing to the same entry at once) makes the check fail and
+//  the entry is ignored
+struct PERFT_ENTRY
+{
+    uint64_t check;     // key ^ data
+    uint64_t data;      // count<<8 | depth
+};
+static vector<PERFT_ENTRY> hash_table;
+static uint64_t hash_mask;
+
+static bool hash_probe( uint64_t key, int depth, uint64_t &count )
+{
+    PERFT_ENTRY e = hash_table[key&hash_mask];
+    if( (e.check^e.data) != key || (int)(e.data&0xff) != depth )
+        return false;
+    count = e.data >> 8;
+    return true;
+}
+
+static void hash_store( uint64_t key, int depth, uint64_t count )
+{
+    PERFT_ENTRY &e = hash_table[key&hash_mask];
+    e.data  = (count<<8) | (uint64_t)depth;
+    e.check = key ^ e.data;
+}
+
+static uint64_t perft( ChessRules &cr, int depth )
+{
+    MOVELIST list;
+    cr.GenLegalMoveList( &list );
+    if( depth <= 1 )
+        return list.count;
+    uint64_t key = 0, count = 0;
+    bool use_hash = (hash_table.size() > 0);
+    if( use_hash )
+    {
+        key = cr.Zobrist();
+        if( hash_probe(key,depth,count) )
+            return count;
+    }
+    for( int i=0; i<list.count; i++ )
+    {
+        Move &move = list.moves[i];
+        cr.PushMove( move );
+        count += perft( cr, depth-1 );
+        cr.PopMove( move );
+    }
+    if( use_hash )
+        hash_store( key, depth, count );
+    return count;
+}
+
+// Count the moves from the root, split between threads. Each thread takes
+//  the next root move not yet taken, so a few big subtrees don't leave
+//  the other threads idle
+static uint64_t perft_root( ChessRules &root, int depth, int nbr_threads, bool divide )
+{
+    MOVELIST list;
+    root.GenLegalMoveList( &list );
+    if( depth <= 1 && !divide )
+        return depth<1 ? 1 : list.count;
+    vector<uint64_t> counts( list.count, 0 );
+    atomic<int> next(0);
+    auto worker = [&]()
+    {
+        ChessRules cr = root;
+        int i;
+        while( (i=next++) < list.count )
+        {
+            Move move = list.moves[i];
+            cr.PushMove( move );
+            counts[i] = depth>1 ? perft( cr, depth-1 ) : 1;
+            cr.PopMove( move );
+        }
+    };
+    vector<thread> threads;
+    for( int t=1; t<nbr_threads && t<list.count; t++ )
+        threads.push_back( thread(worker) );
+    worker();
+    for( unsigned int t=0; t<threads.size(); t++ )
+        threads[t].join();
+    uint64_t total = 0;
+    for( int i=0; i<list.count; i++ )
+    {
+        if( divide )
+            printf( "%s: %llu\n", list.moves[i].TerseOut().c_str(), (unsigned long long)counts[i] );
+        total += counts[i];
+    }
+    return total;
+}
+
+static double now_seconds()
+{
+    return chrono::duration<double>( chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+static uint64_t run( ChessRules &cr, int depth, int nbr_threads, bool divide, double &elapsed )
+{
+    double start = now_seconds();
+    uint64_t count = perft_root( cr, depth, nbr_threads, divide );
+    elapsed = now_seconds() - start;
+    return count;
+}
+
+static void print_rate( uint64_t count, double elapsed )
+{
+    printf( "%.3fs, %.0f knodes/sec\n", elapsed, elapsed>0 ? count/elapsed/1000.0 : 0.0 );
+}
+
+// Run the positions in a suite file, returns number of wrong counts (or
+//  -1 if the file can't be read)
+static int run_suite( const char *filename, int max_depth, int nbr_threads )
+{
+    FILE *f = fopen( filename, "rt" );
+    if( !f )
+    {
+        printf( "Cannot open %s\n", filename );
+        return -1;
+    }
+    int nbr_wrong=0, nbr_checked=0;
+    uint64_t total_count=0;
+    double total_elapsed=0.0;
+    char buf[1000];
+    while( fgets(buf,sizeof(buf),f) )
+    {
+        char *fen = buf;
+        while( *fen==' ' || *fen=='\t' )
+            fen++;
+        if( *fen=='#' || *fen=='\n' || *fen=='\r' || *fen=='\0' )
+            continue;
+        char *expected = strchr(fen,';');
+        if( expected )
+            *expected++ = '\0';
+        ChessRules cr;
+        if( !cr.Forsyth(fen) )
+        {
+            printf( "Bad FEN: %s\n", fen );
+            nbr_wrong++;
+            continue;
+        }
+        printf( "%s\n", fen );
+        while( expected )
+        {
+            int depth;
+            unsigned long long want;
+            char *next = strchr(expected,';');
+            if( next )
+                *next++ = '\0';
+            if( 2 == sscanf(expected," D%d %llu",&depth,&want) && (max_depth==0 || depth<=max_depth) )
+            {
+                double elapsed;
+                uint64_t count = run( cr, depth, nbr_threads, false, elapsed );
+                total_count += count;
+                total_elapsed += elapsed;
+                nbr_checked++;
+                printf( "  depth %d: %llu %s, ", depth, (unsigned long long)count, count==want?"ok":"WRONG" );
+                if( count != want )
+                {
+                    printf( "expected %llu, ", want );
+                    nbr_wrong++;
+                }
+                print_rate( count, elapsed );
+            }
+            expected = next;
+        }
+    }
+    fclose(f);
+    printf( "%d counts checked, %d wrong. Total %llu nodes, ", nbr_checked, nbr_wrong, (unsigned long long)total_count );
+    print_rate( total_count, total_elapsed );
+    return nbr_wrong;
+}
+
+int main( int argc, char *argv[] )
+{
+    bool divide=false;
+    int nbr_threads=1, hash_mb=0, max_depth=0, depth=-1;
+    const char *suite=NULL;
+    string fen;
+    for( int i=1; i<argc; i++ )
+    {
+        const char *arg = argv[i];
+        bool more = (i+1 < argc);
+        if( 0 == strcmp(arg,"-divide") )
+            divide = true;
+        else if( 0==strcmp(arg,"-threads") && more )
+            nbr_threads = atoi(argv[++i]);
+        else if( 0==strcmp(arg,"-hash") && more )
+            hash_mb = atoi(argv[++i]);
+        else if( 0==strcmp(arg,"-maxdepth") && more )
+            max_depth = atoi(argv[++i]);
+        else if( 0==strcmp(arg,"-suite") && more )
+            suite = argv[++i];
+        else if( arg[0]!='-' && depth<0 )
+            depth = atoi(arg);
+        else if( arg[0]!='-' || arg[1]=='\0' )
+            fen = fen.length() ? fen+" "+arg : string(arg);   // allow FEN unquoted
+        else
+        {
+            printf( "%s", usage );
+            return 2;
+        }
+    }
+    if( nbr_threads < 1 )
+        nbr_threads = 1;
+    if( hash_mb > 0 )
+    {
+        // Round down to a power of two number of entries
+        uint64_t nbr_entries = 1;
+        while( nbr_entries*2*sizeof(PERFT_ENTRY) <= (uint64_t)hash_mb*1024*1024 )
+            nbr_entries *= 2;
+        PERFT_ENTRY empty = {1,0};      // check never matches a depth 0 entry
+        hash_table.assign( (size_t)nbr_entries, empty );
+        hash_mask = nbr_entries-1;
+    }
+    if( suite )
+    {
+        int nbr_wrong = run_suite( suite, max_depth, nbr_threads );
+        return nbr_wrong==0 ? 0 : 1;
+    }
+    if( depth < 0 )
+    {
+        printf( "%s", usage );
+        return 2;
+    }
+    ChessRules cr;
+    if( fen.length()>0 && !cr.Forsyth(fen.c_str()) )
+    {
+        printf( "Bad FEN: %s\n", fen.c_str() );
+        return 2;
+    }
+    double elapsed;
+    uint64_t count = run( cr, depth, nbr_threads, divide, elapsed );
+    printf( "Depth %d: %llu nodes, ", depth, (unsigned long long)count );
+    print_rate( count, elapsed );
+    return 0;
+}
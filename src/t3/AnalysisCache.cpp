@@ -0,0 +1,147 @@
+/****************************************************************************
+ *  Analysis cache, remembers engine analysis of positions on disk so it can
+ *   be shown again instantly when a position is revisited
+ *  Author:  Bill Forster
+ *  License: MIT license. Full text of license is in associated file LICENSE
+ *  Copyright 2010-2014, Bill Forster <billforsternz at gmail dot com>
+ ****************************************************************************/
+#define _CRT_SECURE_NO_DEPRECATE
+#include <stdio.h>
+#include "DebugPrintf.h"
+#include "AnalysisCache.h"
+
+// A kibitzer writes a line every time the engine reports a new principal
+//  variation, so don't wait for the disk. Losing the last few lines in a
+//  crash doesn't matter, it's only a cache
+static const char *create_table =
+    "CREATE TABLE IF NOT EXISTS analysis "
+    "(position_hash INT8, multipv INTEGER, engine TEXT, depth INTEGER, score INTEGER, info TEXT, "
+    "PRIMARY KEY(position_hash,engine,multipv))";
+
+// Kept in PRAGMA user_version. Version 0 keyed lines by position only, so one
+//  engine's analysis could replace or be shown as another's. It's only a
+//  cache, so an old table is simply dropped
+#define ANALYSIS_CACHE_VERSION 1
+
+AnalysisCache::AnalysisCache()
+{
+    handle      = NULL;
+    stmt_lookup = NULL;
+    stmt_store  = NULL;
+}
+
+AnalysisCache::~AnalysisCache()
+{
+    Close();
+}
+
+bool AnalysisCache::Open( const char *filename )
+{
+    Close();
+    int retval = sqlite3_open(filename,&handle);
+    if( retval )
+    {
+        cprintf( "ANALYSIS CACHE OPEN FAILED %s\n", filename );
+        Close();
+        return false;
+    }
+    sqlite3_exec( handle, "PRAGMA synchronous=OFF", 0, 0, 0 );
+    int version = -1;
+    sqlite3_stmt *stmt;
+    if( 0 == sqlite3_prepare_v2( handle, "PRAGMA user_version", -1, &stmt, 0 ) )
+    {
+        if( sqlite3_step(stmt) == SQLITE_ROW )
+            version = sqlite3_column_int(stmt,0);
+        sqlite3_finalize(stmt);
+    }
+    if( version != ANALYSIS_CACHE_VERSION )
+    {
+        char buf[100];
+        sprintf( buf, "PRAGMA user_version=%d", ANALYSIS_CACHE_VERSION );
+        sqlite3_exec( handle, "DROP TABLE IF EXISTS analysis", 0, 0, 0 );
+        sqlite3_exec( handle, buf, 0, 0, 0 );
+    }
+    retval = sqlite3_exec( handle, create_table, 0, 0, 0 );
+    if( !retval )
+        retval = sqlite3_prepare_v2( handle,
+                    "SELECT multipv, depth, score, engine, info FROM analysis WHERE position_hash=? AND engine=? ORDER BY multipv",
+                    -1, &stmt_lookup, 0 );
+
+    // No upsert in this version of SQLite, so replace only if there isn't a
+    //  deeper line already
+    if( !retval )
+        retval = sqlite3_prepare_v2( handle,
+                    "INSERT OR REPLACE INTO analysis SELECT ?1,?2,?3,?4,?5,?6 WHERE NOT EXISTS "
+                    "(SELECT 1 FROM analysis WHERE position_hash=?1 AND engine=?3 AND multipv=?2 AND depth>?4)",
+                    -1, &stmt_store, 0 );
+    if( retval )
+    {
+        cprintf( "ANALYSIS CACHE SETUP FAILED %s\n", sqlite3_errmsg(handle) );
+        Close();
+        return false;
+    }
+    return true;
+}
+
+void AnalysisCache::Close()
+{
+    if( stmt_lookup )
+        sqlite3_finalize(stmt_lookup);
+    if( stmt_store )
+        sqlite3_finalize(stmt_store);
+    if( handle )
+        sqlite3_close(handle);
+    handle      = NULL;
+    stmt_lookup = NULL;
+    stmt_store  = NULL;
+}
+
+bool AnalysisCache::Lookup( uint64_t key, const char *engine_name, std::vector<ANALYSIS_LINE> &lines )
+{
+    lines.clear();
+    if( !handle )
+        return false;
+    sqlite3_bind_int64( stmt_lookup, 1, (sqlite3_int64)key );
+    sqlite3_bind_text ( stmt_lookup, 2, engine_name, -1, SQLITE_TRANSIENT );
+    while( SQLITE_ROW == sqlite3_step(stmt_lookup) )
+    {
+        ANALYSIS_LINE line;
+        line.multipv  = sqlite3_column_int(stmt_lookup,0);
+        line.depth    = sqlite3_column_int(stmt_lookup,1);
+        line.score_cp = sqlite3_column_int(stmt_lookup,2);
+        const char *s = (const char *)sqlite3_column_text(stmt_lookup,3);
+        line.engine_name = s ? s : "";
+        s = (const char *)sqlite3_column_text(stmt_lookup,4);
+        line.info = s ? s : "";
+        lines.push_back(line);
+    }
+    sqlite3_reset(stmt_lookup);
+    return lines.size() > 0;
+}
+
+void AnalysisCache::Store( uint64_t key, const ANALYSIS_LINE &line )
+{
+    if( !handle )
+        return;
+    sqlite3_bind_int64( stmt_store, 1, (sqlite3_int64)key );
+    sqlite3_bind_int  ( stmt_store, 2, line.multipv );
+    sqlite3_bind_text ( stmt_store, 3, line.engine_name.c_str(), -1, SQLITE_TRANSIENT );
+    sqlite3_bind_int  ( stmt_store, 4, line.depth );
+    sqlite3_bind_int  ( stmt_store, 5, line.score_cp );
+    sqlite3_bind_text ( stmt_store, 6, line.info.c_str(), -1, SQLITE_TRANSIENT );
+    if( SQLITE_DONE != sqlite3_step(stmt_store) )
+        cprintf( "ANALYSIS CACHE STORE FAILED %s\n", sqlite3_errmsg(handle) );
+    sqlite3_reset(stmt_store);
+}
+
+void AnalysisCache::BeginBatch()
+{
+    if( handle )
+        sqlite3_exec( handle, "BEGIN TRANSACTION", 0, 0, 0 );
+}
+
+void AnalysisCache::EndBatch()
+{
+    if( handle )
+        sqlite3_exec( handle, "COMMIT TRANSACTION", 0, 0, 0 );
+}
@@ -0,0 +1,51 @@
+/****************************************************************************
+ *  Analysis cache, remembers engine analysis of positions on disk so it can
+ *   be shown again instantly when a position is revisited
+ *  Author:  Bill Forster
+ *  License: MIT license. Full text of license is in associated file LICENSE
+ *  Copyright 2010-2014, Bill Forster <billforsternz at gmail dot com>
+ ****************************************************************************/
+#ifndef ANALYSIS_CACHE_H
+#define ANALYSIS_CACHE_H
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "sqlite3.h"
+
+// One line of multi-pv analysis. The engine's own "info ... pv ..." line is
+//  kept, so it can be replayed through the normal kibitz display code
+struct ANALYSIS_LINE
+{
+    int multipv;                // 0 = best line
+    int depth;
+    int score_cp;               // side to move's point of view, mates as +-100000
+    std::string engine_name;
+    std::string info;
+};
+
+class AnalysisCache
+{
+public:
+    AnalysisCache();
+    ~AnalysisCache();
+    bool Open( const char *filename );
+    void Close();
+
+    // Position keys are ChessRules::Zobrist(), lines are kept separately for
+    //  each engine. Returns lines in multipv order
+    bool Lookup( uint64_t key, const char *engine_name, std::vector<ANALYSIS_LINE> &lines );
+
+    // Only replaces a line already stored if the new line is at least as deep
+    void Store( uint64_t key, const ANALYSIS_LINE &line );
+
+    // Group a batch of Store()s into one transaction
+    void BeginBatch();
+    void EndBatch();
+
+private:
+    sqlite3 *handle;
+    sqlite3_stmt *stmt_lookup;
+    sqlite3_stmt *stmt_store;
+};
+
+#endif // ANALYSIS_CACHE_H
@@ -10,6 +10,9 @@
 #include <stdlib.h>
 #include <ctype.h>
 #include <stdarg.h>
+#include <string>
+#include <thread>
+#include "wx/dir.h"
 #include "Book.h"
 #include "Repository.h"
 #include "Objects.h"
@@ -23,7 +26,7 @@ static FILE *file_regen;
 #endif
 
 // Misc
-#define VERSION 4               // check we've got the right version
+#define VERSION 6               // check we've got the right version
 #define BOOK_MOVE_LIMIT 100     // book moves only up to here
 #define MAGIC   0x43415041      // "CAPA"
 
@@ -52,6 +55,23 @@ Book::Book()
     debug_ptr = 0;
     stack_idx = 0;
     memset( stack_array, 0, sizeof(stack_array) );
+    table = NULL;
+    table_msk = 0;
+    successors = NULL;
+    nbr_successors = 0;
+    compile_bytes = NULL;
+    compile_abort = NULL;
+    nag_value = 0;
+}
+
+// Hash for the compiled book's table. CompressedPosition::Compress()'s own
+//  hash is only 16 bits
+static inline uint32_t book_slot_hash( const CompressedPosition &cpos )
+{
+    uint64_t h = 0;
+    for( unsigned int i=0; i<nbrof(cpos.ints); i++ )
+        h = (h ^ cpos.ints[i]) * 0x9e3779b97f4a7c15ULL;
+    return (uint32_t)(h>>32);
 }
 
 const char *Book::ShowState( STATE state )
@@ -108,6 +128,15 @@ FILE *Book::debug_log_file()
 bool Book::Load( wxString &error_msg, wxString &pgn_file )
 {
     bool error=false;
+
+    // A Polyglot book is used as is, there's nothing to compile
+    if( objs.repository->book.m_polyglot )
+    {
+        predefined_labels.clear();
+        predefined_fens.clear();
+        return polyglot.Load( error_msg, pgn_file );
+    }
+    polyglot.Close();
     wxString compile_msg = "Digesting book";
     wxString pgn_compiled_file;
     pgn_compiled_file = pgn_file + "_compiled"; 
@@ -135,6 +164,8 @@ bool Book::Load( wxString &error_msg, wxString &pgn_file )
             {
                 compile_msg = "Redigesting book";
                 error = Compile( error_msg, compile_msg, pgn_file, pgn_compiled_file );
+                if( !error )
+                    error = LoadCompiled( error_msg, pgn_compiled_file );
             }
         }
         else
@@ -188,14 +219,15 @@ void Book::debug_dump()
     }    
 }
 
-bool Book::Process( FILE *infile, wxProgressDialog &progress )
+// Parse a .pgn into the buckets. Returns bool aborted. Without a progress
+//  dialog we're on a CompileMulti() worker thread, so report progress through
+//  compile_bytes and check compile_abort instead
+bool Book::Process( FILE *infile, wxProgressDialog *progress )
 {
     bool aborted = false;
     char buf[BOOK_BUFLEN+10];
-    static char comment_buf[10000];
     int ch, comment_ch=0, previous_ch=0, push_back=0, len=0, move_number=0;
     STATE state=INIT, old_state, save_state=INIT;
-    static int nag_value;
     fseek(infile,0,SEEK_END);
     unsigned long file_len=ftell(infile);
     rewind(infile);
@@ -203,10 +235,22 @@ bool Book::Process( FILE *infile, wxProgressDialog &progress )
     // Loop through characters
     ch = fgetc(infile);
     int old_percent = -1;
+    unsigned long old_offset = 0;
     unsigned char modulo_256=0;
     while( ch != EOF )
     {
-        if( modulo_256 == 0 )
+        if( modulo_256==0 && !progress )
+        {
+            unsigned long file_offset=ftell(infile);
+            *compile_bytes += file_offset-old_offset;
+            old_offset = file_offset;
+            if( *compile_abort )
+            {
+                aborted = true;
+                break;
+            }
+        }
+        else if( modulo_256 == 0 )
         {
             unsigned long file_offset=ftell(infile);
             int percent;
@@ -218,7 +262,7 @@ bool Book::Process( FILE *infile, wxProgressDialog &progress )
                 percent = (int)( file_offset / (file_len/100L) );
             if( percent != old_percent )
             {
-                if( !progress.Update( percent>100 ? 100 : percent ) )
+                if( !progress->Update( percent>100 ? 100 : percent ) )
                 {
                     aborted = true;
                     break;
@@ -603,6 +647,8 @@ bool Book::Process( FILE *infile, wxProgressDialog &progress )
         }
     }
     FileOver();
+    if( !progress )
+        *compile_bytes += file_len-old_offset;
     return aborted;
 }       
 
@@ -885,13 +931,19 @@ bool Book::DoMove( bool white, int move_number, char *buf )
         }
         else
         {
+            if( stack_idx==0 && n->nbr_moves==0 && fen_flag && fen[0] )
+            {
+                CompressedPosition root;
+                chess_rules.Compress( root );
+                if( fen_roots.size()==0 || 0!=memcmp(&root,&fen_roots.back(),sizeof(root)) )
+                    fen_roots.push_back( root );    // duplicates are removed in WriteCompiled()
+            }
             chess_rules.PlayMove( move );
             if( move_number<=BOOK_MOVE_LIMIT )
             {
                 BookPosition bp;
                 unsigned short hash = chess_rules.Compress( bp.cpos );
                 bp.count = 0;
-                bp.play_position_count = 0;
                 #if 0
                 { // temp - test Decompress() function
                     ChessPosition pos;
@@ -939,6 +991,20 @@ bool Book::DoMove( bool white, int move_number, char *buf )
     return okay;
 }
 
+// Find a position in the buckets, while compiling
+Book::BookPosition *Book::CompileFind( const ChessPosition &pos )
+{
+    CompressedPosition cpos;
+    unsigned short hash = BOOK_HASH_MSK & pos.Compress( cpos );
+    vector<BookPosition>::iterator it;
+    for( it = bucket[hash].begin(); it != bucket[hash].end(); it++ )
+    {
+        if( 0 == memcmp(&cpos,&it->cpos,sizeof(cpos)) )
+            return &(*it);
+    }
+    return NULL;
+}
+
 // Compile book. Returns bool error
 bool Book::Compile( wxString &error_msg, wxString &compile_msg, wxString &pgn_file, wxString &pgn_compiled_file )
 {
@@ -951,6 +1017,14 @@ bool Book::Compile( wxString &error_msg, wxString &compile_msg, wxString &pgn_fi
     bool error = false;
     const char *pgn_in = pgn_file.c_str();
     const char *pgn_compiled_out = pgn_compiled_file.c_str();
+
+    // Can't rewrite the compiled book while it's mapped
+    table = NULL;
+    table_msk = 0;
+    successors = NULL;
+    nbr_successors = 0;
+    play_position_counts.clear();
+    book_map.Close();
     FILE *outfile = NULL;
     FILE *infile  = fopen( pgn_in, "rt" );
     #ifdef REGENERATE
@@ -973,128 +1047,25 @@ bool Book::Compile( wxString &error_msg, wxString &compile_msg, wxString &pgn_fi
     }
     if( !error )
     {
-        unsigned short us;
-        unsigned int   ui;
         for( unsigned int i=0; i<BOOK_HASH_NBR; i++ )
             bucket[i].clear();
+        fen_roots.clear();
         predefined_labels.clear();
         predefined_fens.clear();
         predefined_labels.Add(" ");  // a blank line for combo box
         predefined_fens.Add(" ");
-        bool aborted = Process( infile, progress );
+        bool aborted = Process( infile, &progress );
         if( aborted )
         {
             error_msg.Printf( "Digestion cancelled by user - no book moves available" );
             error = true;
             for( unsigned int i=0; i<BOOK_HASH_NBR; i++ )
                 bucket[i].clear();
+            fen_roots.clear();
         }
         else
         {
-            ui = MAGIC;
-            fwrite( &ui, sizeof(ui), 1, outfile );
-            ui = VERSION;
-            fwrite( &ui, sizeof(ui), 1, outfile );
-            ui = BOOK_HASH_NBR;
-            fwrite( &ui, sizeof(ui), 1, outfile );
-            unsigned int nbr_labels = predefined_labels.GetCount();
-            unsigned int nbr_fens = predefined_fens.GetCount();
-            if( nbr_labels != nbr_fens )
-            {
-                predefined_labels.clear();
-                predefined_fens.clear();
-                predefined_labels.Add(" ");  // a blank line for combo box
-                predefined_fens.Add(" ");
-                nbr_labels = nbr_fens = 1;
-            }
-            fwrite( &nbr_labels, sizeof(nbr_labels), 1, outfile );
-            for( unsigned int i=0; i<nbr_labels; i++ )
-            {
-                wxString label = predefined_labels[i];
-                ui = label.Len();
-                fwrite( &ui, sizeof(ui), 1, outfile );
-                fwrite( label.c_str(), label.Len(), 1, outfile );
-                wxString fen = predefined_fens[i];
-                ui = fen.Len();
-                fwrite( &ui, sizeof(ui), 1, outfile );
-                fwrite( fen.c_str(), fen.Len(), 1, outfile );
-            }
-            ChessRules cr2;
-            for( int i=0; i<BOOK_HASH_NBR; i++ )
-            {
-                if( bucket[i].size() )
-                {
-                    us = (unsigned short)i;
-                    fwrite( &us, sizeof(us), 1, outfile );
-                    ui = bucket[i].size();
-                    fwrite( &ui, sizeof(ui), 1, outfile );
-                    //bool multi = (bucket[i].size()>1);
-                    //DebugPrintf(( "bucket[%04x] has %d position%s", i, bucket[i].size(), multi?"s":"" ));
-                    vector<BookPosition>::iterator it;
-                    for( it = bucket[i].begin(); it != bucket[i].end(); it++ )
-                    {
-                        BookPosition bp = *it;
-                        BookPositionInFile bpif;
-                        bpif.cpos  = bp.cpos;
-                        unsigned long count = bp.count;
-                        // count = 4294967295; testing
-
-                        // Compress a 32 bit count into a 16 bit count, sacrificing
-                        //  accuracy for large values
-                        // Examples;
-                        //  9999  --compress--> 9999  --decompress--> 9999
-                        //  10000 --compress--> 10000 --decompress--> 10000
-                        //  10001 --compress--> 11000 --decompress--> 10000
-                        //  10009 --compress--> 11000 --decompress--> 10000
-                        //  10010 --compress--> 11001 --decompress--> 10010
-                        //  10019 --compress--> 11001 --decompress--> 10010
-                        //  10020 --compress--> 11002 --decompress--> 10020
-                        //  4,294,967,295 --compress--> 64294 --decompress--> 4,294,000,000
-                        //  Characteristics of scheme;
-                        //  - There are unused coding holes 10,000->10,999 20,000->20,999 etc.
-                        //  - Scheme preserves 4 ms digits of accuracy
-                        if( count > 1000000000 )        // (4,294,967,295->64294) [2^32-1 is largest unsigned int we cope with]
-                        {
-                            count = (count/1000000);    // 4000,000,000->4000
-                            count += 60000;             // 4000,000,000->64000
-                        }
-                        else if( count > 100000000 )    // (1000,000,000->60,000)
-                        {
-                            count = (count/100000);     // 900,000,000->9000
-                            count += 50000;             // 900,000,000->59000
-                        }
-                        else if( count > 10000000 )
-                        {
-                            count = (count/10000);      // 90,000,000->9000
-                            count += 40000;             // 90,000,000->49000
-                        }
-                        else if( count > 1000000 )
-                        {
-                            count = (count/1000);       // 9,000,000->9000
-                            count += 30000;             // 9,000,000->39000
-                        }
-                        else if( count > 100000 )
-                        {
-                            count = (count/100);        // 900,000->9000
-                            count += 20000;             // 900,000->29000
-                        }
-                        else if( count > 10000 )
-                        {
-                            count = (count/10);         // 90,000->9000
-                            count += 10000;             // 90,000->19000
-                        }
-                        // else 9000->9000 (no loss of accuracy from 0-10000)
-                        bpif.count  = (unsigned short)count;
-                        fwrite( &bpif, sizeof(BookPositionInFile), 1, outfile );
-                    }
-                }
-            }
-
-            // Terminate with 0,0
-            us = (unsigned short)0;
-            fwrite( &us, sizeof(us), 1, outfile );
-            ui = (unsigned int)0;
-            fwrite( &ui, sizeof(ui), 1, outfile );
+            error = WriteCompiled( error_msg, outfile, pgn_compiled_out, progress );
         }
     }
     if( infile )
@@ -1108,60 +1079,436 @@ bool Book::Compile( wxString &error_msg, wxString &compile_msg, wxString &pgn_fi
 	return error;
 }
 
-// Load compiled book. Returns bool error
-bool Book::LoadCompiled( wxString &error_msg, wxString &pgn_compiled_file )
+// Read from the mapped book file, return false if past the end
+static bool book_read( const char *&p, const char *end, void *dst, size_t len )
+{
+    if( (size_t)(end-p) < len )
+        return false;
+    memcpy( dst, p, len );
+    p += len;
+    return true;
+}
+
+// Compile book from several sources, each worker thread parses whole .pgn
+//  files into buckets of its own, then they are merged. Returns bool error
+bool Book::CompileMulti( wxString &error_msg, wxArrayString &sources, wxString &pgn_compiled_file, bool add )
 {
     bool error = false;
-    unsigned int   ui;
+    const char *pgn_compiled_out = pgn_compiled_file.c_str();
+
+    // List the files (as plain strings for the workers) and add up their sizes
+    //  for progress
+    wxArrayString pgn_files;
+    for( unsigned int i=0; i<sources.GetCount(); i++ )
+    {
+        if( wxDir::Exists(sources[i]) )
+            wxDir::GetAllFiles( sources[i], &pgn_files, "*.pgn" );
+        else
+            pgn_files.Add( sources[i] );
+    }
+    vector<std::string> files;
+    unsigned long total_bytes = 0;
+    for( unsigned int i=0; !error && i<pgn_files.GetCount(); i++ )
+    {
+        std::string file( pgn_files[i].c_str() );
+        FILE *infile = fopen( file.c_str(), "rt" );
+        if( infile == NULL )
+        {
+            error_msg.Printf( "Cannot open %s for reading", file.c_str() );
+            error = true;
+        }
+        else
+        {
+            fseek( infile, 0, SEEK_END );
+            total_bytes += ftell( infile );
+            fclose( infile );
+            files.push_back( file );
+        }
+    }
+    if( error )
+        return error;
+
+    // Start with the positions already in the book if adding to it
     for( unsigned int i=0; i<BOOK_HASH_NBR; i++ )
         bucket[i].clear();
+    fen_roots.clear();
     predefined_labels.clear();
     predefined_fens.clear();
-    const char *pgn_compiled_in = pgn_compiled_file.c_str();
-    FILE *infile  = fopen( pgn_compiled_in, "rb" );
-    if( infile == NULL )
+    wxFileName pcf(pgn_compiled_file);
+    if( add && pcf.FileExists() )
     {
-        error_msg.Printf( "Cannot open %s for reading", pgn_compiled_in );
+        error = LoadCompiled( error_msg, pgn_compiled_file );
+        if( error )
+            return error;
+        RebuildBuckets();
+    }
+    if( predefined_labels.GetCount() == 0 )
+    {
+        predefined_labels.Add(" ");  // a blank line for combo box
+        predefined_fens.Add(" ");
+    }
+
+    // Can't rewrite the compiled book while it's mapped
+    table = NULL;
+    table_msk = 0;
+    successors = NULL;
+    nbr_successors = 0;
+    play_position_counts.clear();
+    book_map.Close();
+
+    // Workers take the next file not yet taken
+    wxProgressDialog progress( "Book digestion", "Digesting book", 100, NULL,
+                                     wxPD_APP_MODAL+
+                                     wxPD_AUTO_HIDE+
+                                     wxPD_ELAPSED_TIME+
+                                     wxPD_CAN_ABORT+
+                                     wxPD_ESTIMATED_TIME );
+    std::atomic<unsigned long> bytes(0);
+    std::atomic<bool> abort(false);
+    std::atomic<int> next(0);
+    std::atomic<int> nbr_running(0);
+    int nbr_threads = std::thread::hardware_concurrency();
+    if( nbr_threads > (int)files.size() )
+        nbr_threads = (int)files.size();
+    if( nbr_threads < 1 )
+        nbr_threads = 1;
+    vector<Book *> workers;
+    vector<std::thread> threads;
+    for( int t=0; t<nbr_threads; t++ )
+    {
+        Book *w = new Book;
+        w->compile_bytes = &bytes;
+        w->compile_abort = &abort;
+        #ifdef _DEBUG
+        w->debug_log_file_txt = debug_log_file();  // one log for all workers' Error()s
+        #endif
+        workers.push_back( w );
+        nbr_running++;
+        threads.push_back( std::thread( [&,w]()
+        {
+            int i;
+            while( !abort && (i=next++) < (int)files.size() )
+            {
+                FILE *infile = fopen( files[i].c_str(), "rt" );
+                if( infile )
+                {
+                    w->stack_idx = 0;
+                    w->Process( infile, NULL );
+                    fclose( infile );
+                }
+            }
+            nbr_running--;
+        } ) );
+    }
+    while( nbr_running > 0 )
+    {
+        wxMilliSleep(100);
+        int percent = total_bytes ? (int)( ((double)bytes)*100.0 / total_bytes ) : 100;
+        if( !progress.Update( percent>100 ? 100 : percent ) )
+            abort = true;
+    }
+    for( unsigned int t=0; t<threads.size(); t++ )
+        threads[t].join();
+
+    // Merge
+    if( abort )
+    {
+        error_msg.Printf( "Digestion cancelled by user - book unchanged" );
         error = true;
+        for( unsigned int i=0; i<BOOK_HASH_NBR; i++ )
+            bucket[i].clear();
+        fen_roots.clear();
     }
-    if( !error )
+    for( unsigned int t=0; t<workers.size(); t++ )
     {
-        fread( &ui, sizeof(ui), 1, infile );
-        if( ui != MAGIC )
+        if( !error )
         {
-            error_msg.Printf( "File %s is not a book file", pgn_compiled_in );
-            error = true;
+            MergeBuckets( *workers[t] );
+            for( unsigned int i=0; i<workers[t]->predefined_labels.GetCount() && i<workers[t]->predefined_fens.GetCount(); i++ )
+            {
+                predefined_labels.Add( workers[t]->predefined_labels[i] );
+                predefined_fens.Add( workers[t]->predefined_fens[i] );
+            }
         }
+        delete workers[t];
     }
+
+    // Write, then map the result (or map the unchanged book again)
     if( !error )
     {
-        fread( &ui, sizeof(ui), 1, infile );
-        if( ui != VERSION )
+        FILE *outfile = fopen( pgn_compiled_out, "wb" );
+        if( outfile == NULL )
         {
-            error_msg.Printf( "File %s uses book format version %u, not supported by this program",
-                                 pgn_compiled_in, ui );
+            error_msg.Printf( "Cannot open %s for writing", pgn_compiled_out );
             error = true;
         }
+        else
+        {
+            error = WriteCompiled( error_msg, outfile, pgn_compiled_out, progress );
+            fclose( outfile );
+        }
+        if( !error )
+            error = LoadCompiled( error_msg, pgn_compiled_file );
+    }
+    else if( pcf.FileExists() )
+    {
+        wxString load_error_msg;
+        LoadCompiled( load_error_msg, pgn_compiled_file );
+    }
+    return error;
+}
+
+// Recreate the buckets from the mapped compiled book. Every book position is
+//  reached by a book move from a position in the table, so none are lost.
+//  The table positions that aren't reached that way are the start positions
+void Book::RebuildBuckets()
+{
+    for( uint32_t idx=0; table && idx<=table_msk; idx++ )
+    {
+        const BookSlot &slot = table[idx];
+        if( slot.nbr_successors==0 || slot.successors+slot.nbr_successors > nbr_successors )
+            continue;
+        ChessPosition pos;
+        pos.Decompress( slot.cpos );
+        ChessRules cr = pos;
+        for( uint32_t i=slot.successors; i<slot.successors+slot.nbr_successors; i++ )
+        {
+            Move move = successors[i].move;
+            cr.PushMove( move );
+            if( !CompileFind(cr) )
+            {
+                BookPosition bp;
+                unsigned short hash = BOOK_HASH_MSK & cr.Compress( bp.cpos );
+                bp.count = successors[i].count;
+                bucket[hash].push_back( bp );
+            }
+            cr.PopMove( move );
+        }
+    }
+    for( uint32_t idx=0; table && idx<=table_msk; idx++ )
+    {
+        const BookSlot &slot = table[idx];
+        if( slot.nbr_successors==0 || slot.successors+slot.nbr_successors > nbr_successors )
+            continue;
+        ChessPosition pos;
+        pos.Decompress( slot.cpos );
+        if( !CompileFind(pos) )
+            fen_roots.push_back( slot.cpos );
+    }
+}
+
+// Add another book's buckets to ours, and empty them
+void Book::MergeBuckets( Book &other )
+{
+    for( unsigned int i=0; i<BOOK_HASH_NBR; i++ )
+    {
+        vector<BookPosition>::iterator it, it2;
+        for( it = other.bucket[i].begin(); it != other.bucket[i].end(); it++ )
+        {
+            bool found = false;
+            for( it2 = bucket[i].begin(); it2 != bucket[i].end(); it2++ )
+            {
+                if( 0 == memcmp(&it->cpos,&it2->cpos,sizeof(it->cpos)) )
+                {
+                    found = true;
+                    it2->count += it->count+1;  // count is appearances-1
+                    break;
+                }
+            }
+            if( !found )
+                bucket[i].push_back( *it );
+        }
+        vector<BookPosition>().swap( other.bucket[i] );
+    }
+    fen_roots.insert( fen_roots.end(), other.fen_roots.begin(), other.fen_roots.end() );
+    vector<CompressedPosition>().swap( other.fen_roots );
+}
+
+// Write the compiled book from the buckets, and free them. Returns bool error
+bool Book::WriteCompiled( wxString &error_msg, FILE *outfile, const char *pgn_compiled_out, wxProgressDialog &progress )
+{
+    bool error = false;
+    unsigned int ui;
+    ui = MAGIC;
+    fwrite( &ui, sizeof(ui), 1, outfile );
+    ui = VERSION;
+    fwrite( &ui, sizeof(ui), 1, outfile );
+    unsigned int nbr_labels = predefined_labels.GetCount();
+    unsigned int nbr_fens = predefined_fens.GetCount();
+    if( nbr_labels != nbr_fens )
+    {
+        predefined_labels.clear();
+        predefined_fens.clear();
+        predefined_labels.Add(" ");  // a blank line for combo box
+        predefined_fens.Add(" ");
+        nbr_labels = nbr_fens = 1;
+    }
+    fwrite( &nbr_labels, sizeof(nbr_labels), 1, outfile );
+    for( unsigned int i=0; i<nbr_labels; i++ )
+    {
+        wxString label = predefined_labels[i];
+        ui = label.Len();
+        fwrite( &ui, sizeof(ui), 1, outfile );
+        fwrite( label.c_str(), label.Len(), 1, outfile );
+        wxString fen = predefined_fens[i];
+        ui = fen.Len();
+        fwrite( &ui, sizeof(ui), 1, outfile );
+        fwrite( fen.c_str(), fen.Len(), 1, outfile );
+    }
+
+    // Each book position gets a slot if it leads to other book
+    //  positions (including by transposition), with a list of the
+    //  moves that do, so Lookup() needs just one probe
+    vector<BookSlot> parents;
+    vector<BookSuccessor> succ;
+    auto add_parent = [&]( const CompressedPosition &cpos )
+    {
+        ChessPosition pos;
+        pos.Decompress( cpos );
+        ChessRules cr = pos;
+        vector<Move> moves;
+        cr.GenLegalMoveList( moves );
+        BookSlot slot;
+        slot.cpos = cpos;
+        slot.successors = succ.size();
+        for( unsigned int j=0; j<moves.size(); j++ )
+        {
+            cr.PushMove( moves[j] );
+            BookPosition *child = CompileFind( cr );
+            cr.PopMove( moves[j] );
+            if( child )
+            {
+                BookSuccessor bs;
+                bs.move  = moves[j];
+                bs.count = child->count;
+                succ.push_back( bs );
+            }
+        }
+        slot.nbr_successors = succ.size() - slot.successors;
+        if( slot.nbr_successors )
+        {
+            // Most popular first
+            sort( succ.begin()+slot.successors, succ.end(),
+                  []( const BookSuccessor &a, const BookSuccessor &b ) { return a.count > b.count; } );
+            parents.push_back( slot );
+        }
+    };
+
+    // The start positions are never reached by a move (unless by transposition
+    //  from another game), so aren't in the buckets
+    ChessRules start;
+    CompressedPosition start_cpos;
+    start.Compress( start_cpos );
+    fen_roots.push_back( start_cpos );
+    sort( fen_roots.begin(), fen_roots.end(),
+          []( const CompressedPosition &a, const CompressedPosition &b ) { return memcmp(&a,&b,sizeof(a)) < 0; } );
+    fen_roots.erase( unique( fen_roots.begin(), fen_roots.end(),
+          []( const CompressedPosition &a, const CompressedPosition &b ) { return memcmp(&a,&b,sizeof(a)) == 0; } ),
+          fen_roots.end() );
+    for( unsigned int i=0; i<fen_roots.size(); i++ )
+    {
+        ChessPosition pos;
+        pos.Decompress( fen_roots[i] );
+        if( !CompileFind(pos) )
+            add_parent( fen_roots[i] );
+    }
+    for( unsigned int i=0; i<BOOK_HASH_NBR; i++ )
+    {
+        if( (i&0xff) == 0 )
+            progress.Pulse();
+        vector<BookPosition>::iterator it;
+        for( it = bucket[i].begin(); it != bucket[i].end(); it++ )
+            add_parent( it->cpos );
+    }
+    for( unsigned int i=0; i<BOOK_HASH_NBR; i++ )
+        vector<BookPosition>().swap( bucket[i] );   // free them, the table is all we need now
+    vector<CompressedPosition>().swap( fen_roots );
+
+    // Size the hash table so it's never more than half full
+    unsigned int nbr_positions = parents.size();
+    unsigned int nbr_slots = 64;
+    while( nbr_slots < 2*nbr_positions )
+        nbr_slots *= 2;
+    vector<BookSlot> slots(nbr_slots);
+    memset( &slots[0], 0, nbr_slots*sizeof(BookSlot) );
+    uint32_t msk = nbr_slots-1;
+    for( unsigned int i=0; i<nbr_positions; i++ )
+    {
+        uint32_t idx = book_slot_hash(parents[i].cpos) & msk;
+        while( slots[idx].nbr_successors )
+            idx = (idx+1) & msk;
+        slots[idx] = parents[i];
+    }
+    unsigned int nbr_succ = succ.size();
+    fwrite( &nbr_slots, sizeof(nbr_slots), 1, outfile );
+    fwrite( &nbr_positions, sizeof(nbr_positions), 1, outfile );
+    fwrite( &nbr_succ, sizeof(nbr_succ), 1, outfile );
+
+    // Table starts on a cache line boundary, the book moves follow it
+    long offset = ftell( outfile );
+    static const char zeros[64] = {0};
+    if( offset % 64 )
+        fwrite( zeros, 64 - offset%64, 1, outfile );
+    if( nbr_slots != fwrite( &slots[0], sizeof(BookSlot), nbr_slots, outfile ) ||
+        (nbr_succ>0 && nbr_succ != fwrite( &succ[0], sizeof(BookSuccessor), nbr_succ, outfile )) )
+    {
+        error_msg.Printf( "Cannot write %s", pgn_compiled_out );
+        error = true;
+    }
+    return error;
+}
+
+// Load compiled book. Returns bool error
+bool Book::LoadCompiled( wxString &error_msg, wxString &pgn_compiled_file )
+{
+    bool error = false;
+    uint32_t ui;
+    for( unsigned int i=0; i<BOOK_HASH_NBR; i++ )
+        bucket[i].clear();
+    fen_roots.clear();
+    predefined_labels.clear();
+    predefined_fens.clear();
+    play_position_counts.clear();
+    table = NULL;
+    table_msk = 0;
+    successors = NULL;
+    nbr_successors = 0;
+    book_map.Close();
+    const char *pgn_compiled_in = pgn_compiled_file.c_str();
+    if( !book_map.Open(pgn_compiled_in) )
+    {
+        error_msg.Printf( "Cannot open %s for reading", pgn_compiled_in );
+        return true;
+    }
+
+    // Everything up to the hash table is read in the usual way, the table
+    //  itself is used in place
+    const char *base = book_map.Data();
+    const char *end  = base + book_map.Length();
+    const char *p    = base;
+    if( !book_read(p,end,&ui,sizeof(ui)) || ui != MAGIC )
+    {
+        error_msg.Printf( "File %s is not a book file", pgn_compiled_in );
+        error = true;
     }
     if( !error )
     {
-        fread( &ui, sizeof(ui), 1, infile );
-        if( ui != BOOK_HASH_NBR )
+        if( !book_read(p,end,&ui,sizeof(ui)) || ui != VERSION )
         {
-            error_msg.Printf( "File %s uses book format hash number %u, not supported by this program",
+            error_msg.Printf( "File %s uses book format version %u, not supported by this program",
                                  pgn_compiled_in, ui );
             error = true;
         }
     }
+    if( !error && !book_read(p,end,&ui,sizeof(ui)) )
+        error = true;
     if( !error )
     {
-        fread( &ui, sizeof(ui), 1, infile );
         unsigned int nbr=ui;
         for( unsigned int i=0; !error && i<nbr; i++ )
         {
             char buf[1024];
-            fread( &ui, sizeof(ui), 1, infile );
-            if( ui==0 || ui>sizeof(buf)-3 )
+            if( !book_read(p,end,&ui,sizeof(ui)) || ui==0 || ui>sizeof(buf)-3 || !book_read(p,end,buf,ui) )
             {
                 error_msg.Printf( "File %s has an illegal predefined position label",
                                      pgn_compiled_in );
@@ -1169,91 +1516,49 @@ bool Book::LoadCompiled( wxString &error_msg, wxString &pgn_compiled_file )
             }
             else
             {
-                fread( buf, ui, 1, infile );
                 buf[ui] = '\0';
                 predefined_labels.Add(buf);
-            }
-            fread( &ui, sizeof(ui), 1, infile );
-            if( ui==0 || ui>sizeof(buf)-3 )
-            {
-                error_msg.Printf( "File %s has an illegal predefined position fen",
-                                     pgn_compiled_in );
-                error = true;
-            }
-            else
-            {
-                fread( buf, ui, 1, infile );
-                buf[ui] = '\0';
-                predefined_fens.Add(buf);
+                if( !book_read(p,end,&ui,sizeof(ui)) || ui==0 || ui>sizeof(buf)-3 || !book_read(p,end,buf,ui) )
+                {
+                    error_msg.Printf( "File %s has an illegal predefined position fen",
+                                         pgn_compiled_in );
+                    error = true;
+                }
+                else
+                {
+                    buf[ui] = '\0';
+                    predefined_fens.Add(buf);
+                }
             }
         }
     }
+    uint32_t nbr_slots=0, nbr_positions=0, nbr_succ=0;
     if( !error )
     {
-        ChessRules cr2;
-        for( ;; )
+        if( !book_read(p,end,&nbr_slots,sizeof(nbr_slots)) || !book_read(p,end,&nbr_positions,sizeof(nbr_positions)) ||
+            !book_read(p,end,&nbr_succ,sizeof(nbr_succ)) ||
+            nbr_slots==0 || (nbr_slots&(nbr_slots-1))!=0 || nbr_positions>=nbr_slots )
+            error = true;
+        else
         {
-            // Read a hash idx and a non-zero number of BookPositions for that hash idx
-            unsigned short hash;
-            fread( &hash, sizeof(hash), 1, infile );
-            unsigned int ui;
-            fread( &ui, sizeof(ui), 1, infile );
-            if( ui == 0 )
-                break;  // zero len vector terminates
-
-            // Loop adding BookPositions
-            for( unsigned int i=0; i<ui; i++ )
-            {
-                BookPosition       bp;  
-                BookPositionInFile bpif;
-                fread( &bpif, sizeof(BookPositionInFile), 1, infile );
-                bp.cpos  = bpif.cpos;
-                bp.play_position_count = 0;
-                unsigned long count = bpif.count;
-
-                // Reverse the 32->16 bit compression
-                // Compress a 32 bit count into a 16 bit count, sacrificing
-                //  accuracy for large values
-                if( count > 64294)
-                    count = 64294;  // largest number algorithm copes with
-                if( count > 60000 )             // [64294->4294,000,000 (almost 2^32)]
-                {
-                    count -= 60000;             // 64000->4000
-                    count = (count*1000000);    // 4000->4000,000,000
-                }
-                else if( count > 50000 )        // (60,000->1000,000,000)
-                {
-                    count -= 50000;             // 59000->9000
-                    count = (count*100000);     // 9000->900,000,000
-                }
-                else if( count > 40000 )        // (50,000->100,000,000)
-                {
-                    count -= 40000;             // 49000->9000
-                    count = (count*10000);      // 9000->90,000,000
-                }
-                else if( count > 30000 )        // (40,000->10,000,000)
-                {
-                    count -= 30000;             // 39000->9000
-                    count = (count*1000);       // 9000->9,000,000
-                }
-                else if( count > 20000 )        // (30,000->1,000,000)
-                {
-                    count -= 20000;             // 29000->9000
-                    count = (count*100);        // 9000->900,000
-                }
-                else if( count > 10000 )        // (20,000->100,000)
-                {
-                    count -= 10000;             // 19000->9000
-                    count = (count*10);         // 9000->90,000
-                }
-                // else 9000->9000 (no loss of accuracy from 0-10000)
-                bp.count  = count;
-                bucket[hash].push_back( bp );
-            }
+            long offset = p-base;
+            if( offset % 64 )
+                p += 64 - offset%64;
+            if( end-p < (long)(nbr_slots*sizeof(BookSlot) + nbr_succ*sizeof(BookSuccessor)) )
+                error = true;
         }
+        if( error )
+            error_msg.Printf( "File %s has an illegal hash table", pgn_compiled_in );
+    }
+    if( error )
+        book_map.Close();
+    else
+    {
+        table = (const BookSlot *)p;
+        table_msk = nbr_slots-1;
+        successors = (const BookSuccessor *)(p + nbr_slots*sizeof(BookSlot));
+        nbr_successors = nbr_succ;
     }
-    if( infile )
-        fclose( infile );
 	return error;
 }
 
@@ -1262,39 +1567,33 @@ bool Book::Lookup( ChessPosition &pos, vector<BookMove> &bmoves )
 {
     bool found = false;
     //if( pos.squares[c4]=='P' && pos.squares[f3]=='N' && pos.squares[d5]=='p' )
-    if( objs.repository->book.m_enabled )
+    if( objs.repository->book.m_enabled && polyglot.IsLoaded() )
+        found = polyglot.Lookup( pos, bmoves );
+    else if( objs.repository->book.m_enabled && table )
     {
         bmoves.clear();
-        vector<Move> moves;
-        ChessRules cr = pos;
-        cr.GenLegalMoveList( moves );
-        for( unsigned int i=0; i<moves.size(); i++ )
+        CompressedPosition cpos;
+        pos.Compress( cpos );
+        uint32_t idx = book_slot_hash(cpos) & table_msk;
+        for( ; table[idx].nbr_successors; idx = (idx+1) & table_msk )
         {
-            Move move = moves[i];
-            cr = pos;
-            cr.PlayMove( move );
-            CompressedPosition cpos;
-            unsigned short hash = BOOK_HASH_MSK & cr.Compress( cpos );
-            vector<BookPosition>::iterator it;
-            if( bucket[hash].size() )
+            const BookSlot &slot = table[idx];
+            if( 0 == memcmp(&cpos,&slot.cpos,sizeof(cpos)) )
             {
-                for( it = bucket[hash].begin(); it != bucket[hash].end(); it++ )
+                if( slot.successors+slot.nbr_successors > nbr_successors )
+                    break;  // corrupt
+                for( uint32_t i=slot.successors; i<slot.successors+slot.nbr_successors; i++ )
                 {
-                    if( 0 == memcmp(&cpos,&it->cpos,sizeof(cpos)) )
-                    {
-                        found = true;
-                        BookMove bm;
-                        bm.move = move;
-                        bm.count = it->count;
-                        bm.play_position_count = &it->play_position_count;
-                        bmoves.push_back(bm);
-                        break;
-                    }
+                    BookMove bm;
+                    bm.move = successors[i].move;
+                    bm.count = successors[i].count;
+                    bm.play_position_count = &play_position_counts[i];
+                    bmoves.push_back(bm);
                 }
+                found = true;   // already in order of popularity
+                break;
             }
         }
-        if( found )
-            sort( bmoves.rbegin(), bmoves.rend() );
     }
     return found;
 }
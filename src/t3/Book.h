@@ -12,7 +12,12 @@
 #include "wx/progdlg.h"
 #include "DebugPrintf.h"
 #include "ChessRules.h"
+#include "MemoryMap.h"
+#include "PolyglotBook.h"
+#include <stdint.h>
 #include <vector>
+#include <map>
+#include <atomic>
 #include <algorithm>
 
 // Representation of a book move
@@ -35,9 +40,14 @@ public:
     // Constructor
     Book();
 
-    // Load Book, Return bool error
+    // Load Book (a .pgn, or a Polyglot .bin if so configured), Return bool error
     bool Load( wxString &error_msg, wxString &pgn_file );
 
+    // Compile a book from a list of .pgn files and directories of them, on
+    //  worker threads. If add, keep the positions already in the compiled
+    //  book, so only new games need be parsed. Return bool error
+    bool CompileMulti( wxString &error_msg, wxArrayString &sources, wxString &pgn_compiled_file, bool add=false );
+
     // Get predefined positions from book, Return bool error
     bool Predefined( wxArrayString &labels, wxArrayString &fens );
 
@@ -49,19 +59,28 @@ public:
 
 private:
 
-    // A position that appears in the book
+    // A position that appears in the book, while compiling
     struct BookPosition
     {
         thc::CompressedPosition cpos;
         unsigned int           count;                   // how many times it appears in the book
-        unsigned int           play_position_count;     // how often it has appeared on board in human-engine session
     };
 
-    // A position that appears in the book, without session stat
-    struct BookPositionInFile
+    // A slot in the compiled book's open addressed hash table, two to a
+    //  cache line. The table is used directly from the memory mapped file.
+    //  Only positions with book moves have a slot
+    struct BookSlot
     {
         thc::CompressedPosition cpos;
-        unsigned short         count;
+        uint32_t               successors;              // index of first book move
+        uint32_t               nbr_successors;          // 0 = empty slot
+    };
+
+    // A book move from a BookSlot position, most popular first
+    struct BookSuccessor
+    {
+        thc::Move              move;
+        uint32_t               count;                   // BookPosition::count of the resulting position
     };
 
     // TODO make these modern C++ consts
@@ -87,6 +106,8 @@ private:
     char event  [ BOOK_BUFLEN + 10];
     char site   [ BOOK_BUFLEN + 10];
     char move_order_type[BOOK_BUFLEN + 10];
+    char comment_buf[10000];
+    int  nag_value;
 
     // Misc
     bool fen_flag;
@@ -96,9 +117,27 @@ private:
     FILE *file_inc;
     thc::ChessRules chess_rules;
 
-    // All the book positions
+    // All the book positions, while compiling
     std::vector<BookPosition> bucket[BOOK_HASH_NBR];
 
+    // Start positions of [FEN] games, while compiling. Like the standard
+    //  start position they're never reached by a move, so aren't in the buckets
+    std::vector<thc::CompressedPosition> fen_roots;
+
+    // The compiled book, memory mapped
+    MemoryMap book_map;
+    const BookSlot *table;
+    uint32_t table_msk;         // number of slots - 1, a power of two - 1
+    const BookSuccessor *successors;
+    uint32_t nbr_successors;
+
+    // How often each book move has been played in human-engine session,
+    //  indexed by successor. Only moves looked up are here
+    std::map<uint32_t,unsigned int> play_position_counts;
+
+    // Used instead if BookConfig::m_polyglot
+    PolyglotBook polyglot;
+
     // Object state
     enum STATE
     {
@@ -150,6 +189,22 @@ private:
     // Load compiled book. Returns bool error
     bool LoadCompiled( wxString &error_msg, wxString &pgn_compiled_file );
 
+    // Find a position in the buckets, while compiling
+    BookPosition *CompileFind( const thc::ChessPosition &pos );
+
+    // Write compiled book from the buckets. Returns bool error
+    bool WriteCompiled( wxString &error_msg, FILE *outfile, const char *pgn_compiled_out, wxProgressDialog &progress );
+
+    // Recreate the buckets from the mapped compiled book
+    void RebuildBuckets();
+
+    // Add another book's buckets to ours, and empty them
+    void MergeBuckets( Book &other );
+
+    // Shared with CompileMulti() worker threads
+    std::atomic<unsigned long> *compile_bytes;  // bytes parsed
+    std::atomic<bool>          *compile_abort;  // cancelled by user
+
     // Misc helpers
     FILE *debug_log_file();
     bool TestResult( const char *buf );
@@ -163,7 +218,7 @@ private:
     void FileOver();
     void Error( const char *msg );
     //void FatalError( const char *msg );
-    bool Process( FILE *infile, wxProgressDialog &progress );
+    bool Process( FILE *infile, wxProgressDialog *progress );
 
 };
 
@@ -102,8 +102,8 @@ void BookDialog::CreateControls()
 
     // File picker control
     wxString path = dat.m_file;
-    wxFilePickerCtrl *picker = new wxFilePickerCtrl( this, ID_BOOK_PICKER, path, wxT("Select .pgn file for book"),
-        "*.pgn", wxDefaultPosition, wxDefaultSize, 
+    wxFilePickerCtrl *picker = new wxFilePickerCtrl( this, ID_BOOK_PICKER, path, wxT("Select .pgn or Polyglot .bin file for book"),
+        "Book files (*.pgn;*.bin)|*.pgn;*.bin", wxDefaultPosition, wxDefaultSize, 
         wxFLP_USE_TEXTCTRL|wxFLP_OPEN|wxFLP_FILE_MUST_EXIST );    
     box_sizer->Add(picker, 1, wxALIGN_LEFT|wxEXPAND|wxALL, 5);
 
@@ -114,6 +114,13 @@ void BookDialog::CreateControls()
     box_sizer->Add( enabled_box, 0,
         wxALIGN_CENTER_VERTICAL|wxALL, 5);
 
+    // File is a Polyglot book
+    wxCheckBox* polyglot_box = new wxCheckBox( this, ID_POLYGLOT,
+       wxT("&Polyglot .bin book"), wxDefaultPosition, wxDefaultSize, 0 );
+    polyglot_box->SetValue( dat.m_polyglot );
+    box_sizer->Add( polyglot_box, 0,
+        wxALIGN_CENTER_VERTICAL|wxALL, 5);
+
     // Label for the moves limit
     wxStaticText* limit_moves_label = new wxStaticText ( this, wxID_STATIC,
         wxT("&If available always play book moves up until move:"), wxDefaultPosition, wxDefaultSize, 0 );
@@ -180,6 +187,8 @@ void BookDialog::SetDialogValidators()
         wxGenericValidator(& dat.m_enabled));
     FindWindow(ID_SUGGEST)->SetValidator(
         wxGenericValidator(& dat.m_suggest));
+    FindWindow(ID_POLYGLOT)->SetValidator(
+        wxGenericValidator(& dat.m_polyglot));
     FindWindow(ID_LIMIT_MOVES)->SetValidator(
         wxGenericValidator(& dat.m_limit_moves));
     FindWindow(ID_POST_LIMIT_PERCENT)->SetValidator(
@@ -191,6 +200,7 @@ void BookDialog::SetDialogHelp()
 {
     wxString file_help              = wxT("The .pgn file that is used for opening book moves.");
     wxString enabled_help            = wxT("Clear this box to disable the book.");
+    wxString polyglot_help           = wxT("Check this box if the file is a Polyglot .bin book rather than a .pgn file.");
     wxString limit_moves_help        = wxT("Initially always play a book move if available.");
     wxString post_limit_percent_help = wxT("Once limit reached, a book move is only selected a proportion of the time.");
 
@@ -200,6 +210,9 @@ void BookDialog::SetDialogHelp()
     FindWindow(ID_ENABLED)->SetHelpText(enabled_help);
     FindWindow(ID_ENABLED)->SetToolTip(enabled_help);
 
+    FindWindow(ID_POLYGLOT)->SetHelpText(polyglot_help);
+    FindWindow(ID_POLYGLOT)->SetToolTip(polyglot_help);
+
     FindWindow(ID_LIMIT_MOVES)->SetHelpText(limit_moves_help);
     FindWindow(ID_LIMIT_MOVES)->SetToolTip(limit_moves_help);
 
@@ -246,8 +259,9 @@ void BookDialog::OnHelpClick( wxCommandEvent& WXUNUSED(event) )
      */
 
     wxString helpText =
-      wxT("Use this panel to select a .pgn file to use as the\n")
-      wxT("opening book and to setup how the book is used.\n\n")
+      wxT("Use this panel to select a .pgn file (or a Polyglot\n")
+      wxT(".bin file) to use as the opening book and to setup\n")
+      wxT("how the book is used.\n\n")
       wxT("The last two parameters let you control how\n")
       wxT("early or late the engine will start thinking\n")
       wxT("for itself rather than using book moves.\n\n")
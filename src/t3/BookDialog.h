@@ -21,7 +21,8 @@ enum
     ID_SUGGEST            = 10003,
     ID_BOOK_PICKER        = 10004,
     ID_LIMIT_MOVES        = 10005,
-    ID_POST_LIMIT_PERCENT = 10006
+    ID_POST_LIMIT_PERCENT = 10006,
+    ID_POLYGLOT           = 10007
 };
 
 // BookDialog class declaration
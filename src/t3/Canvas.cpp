@@ -23,6 +23,8 @@
 #include "Log.h"
 #include "Session.h"
 #include "Database.h"
+#include "DbPrimitives.h"
+#include "AnalysisCache.h"
 #include "Book.h"
 #include "Tabs.h"
 #include "Repository.h"
@@ -574,6 +576,8 @@ Canvas::Canvas
     objs.book       = new Book;
     objs.cws        = new CentralWorkSaver;
     objs.db         = new Database;
+    objs.analysis_cache = new AnalysisCache;
+    objs.analysis_cache->Open( DB_ANALYSIS_FILE );
     objs.tabs       = new Tabs;
     objs.gl         = NULL;
     GameLogic *gl   = new GameLogic( this, lb );
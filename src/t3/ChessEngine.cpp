@@ -11,6 +11,7 @@
 #include <ctype.h>
 #include <assert.h>
 #include <algorithm>
+#include <thread>
 #include "Portability.h"
 #include "DebugPrintf.h"
 #include "ChessEngine.h"
@@ -31,19 +32,19 @@ using namespace thc;
 //#define THREE_PLY
 #define VARIABLE_PLY
 #define DEFAULT_DEPTH 4
-int  gbl_depth=DEFAULT_DEPTH;
-bool gbl_stop;
+#define INITIAL_KILL_THRESHOLD 800
+std::atomic<bool> gbl_stop;
 #ifdef VARIABLE_PLY
-    #define IF_STOP_RECURSING if( recurse_level>gbl_depth || gbl_stop )
+    #define IF_STOP_RECURSING if( ctx.recurse_level>ctx.depth || *ctx.stop )
 #endif
 #ifdef SIX_PLY
-    #define IF_STOP_RECURSING if( recurse_level>5 )
+    #define IF_STOP_RECURSING if( ctx.recurse_level>5 )
 #endif
 #ifdef FIVE_PLY
-    #define IF_STOP_RECURSING if( recurse_level>4 )
+    #define IF_STOP_RECURSING if( ctx.recurse_level>4 )
 #endif
 #ifdef THREE_PLY
-    #define IF_STOP_RECURSING if( recurse_level>2 )
+    #define IF_STOP_RECURSING if( ctx.recurse_level>2 )
 #endif
 
   #define LEVEL_STOP_SORTING  5 //12000         11500
@@ -59,11 +60,6 @@ bool gbl_stop;
 //#define LEVEL_CAREFUL_SORTING 2 //12031
 //#define LEVEL_CAREFUL_SORTING 1 //12328
 //#define LEVEL_CAREFUL_SORTING 0 //12250
-int DIAG_evaluate_count;
-int DIAG_evaluate_leaf_count;
-int DIAG_make_move_primary;	
-int DIAG_cutoffs;
-int DIAG_deep_cutoffs;
 
 // Utilities
 #ifndef nbrof
@@ -80,28 +76,223 @@ int DIAG_deep_cutoffs;
  ****************************************************************************/
 #define POS_INFINITY  1000000000
 #define NEG_INFINITY -1000000000
-#define MAX_DEPTH 30
-static Move moves[MAX_DEPTH][MAX_DEPTH];   // Obviously all these disgusting static
-static Move pv_array[MAX_DEPTH];           //  arrays mean only once instance of the
-static unsigned int pv_count;               //  ChessEngine type can work at once.
-static int scores[MAX_DEPTH][MAX_DEPTH];    //  This must be fixed in the future
-static int recurse_level;
-static int static_balance;
+#define MAX_DEPTH ENGINE_MAX_DEPTH
+
+/****************************************************************************
+ * Transposition table, remembers what searching a position found so it
+ *  needn't be searched again when it is reached by another move order, and
+ *  so the best move from the previous iteration can be tried first
+ ****************************************************************************/
+#define DEFAULT_HASH_MB 64
+#define TT_BUCKET_SIZE  4       // 4 entries of 16 bytes, one cache line
+#define TT_MAX_SCORE    10000   // mate scores depend on the distance from the
+                                //  root, so aren't stored
+enum TT_BOUND { TT_NONE, TT_EXACT, TT_LOWER, TT_UPPER };
+
+// Each entry stores key^data alongside data, so an entry that is only half
+//  written (or belongs to another position) doesn't match
+struct TT_ENTRY
+{
+    uint64_t check;     // key ^ data
+    uint64_t data;      // move | score<<32 | draft<<54 | bound<<60 | generation<<62
+};
+struct TT_BUCKET
+{
+    TT_ENTRY entries[TT_BUCKET_SIZE];
+};
+struct TT_DATA
+{
+    Move     move;
+    int      score;
+    int      draft;     // depth searched below the position
+    TT_BOUND bound;
+};
+static TT_BUCKET *tt_table;
+static void      *tt_memory;        // tt_table, before alignment
+static uint64_t  tt_mask;           // nbr buckets - 1
+static int       tt_hash_mb = DEFAULT_HASH_MB;
+static int       tt_table_mb;
+static unsigned  tt_generation;
+
+void ChessEngine::SetHash( int hash_mb )
+{
+    tt_hash_mb = hash_mb>0 ? hash_mb : 0;
+}
+
+// Called at the start of each search, (re)allocate the table if the size
+//  has changed and start a new generation, older entries are replaced first
+static void tt_new_search()
+{
+    if( tt_table_mb != tt_hash_mb )
+    {
+        free( tt_memory );
+        tt_memory = NULL;
+        tt_table  = NULL;
+        tt_table_mb = tt_hash_mb;
+        if( tt_hash_mb > 0 )
+        {
+            // Round down to a power of two number of buckets
+            uint64_t nbr_buckets = 1;
+            while( nbr_buckets*2*sizeof(TT_BUCKET) <= (uint64_t)tt_hash_mb*1024*1024 )
+                nbr_buckets *= 2;
+            tt_memory = calloc( (size_t)nbr_buckets*sizeof(TT_BUCKET) + 64, 1 );
+            if( tt_memory )
+            {
+                tt_table = (TT_BUCKET *)( ((uintptr_t)tt_memory + 63) & ~(uintptr_t)63 );
+                tt_mask  = nbr_buckets-1;
+            }
+        }
+    }
+    tt_generation = (tt_generation+1) & 3;
+}
+
+static bool tt_probe( uint64_t key, TT_DATA &tt )
+{
+    TT_BUCKET *bucket = &tt_table[key&tt_mask];
+    for( int i=0; i<TT_BUCKET_SIZE; i++ )
+    {
+        TT_ENTRY e = bucket->entries[i];
+        if( (e.check^e.data) == key && e.data!=0 )
+        {
+            uint32_t imv = (uint32_t)e.data;
+            memcpy( &tt.move, &imv, sizeof(tt.move) );
+            tt.score = (int)((e.data>>32) & 0x3fffff) - 0x200000;
+            tt.draft = (int)((e.data>>54) & 0x3f);
+            tt.bound = (TT_BOUND)((e.data>>60) & 3);
+            return true;
+        }
+    }
+    return false;
+}
+
+static void tt_store( uint64_t key, Move move, int score, int draft, TT_BOUND bound )
+{
+    if( score>=TT_MAX_SCORE || score<=-TT_MAX_SCORE )
+        return;
+    uint32_t imv;
+    memcpy( &imv, &move, sizeof(imv) );
+    uint64_t data = imv |
+                    ((uint64_t)(score+0x200000) << 32) |
+                    ((uint64_t)draft << 54) |
+                    ((uint64_t)bound << 60) |
+                    ((uint64_t)tt_generation << 62);
+
+    // Replace the entry for the same position if there is one, otherwise
+    //  prefer entries from earlier searches, then those searched least deeply
+    TT_BUCKET *bucket = &tt_table[key&tt_mask];
+    TT_ENTRY *replace = &bucket->entries[0];
+    int worst = 1000;
+    for( int i=0; i<TT_BUCKET_SIZE; i++ )
+    {
+        TT_ENTRY *e = &bucket->entries[i];
+        if( (e->check^e->data) == key )
+        {
+            replace = e;
+            break;
+        }
+        int value = (int)((e->data>>54) & 0x3f);
+        if( (unsigned)(e->data>>62) != tt_generation )
+            value -= 100;
+        if( value < worst )
+        {
+            worst = value;
+            replace = e;
+        }
+    }
+    replace->data  = data;
+    replace->check = key ^ data;
+}
+
+/****************************************************************************
+ * Search threads. Every search runs on a SEARCH_CONTEXT of its own, so
+ *  helper threads can search copies of the engine alongside the main one
+ ****************************************************************************/
+static int smp_threads = 1;
+
+void ChessEngine::SetThreads( int nbr_threads )
+{
+    if( nbr_threads <= 0 )
+    {
+        nbr_threads = std::thread::hardware_concurrency();
+        if( nbr_threads <= 0 )
+            nbr_threads = 1;
+    }
+    smp_threads = nbr_threads;
+}
+
+void ChessEngine::NewGame()
+{
+    memset( &ctx, 0, sizeof(ctx) );
+    ctx.depth = DEFAULT_DEPTH;
+    ctx.stop  = &gbl_stop;
+    pv_count = 0;
+    multipv_ml.count = 0;
+    losing_ring[0]  = losing_ring[1]  =  false;
+    winning_ring[0] = winning_ring[1] =  false;
+    ring_idx = 0;
+    killing = INITIAL_KILL_THRESHOLD;
+    for( unsigned int i=0; i<nbrof(multiplier); i++ )
+        multiplier[i] = 0;
+}
+
+void ChessEngine::NewSearch( int balance, int depth )
+{
+    if( depth > MAX_DEPTH-10 )
+        ctx.depth = MAX_DEPTH-10;
+    else
+        ctx.depth = depth;
+    ctx.balance = balance;
+    ctx.recurse_level = 0;
+    ctx.stop = &gbl_stop;
+    pv_count = 0;
+}
+
+int ChessEngine::ScoreSmp( MOVELIST &ml, int &besti )
+{
+    tt_new_search();
+    int nbr_helpers = smp_threads-1;
+    if( nbr_helpers<=0 || tt_table==NULL )
+        return Score( ml, besti );
+
+    // Lazy SMP. The helpers search the same position, every second one a
+    //  ply deeper, and leave what they find in the transposition table for
+    //  the main thread (and each other). Their own results are discarded,
+    //  they are stopped when the main thread finishes
+    std::atomic<bool> helpers_stop(false);
+    vector<ChessEngine> helpers( nbr_helpers, *this );
+    vector<MOVELIST> helper_ml( nbr_helpers, ml );
+    vector<std::thread> threads;
+    for( int t=0; t<nbr_helpers; t++ )
+    {
+        SEARCH_CONTEXT &hctx = helpers[t].ctx;
+        hctx.stop = &helpers_stop;
+        if( t%2==0 && hctx.depth<MAX_DEPTH-10 )
+            hctx.depth++;
+        threads.push_back( std::thread( [&helpers,&helper_ml,t]()
+        {
+            int helper_besti;
+            helpers[t].Score( helper_ml[t], helper_besti );
+        } ) );
+    }
+    int score = Score( ml, besti );
+    helpers_stop = true;
+    for( unsigned int t=0; t<threads.size(); t++ )
+        threads[t].join();
+    return score;
+}
+
+/****************************************************************************
+ * Calculate a new move
+ ****************************************************************************/
 bool ChessEngine::CalculateNextMove( bool &only_move, int &score, Move &move, int balance, int depth )
 {
     MOVELIST ml;
     gbl_stop = false;
     only_move = false;
     bool have_move=true;
-    if( depth > MAX_DEPTH-10 )
-        gbl_depth = MAX_DEPTH-10;
-    else
-        gbl_depth = depth;
+    NewSearch( balance, depth );
     //Planning();
 	GenLegalMoveListSorted( &ml );
-    recurse_level  = 0;
-    static_balance = balance;
-    pv_count = 0;
 	int besti;
     if( ml.count == 0 )
     {
@@ -116,13 +307,13 @@ bool ChessEngine::CalculateNextMove( bool &only_move, int &score, Move &move, in
         PushMove( ml.moves[0] );
 		int material, positional;
 		EvaluateLeaf(material,positional);
-		score = material*static_balance + positional;
+		score = material*ctx.balance + positional;
         PopMove( ml.moves[0] );
         pv_array[0] = ml.moves[besti];
         pv_count = 1;
     }
     else
-        score = Score( ml, besti );
+        score = ScoreSmp( ml, besti );
 
 	// Copy best move to caller
 	if( besti == -1 )
@@ -136,31 +327,31 @@ bool ChessEngine::CalculateNextMove( bool &only_move, int &score, Move &move, in
 
 	    for( int i=0; i<MAX_DEPTH; i++ )
 	    {
-		    if( moves[i][0].src == moves[i][0].dst )
+		    if( ctx.moves[i][0].src == ctx.moves[i][0].dst )
 			    break;
-		    DebugPrintf(( "%d: score %d, %c%c-%c%c\n", i, scores[i][0],
-					       FILE(moves[i][0].src),
-		                   RANK(moves[i][0].src),
-		                   FILE(moves[i][0].dst),
-		                   RANK(moves[i][0].dst) ));
+		    DebugPrintf(( "%d: score %d, %c%c-%c%c\n", i, ctx.scores[i][0],
+					       FILE(ctx.moves[i][0].src),
+		                   RANK(ctx.moves[i][0].src),
+		                   FILE(ctx.moves[i][0].dst),
+		                   RANK(ctx.moves[i][0].dst) ));
 	    }
 	    DebugPrintf(( "DIAG_make_move_primary=%d\n"
 				     "DIAG_evaluate_count=%d\n"
 				     "DIAG_evaluate_leaf_count=%d\n"
 				     "DIAG_cutoffs=%d\n"
 				     "DIAG_deep_cutoffs=%d\n",
-				     DIAG_make_move_primary,
+				     ctx.DIAG_make_move_primary,
 				     0,//DIAG_evaluate_count,
 				     0,//DIAG_evaluate_leaf_count,
-				     DIAG_cutoffs, 
-				     DIAG_deep_cutoffs	));
+				     ctx.DIAG_cutoffs, 
+				     ctx.DIAG_deep_cutoffs	));
 	    for( int i=0; i<MAX_DEPTH; i++ )
 	    {
-		    if( moves[i][0].src == moves[i][0].dst )
+		    if( ctx.moves[i][0].src == ctx.moves[i][0].dst )
 			    break;
-            if( i>0 && scores[i][0]!=scores[i-1][0] )
+            if( i>0 && ctx.scores[i][0]!=ctx.scores[i-1][0] )
                 break;
-            pv_array[i] = moves[i][0];
+            pv_array[i] = ctx.moves[i][0];
             pv_count++;
         }
     }
@@ -174,19 +365,14 @@ bool ChessEngine::CalculateNextMove( bool &only_move, int &score, Move &move, in
 bool ChessEngine::CalculateNextMove( int &score, Move &move, int balance, int depth, bool first )
 {
     bool have_move=true;
-	static MOVELIST ml;
+	MOVELIST &ml = multipv_ml;
     if( first )
     {
         gbl_stop = false;
-        if( depth > MAX_DEPTH-10 )
-            gbl_depth = MAX_DEPTH-10;
-        else
-            gbl_depth = depth;
         //Planning();
 	    GenLegalMoveListSorted( &ml );
     }
-    static_balance = balance;
-    recurse_level  = 0;
+    NewSearch( balance, depth );
 	int besti;
     if( ml.count == 0 )
     {
@@ -194,7 +380,7 @@ bool ChessEngine::CalculateNextMove( int &score, Move &move, int balance, int de
         score = 0;
     }
     else
-        score = Score( ml, besti );
+        score = ScoreSmp( ml, besti );
 
 	// Copy best move to caller
     pv_count = 0;
@@ -213,31 +399,31 @@ bool ChessEngine::CalculateNextMove( int &score, Move &move, int balance, int de
         ml.count--;
 	    for( int i=0; i<MAX_DEPTH; i++ )
 	    {
-		    if( moves[i][0].src == moves[i][0].dst )
+		    if( ctx.moves[i][0].src == ctx.moves[i][0].dst )
 			    break;
-		    DebugPrintf(( "%d: score %d, %c%c-%c%c\n", i, scores[i][0],
-					       FILE(moves[i][0].src),
-		                   RANK(moves[i][0].src),
-		                   FILE(moves[i][0].dst),
-		                   RANK(moves[i][0].dst) ));
+		    DebugPrintf(( "%d: score %d, %c%c-%c%c\n", i, ctx.scores[i][0],
+					       FILE(ctx.moves[i][0].src),
+		                   RANK(ctx.moves[i][0].src),
+		                   FILE(ctx.moves[i][0].dst),
+		                   RANK(ctx.moves[i][0].dst) ));
 	    }
 	    DebugPrintf(( "DIAG_make_move_primary=%d\n"
 				     "DIAG_evaluate_count=%d\n"
 				     "DIAG_evaluate_leaf_count=%d\n"
 				     "DIAG_cutoffs=%d\n"
 				     "DIAG_deep_cutoffs=%d\n",
-				     DIAG_make_move_primary,
+				     ctx.DIAG_make_move_primary,
 				     0,//DIAG_evaluate_count,
 				     0,//DIAG_evaluate_leaf_count,
-				     DIAG_cutoffs, 
-				     DIAG_deep_cutoffs	));
+				     ctx.DIAG_cutoffs, 
+				     ctx.DIAG_deep_cutoffs	));
 	    for( int i=0; i<MAX_DEPTH; i++ )
 	    {
-		    if( moves[i][0].src == moves[i][0].dst )
+		    if( ctx.moves[i][0].src == ctx.moves[i][0].dst )
 			    break;
-            if( i>0 && scores[i][0]!=scores[i-1][0] )
+            if( i>0 && ctx.scores[i][0]!=ctx.scores[i-1][0] )
                 break;
-            pv_array[i] = moves[i][0];
+            pv_array[i] = ctx.moves[i][0];
             pv_count++;
         }
     }
@@ -253,13 +439,7 @@ bool ChessEngine::CalculateNextMove( MOVELIST &ml, bool &only_move, int &score,
     gbl_stop = false;
     only_move = false;
     bool have_move=true;
-    if( depth > MAX_DEPTH-10 )
-        gbl_depth = MAX_DEPTH-10;
-    else
-        gbl_depth = depth;
-    recurse_level  = 0;
-    static_balance = balance;
-    pv_count = 0;
+    NewSearch( balance, depth );
     if( ml.count == 0 )
     {
         besti = -1;
@@ -273,13 +453,13 @@ bool ChessEngine::CalculateNextMove( MOVELIST &ml, bool &only_move, int &score,
         PushMove( ml.moves[0] );
 		int material, positional;
 		EvaluateLeaf(material,positional);
-		score = material*static_balance + positional;
+		score = material*ctx.balance + positional;
         PopMove( ml.moves[0] );
         pv_array[0] = ml.moves[0];
         pv_count = 1;
     }
     else
-        score = Score( ml, besti );
+        score = ScoreSmp( ml, besti );
 
 	// Copy best move to caller
 	if( besti == -1 )
@@ -288,31 +468,31 @@ bool ChessEngine::CalculateNextMove( MOVELIST &ml, bool &only_move, int &score,
     {
 	    for( int i=0; i<MAX_DEPTH; i++ )
 	    {
-		    if( moves[i][0].src == moves[i][0].dst )
+		    if( ctx.moves[i][0].src == ctx.moves[i][0].dst )
 			    break;
-		    DebugPrintf(( "%d: score %d, %c%c-%c%c\n", i, scores[i][0],
-					       FILE(moves[i][0].src),
-		                   RANK(moves[i][0].src),
-		                   FILE(moves[i][0].dst),
-		                   RANK(moves[i][0].dst) ));
+		    DebugPrintf(( "%d: score %d, %c%c-%c%c\n", i, ctx.scores[i][0],
+					       FILE(ctx.moves[i][0].src),
+		                   RANK(ctx.moves[i][0].src),
+		                   FILE(ctx.moves[i][0].dst),
+		                   RANK(ctx.moves[i][0].dst) ));
 	    }
 	    DebugPrintf(( "DIAG_make_move_primary=%d\n"
 				     "DIAG_evaluate_count=%d\n"
 				     "DIAG_evaluate_leaf_count=%d\n"
 				     "DIAG_cutoffs=%d\n"
 				     "DIAG_deep_cutoffs=%d\n",
-				     DIAG_make_move_primary,
+				     ctx.DIAG_make_move_primary,
 				     0,//DIAG_evaluate_count,
 				     0,//DIAG_evaluate_leaf_count,
-				     DIAG_cutoffs, 
-				     DIAG_deep_cutoffs	));
+				     ctx.DIAG_cutoffs, 
+				     ctx.DIAG_deep_cutoffs	));
 	    for( int i=0; i<MAX_DEPTH; i++ )
 	    {
-		    if( moves[i][0].src == moves[i][0].dst )
+		    if( ctx.moves[i][0].src == ctx.moves[i][0].dst )
 			    break;
-            if( i>0 && scores[i][0]!=scores[i-1][0] )
+            if( i>0 && ctx.scores[i][0]!=ctx.scores[i-1][0] )
                 break;
-            pv_array[i] = moves[i][0];
+            pv_array[i] = ctx.moves[i][0];
             pv_count++;
         }
     }
@@ -349,24 +529,11 @@ bool ChessEngine::CalculateNextMove( bool new_game, vector<Move> &pv, Move &best
     bool only_move = false;
     int score=0;
     unsigned long previous_elapsed=0;
-    static bool winning_ring[2];
-    static bool losing_ring[2];
-    static int ring_idx;
-    static int killing;
-    const int initial_kill_threshold = 800;
     const int bump_kill_threshold = 10; // must show trend else stop chopping search
-    static int multiplier[30];
 
     DebugPrintfInner( "CNM: new_game = %s\n", new_game?"true":"false" );
     if( new_game )
-    {
-        losing_ring[0]  = losing_ring[1]  =  false;
-        winning_ring[0] = winning_ring[1] =  false;
-        ring_idx = 0;
-        killing = initial_kill_threshold;
-        for( int i=0; i<30; i++ )
-            multiplier[i] = 0;
-    }
+        NewGame();
 
     for( depth=1; depth<20; depth++ ) // depth+=2 )
     {    
@@ -487,9 +654,9 @@ bool ChessEngine::CalculateNextMove( bool new_game, vector<Move> &pv, Move &best
                 break;
 
             // If we are better, test whether the current best move will repeat
-            static Move save_history[256];          // must be 256 ..
+            Move save_history[256];          // must be 256 ..
             unsigned char save_history_idx;  // .. so this can loop around
-            static DETAIL save_detail_stack[256];   // must be 256 ..
+            DETAIL save_detail_stack[256];   // must be 256 ..
             unsigned char save_detail_idx;   // .. so this can loop around
             memcpy(save_history,history,sizeof(history));
             memcpy(save_detail_stack,detail_stack,sizeof(detail_stack));
@@ -555,7 +722,7 @@ bool ChessEngine::CalculateNextMove( bool new_game, vector<Move> &pv, Move &best
     else if( losing_ring[0] && losing_ring[1] )
         killing += bump_kill_threshold;
     else
-        killing = initial_kill_threshold;
+        killing = INITIAL_KILL_THRESHOLD;
     DebugPrintfInner( "CNM: winning_ring[0]=%s\n", winning_ring[0]?"true":"false" );
     DebugPrintfInner( "CNM: winning_ring[1]=%s\n", winning_ring[1]?"true":"false" );
     DebugPrintfInner( "CNM: losing_ring[0]=%s\n",  losing_ring[0]?"true":"false" );
@@ -577,6 +744,7 @@ bool ChessEngine::IsRepitition()
     //  PopMove() calls as we search backwards (i.e. squares, white,
     //  detail, detail_idx)
     bool save_white = white;
+    uint64_t save_zobrist = zobrist;
     char save_squares[sizeof(squares)];
     memcpy( save_squares, squares, sizeof(save_squares) );
     unsigned char save_detail_idx = detail_idx;  // must be unsigned char
@@ -617,6 +785,7 @@ bool ChessEngine::IsRepitition()
     detail_idx = save_detail_idx;
     DETAIL_RESTORE;
     white      = save_white;
+    zobrist    = save_zobrist;
     return repitition;
 }
 
@@ -631,10 +800,6 @@ void ChessEngine::GetPV( vector<Move> &pv )
 }
 
 
-#ifdef ALPHA_BETA
-int alpha[MAX_DEPTH];   // Todo get rid of all the crazy static vars!!
-int beta[MAX_DEPTH];
-#endif
 /****************************************************************************
  * Score a position
  ****************************************************************************/
@@ -644,8 +809,8 @@ int ChessEngine::Score( MOVELIST &ml, int &besti )
 	#ifdef ALPHA_BETA
     for( int i=0; i<MAX_DEPTH; i++ )
     {
-        alpha[i] = NEG_INFINITY;    // best white score to date
-        beta[i]  = POS_INFINITY;    // best black score to date
+        ctx.alpha[i] = NEG_INFINITY;    // best white score to date
+        ctx.beta[i]  = POS_INFINITY;    // best black score to date
     }
 	#endif
     if( white )
@@ -668,6 +833,66 @@ const char *indent( int recurse_level )
 static unsigned long tag_generator;
 #endif
 
+// Look up the position for a node at recurse_level. Returns true with score
+//  set if the stored result makes searching the position unnecessary, given
+//  the window lo,hi the node is searched with (the best scores white and
+//  black are already assured of by its ancestors, they are also returned
+//  to classify the result when it is stored). Otherwise returns any stored
+//  best move in tt_move
+static bool tt_lookup( SEARCH_CONTEXT &ctx, uint64_t key, int draft, bool white_node, int &lo, int &hi, Move &tt_move, int &score )
+{
+    lo = NEG_INFINITY;
+    hi = POS_INFINITY;
+    #ifdef ALPHA_BETA
+    for( int j=ctx.recurse_level-(white_node?2:1); j>=0; j-=2 )
+    {
+        if( ctx.alpha[j] > lo )
+            lo = ctx.alpha[j];
+    }
+    for( int j=ctx.recurse_level-(white_node?1:2); j>=0; j-=2 )
+    {
+        if( ctx.beta[j] < hi )
+            hi = ctx.beta[j];
+    }
+    #endif
+    TT_DATA tt;
+    if( !tt_probe(key,tt) )
+        return false;
+    tt_move = tt.move;
+
+    // Not at the root, it must come up with a move from its own list
+    if( ctx.recurse_level>1 && tt.draft>=draft &&
+        ( tt.bound==TT_EXACT ||
+         (tt.bound==TT_LOWER && tt.score>=hi) ||
+         (tt.bound==TT_UPPER && tt.score<=lo) ) )
+    {
+        // The PV ends here
+        int l = ctx.recurse_level-1;
+        ctx.scores[l][l] = tt.score;
+        ctx.moves [l][l] = tt.move;
+        for( int j=l+1; j<MAX_DEPTH; j++ )
+            ctx.moves[j][l].Invalid();
+        score = tt.score;
+        return true;
+    }
+    return false;
+}
+
+// Search the transposition table's best move first
+static void tt_move_first( MOVELIST &ml, Move tt_move )
+{
+    for( int i=1; i<ml.count; i++ )
+    {
+        if( ml.moves[i] == tt_move )
+        {
+            for( ; i>0; i-- )
+                ml.moves[i] = ml.moves[i-1];
+            ml.moves[0] = tt_move;
+            break;
+        }
+    }
+}
+
 int ChessEngine::ScoreWhiteToMove( MOVELIST &ml, int &besti, int black_mobility )
 {
     int white_mobility = ml.count;
@@ -677,20 +902,34 @@ int ChessEngine::ScoreWhiteToMove( MOVELIST &ml, int &besti, int black_mobility
 	int i, score=0, temp;
     int max  = NEG_INFINITY;
     besti = -1;
-    recurse_level++;
+    ctx.recurse_level++;
 	#ifdef ALPHA_BETA
-    alpha[recurse_level] =  NEG_INFINITY;    // best white score to date
-    beta[recurse_level]  =  POS_INFINITY;    // best black score to date
+    ctx.alpha[ctx.recurse_level] =  NEG_INFINITY;    // best white score to date
+    ctx.beta[ctx.recurse_level]  =  POS_INFINITY;    // best black score to date
 	#endif
+
+    // Transposition table. Not used where the moves are scored as leaves,
+    //  those scores depend on black_mobility as well as the position
+    uint64_t key = Zobrist();
+    int draft = ctx.depth - ctx.recurse_level + 1;
+    bool use_tt = (tt_table!=NULL && draft>0);
+    int lo, hi;
+    Move tt_move;
+    tt_move.Invalid();
+    if( use_tt && tt_lookup(ctx,key,draft,true,lo,hi,tt_move,score) )
+    {
+        ctx.recurse_level--;
+        return score;
+    }
     #ifdef EXTRA_DEBUG_CODE1
     unsigned long tag = tag_generator++;
-    if( recurse_level < LEVEL_CAREFUL_SORTING )
+    if( ctx.recurse_level < LEVEL_CAREFUL_SORTING )
     {
-        DebugPrintf(( "%sScoreWhiteToMove() [%lu], sorted [", indent(recurse_level), tag ));
+        DebugPrintf(( "%sScoreWhiteToMove() [%lu], sorted [", indent(ctx.recurse_level), tag ));
         CarefulSort( ml );
     }
     else
-        DebugPrintf(( "%sScoreWhiteToMove() [%lu], not sorted [", indent(recurse_level), tag ));
+        DebugPrintf(( "%sScoreWhiteToMove() [%lu], not sorted [", indent(ctx.recurse_level), tag ));
 	for( i=0; i<ml.count; i++  )
 	{
         Move move;
@@ -701,9 +940,11 @@ int ChessEngine::ScoreWhiteToMove( MOVELIST &ml, int &besti, int black_mobility
     }
     DebugPrintf(( "]\n" ));
     #else
-    if( recurse_level < LEVEL_CAREFUL_SORTING )
+    if( ctx.recurse_level < LEVEL_CAREFUL_SORTING )
         CarefulSort( ml );
     #endif
+	if( use_tt )
+		tt_move_first( ml, tt_move );
 	for( i=0; !prune && i<ml.count; i++  )
 	{
         #ifdef EXTRA_DEBUG_CODE1
@@ -711,39 +952,39 @@ int ChessEngine::ScoreWhiteToMove( MOVELIST &ml, int &besti, int black_mobility
         move = ml.moves[i];
         std::string nmove;
         nmove = move.NaturalOut( this );
-        DebugPrintf(( "%sScoreWhiteToMove() [%lu], playing .%s\n", indent(recurse_level), tag, nmove.c_str() ));
+        DebugPrintf(( "%sScoreWhiteToMove() [%lu], playing .%s\n", indent(ctx.recurse_level), tag, nmove.c_str() ));
         #endif
 		PushMove( ml.moves[i] );
-		DIAG_make_move_primary++;	
+		ctx.DIAG_make_move_primary++;	
 		//if( (recurse_level>=7) || (recurse_level>4 && i>=ml.scount)  )
 		//if( (recurse_level>=8) || (recurse_level>4 && i>=ml.scount && !AttackedPiece(bking)) )
         IF_STOP_RECURSING
 		{
             #ifdef VARIABLE_PLY
-            if( gbl_stop )
+            if( *ctx.stop )
                 DebugPrintf(("Stop command received\n" ));
             #endif
 			int material, positional;
 			EvaluateLeaf(material,positional);
-			score = material*static_balance + positional + (white_mobility-black_mobility)/4;
+			score = material*ctx.balance + positional + (white_mobility-black_mobility)/4;
             #ifdef EXTRA_DEBUG_CODE1
             DebugPrintf(( "%s [%lu] Leaf score: score=%d: (material=%d, positional=%d, white_mobility=%d, black_mobility=%d)\n",
-                            indent(recurse_level), tag, score, material, positional, white_mobility, black_mobility ));
+                            indent(ctx.recurse_level), tag, score, material, positional, white_mobility, black_mobility ));
             #endif
         }
 		else
 		{
 			bool okay = Evaluate(&ml2,score_terminal);
-			//bool okay = Evaluate(recurse_level>=LEVEL_CAREFUL_SORTING-1,&ml2,score_terminal);
-			//bool okay = Evaluate(recurse_level<LEVEL_STOP_SORTING,&ml2,score_terminal);
+			//bool okay = Evaluate(ctx.recurse_level>=LEVEL_CAREFUL_SORTING-1,&ml2,score_terminal);
+			//bool okay = Evaluate(ctx.recurse_level<LEVEL_STOP_SORTING,&ml2,score_terminal);
 			if( !okay )
 				score = NEG_INFINITY;
 			else
 			{
 				switch( score_terminal )
     			{
-	    			case TERMINAL_WCHECKMATE: score=-10000*(MAX_DEPTH-recurse_level);       break;
-		    		case TERMINAL_BCHECKMATE: score=10000*(MAX_DEPTH-recurse_level);        break;
+	    			case TERMINAL_WCHECKMATE: score=-10000*(MAX_DEPTH-ctx.recurse_level);       break;
+		    		case TERMINAL_BCHECKMATE: score=10000*(MAX_DEPTH-ctx.recurse_level);        break;
 					case TERMINAL_WSTALEMATE: score=0;										break;
     				case TERMINAL_BSTALEMATE: score=0;										break;
 	    			case 0: 				  score = ScoreBlackToMove( ml2, temp, white_mobility );		break;
@@ -751,58 +992,64 @@ int ChessEngine::ScoreWhiteToMove( MOVELIST &ml, int &besti, int black_mobility
 			}
             #ifdef EXTRA_DEBUG_CODE1
             DebugPrintf(( "%s [%lu] Recursion score: score=%d\n",
-                            indent(recurse_level), tag, score ));
+                            indent(ctx.recurse_level), tag, score ));
             #endif
 		}
         if( score > max )
         {
             #ifdef EXTRA_DEBUG_CODE1
             DebugPrintf(( "%s [%lu] New max: score=%d, previous max=%d\n",
-                            indent(recurse_level), tag, score, max ));
+                            indent(ctx.recurse_level), tag, score, max ));
             #endif
 			#ifdef ALPHA_BETA
-            for( int j=recurse_level-1; j>=0 ; j-=2 )
+            for( int j=ctx.recurse_level-1; j>=0 ; j-=2 )
             {   
-                if( score > beta[j] )
+                if( score > ctx.beta[j] )
                 {
                     prune = true;
-					DIAG_cutoffs++;
+					ctx.DIAG_cutoffs++;
                     #ifdef EXTRA_DEBUG_CODE1
-                    DebugPrintf(( "%s [%lu] Beta %s: score=%d, beta[%d] = %d\n",
-                                    indent(recurse_level), tag, j!=recurse_level-1?"deep prune":"prune",
-                                    score, j, beta[j] ));
+                    DebugPrintf(( "%s [%lu] Beta %s: score=%d, ctx.beta[%d] = %d\n",
+                                    indent(ctx.recurse_level), tag, j!=ctx.recurse_level-1?"deep prune":"prune",
+                                    score, j, ctx.beta[j] ));
                     #endif
-					if( j != recurse_level-1 )
-						DIAG_deep_cutoffs++;
+					if( j != ctx.recurse_level-1 )
+						ctx.DIAG_deep_cutoffs++;
                     break;
                 }
             }
-            if( score > alpha[recurse_level] )
+            if( score > ctx.alpha[ctx.recurse_level] )
             {
                 #ifdef EXTRA_DEBUG_CODE1
-                DebugPrintf(( "%s [%lu] Alpha update: score=%d > old alpha[%d] = %d\n",
-                                indent(recurse_level), tag,
-                                score, recurse_level, alpha[recurse_level] ));
+                DebugPrintf(( "%s [%lu] Alpha update: score=%d > old ctx.alpha[%d] = %d\n",
+                                indent(ctx.recurse_level), tag,
+                                score, ctx.recurse_level, ctx.alpha[ctx.recurse_level] ));
                 #endif
-                alpha[recurse_level] = score;
+                ctx.alpha[ctx.recurse_level] = score;
             }
 			#endif
             max   = score;
             besti = i;
 			{
-				int l = recurse_level-1;
-				scores[l][l] = max;
-				moves [l][l] = ml.moves[besti];
+				int l = ctx.recurse_level-1;
+				ctx.scores[l][l] = max;
+				ctx.moves [l][l] = ml.moves[besti];
 				for( int j=l+1; j<MAX_DEPTH; j++ )
 				{
-					scores[j][l] = scores[j][l+1];
-					moves [j][l] = moves [j][l+1];
+					ctx.scores[j][l] = ctx.scores[j][l+1];
+					ctx.moves [j][l] = ctx.moves [j][l+1];
 				}
 			}
         }
 	 	PopMove( ml.moves[i] );
     }
-    recurse_level--;
+
+    // Store the result, unless abandoned part way through. Not at the root,
+    //  its move list may have had moves removed (see the Multi-PV and
+    //  repitition avoidance versions of CalculateNextMove())
+    if( use_tt && ctx.recurse_level>1 && besti>=0 && !*ctx.stop )
+        tt_store( key, ml.moves[besti], max, draft, max>=hi ? TT_LOWER : (max<=lo ? TT_UPPER : TT_EXACT) );
+    ctx.recurse_level--;
     return( max );
 }
 
@@ -847,7 +1094,7 @@ void ChessEngine::CarefulSort( MOVELIST &ml )
         PushMove( ml.moves[i] );
    		int material, positional;
 		EvaluateLeaf(material,positional);
-        buf[i].score = material*static_balance + positional;
+        buf[i].score = material*ctx.balance + positional;
         buf[i].ptr   = &ml.moves[i];
         PopMove( ml.moves[i] );
     }
@@ -878,20 +1125,34 @@ int ChessEngine::ScoreBlackToMove( MOVELIST &ml, int &besti, int white_mobility
 	int i, score=0, temp;
     int min = POS_INFINITY;
     besti = -1;
-    recurse_level++;
+    ctx.recurse_level++;
 	#ifdef ALPHA_BETA
-    alpha[recurse_level] =  NEG_INFINITY;    // best white score to date
-    beta[recurse_level]  =  POS_INFINITY;    // best black score to date
+    ctx.alpha[ctx.recurse_level] =  NEG_INFINITY;    // best white score to date
+    ctx.beta[ctx.recurse_level]  =  POS_INFINITY;    // best black score to date
 	#endif
+
+    // Transposition table. Not used where the moves are scored as leaves,
+    //  those scores depend on white_mobility as well as the position
+    uint64_t key = Zobrist();
+    int draft = ctx.depth - ctx.recurse_level + 1;
+    bool use_tt = (tt_table!=NULL && draft>0);
+    int lo, hi;
+    Move tt_move;
+    tt_move.Invalid();
+    if( use_tt && tt_lookup(ctx,key,draft,false,lo,hi,tt_move,score) )
+    {
+        ctx.recurse_level--;
+        return score;
+    }
     #ifdef EXTRA_DEBUG_CODE1
     unsigned long tag = tag_generator++;
-    if( recurse_level < LEVEL_CAREFUL_SORTING )
+    if( ctx.recurse_level < LEVEL_CAREFUL_SORTING )
     {
-        DebugPrintf(( "%sScoreBlackToMove() [%lu], sorted [", indent(recurse_level), tag ));
+        DebugPrintf(( "%sScoreBlackToMove() [%lu], sorted [", indent(ctx.recurse_level), tag ));
         CarefulSort( ml );
     }
     else
-        DebugPrintf(( "%sScoreBlackToMove() [%lu], not sorted [", indent(recurse_level), tag ));
+        DebugPrintf(( "%sScoreBlackToMove() [%lu], not sorted [", indent(ctx.recurse_level), tag ));
 	for( i=0; i<ml.count; i++  )
 	{
         Move move;
@@ -902,9 +1163,11 @@ int ChessEngine::ScoreBlackToMove( MOVELIST &ml, int &besti, int white_mobility
     }
     DebugPrintf(( "]\n" ));
     #else
-    if( recurse_level < LEVEL_CAREFUL_SORTING )
+    if( ctx.recurse_level < LEVEL_CAREFUL_SORTING )
         CarefulSort( ml );
     #endif
+	if( use_tt )
+		tt_move_first( ml, tt_move );
 	for( i=0; !prune && i<ml.count; i++  )
 	{
         #ifdef EXTRA_DEBUG_CODE1
@@ -912,39 +1175,39 @@ int ChessEngine::ScoreBlackToMove( MOVELIST &ml, int &besti, int white_mobility
         move = ml.moves[i];
         std::string nmove;
         nmove = move.NaturalOut( this );
-        DebugPrintf(( "%sScoreBlackToMove() [%lu], playing %s\n", indent(recurse_level), tag, nmove.c_str() ));
+        DebugPrintf(( "%sScoreBlackToMove() [%lu], playing %s\n", indent(ctx.recurse_level), tag, nmove.c_str() ));
         #endif
 		PushMove( ml.moves[i] );
-		DIAG_make_move_primary++;	
+		ctx.DIAG_make_move_primary++;	
 		//if( (recurse_level>=7) || (recurse_level>4 && i>=ml.scount)  )
 		//if( (recurse_level>=8) || (recurse_level>4 && i>=ml.scount && !AttackedPiece(wking_square)) )
         IF_STOP_RECURSING
 		{
             #ifdef VARIABLE_PLY
-            if( gbl_stop )
+            if( *ctx.stop )
                 DebugPrintf(("Stop command received\n" ));
             #endif
 			int material, positional;
 			EvaluateLeaf(material,positional);
-			score = material*static_balance + positional + (white_mobility-black_mobility)/4;
+			score = material*ctx.balance + positional + (white_mobility-black_mobility)/4;
             #ifdef EXTRA_DEBUG_CODE1
             DebugPrintf(( "%s [%lu] Leaf score: score=%d: (material=%d, positional=%d, white_mobility=%d, black_mobility=%d)\n",
-                            indent(recurse_level), tag, score, material, positional, white_mobility, black_mobility ));
+                            indent(ctx.recurse_level), tag, score, material, positional, white_mobility, black_mobility ));
             #endif
         }
 		else
 		{
 			bool okay = Evaluate(&ml2,score_terminal);
-			//bool okay = Evaluate(recurse_level>=LEVEL_CAREFUL_SORTING-1,&ml2,score_terminal);
-			//bool okay = Evaluate(recurse_level<LEVEL_STOP_SORTING,&ml2,score_terminal);
+			//bool okay = Evaluate(ctx.recurse_level>=LEVEL_CAREFUL_SORTING-1,&ml2,score_terminal);
+			//bool okay = Evaluate(ctx.recurse_level<LEVEL_STOP_SORTING,&ml2,score_terminal);
 			if( !okay )
 				score = POS_INFINITY;
 			else
 			{
 				switch( score_terminal )
     			{
-	    			case TERMINAL_WCHECKMATE: score=-10000*(20-recurse_level);				break;
-		    		case TERMINAL_BCHECKMATE: score=10000*(20-recurse_level);				break;
+	    			case TERMINAL_WCHECKMATE: score=-10000*(20-ctx.recurse_level);				break;
+		    		case TERMINAL_BCHECKMATE: score=10000*(20-ctx.recurse_level);				break;
 					case TERMINAL_WSTALEMATE: score=0;										break;
     				case TERMINAL_BSTALEMATE: score=0;										break;
 	    			case 0: 				  score = ScoreWhiteToMove( ml2, temp, black_mobility );		break;
@@ -952,58 +1215,64 @@ int ChessEngine::ScoreBlackToMove( MOVELIST &ml, int &besti, int white_mobility
 			}
             #ifdef EXTRA_DEBUG_CODE1
             DebugPrintf(( "%s [%lu] Recursion score: score=%d\n",
-                            indent(recurse_level), tag, score ));
+                            indent(ctx.recurse_level), tag, score ));
             #endif
 		}
         if( score < min )
         {
             #ifdef EXTRA_DEBUG_CODE1
             DebugPrintf(( "%s [%lu] New min: score=%d, previous min=%d\n",
-                            indent(recurse_level), tag, score, min ));
+                            indent(ctx.recurse_level), tag, score, min ));
             #endif
 			#ifdef ALPHA_BETA
-            for( int j=recurse_level-1; j>=0 ; j-=2 )
+            for( int j=ctx.recurse_level-1; j>=0 ; j-=2 )
             {
-                if( score < alpha[j] )
+                if( score < ctx.alpha[j] )
                 {
                     prune = true;
-					DIAG_cutoffs++;
+					ctx.DIAG_cutoffs++;
                     #ifdef EXTRA_DEBUG_CODE1
-                    DebugPrintf(( "%s [%lu] Alpha %s: score=%d, alpha[%d] = %d\n",
-                                    indent(recurse_level), tag, j!=recurse_level-1?"deep prune":"prune",
-                                    score, j, alpha[j] ));
+                    DebugPrintf(( "%s [%lu] Alpha %s: score=%d, ctx.alpha[%d] = %d\n",
+                                    indent(ctx.recurse_level), tag, j!=ctx.recurse_level-1?"deep prune":"prune",
+                                    score, j, ctx.alpha[j] ));
                     #endif
-					if( j != recurse_level-1 )
-						DIAG_deep_cutoffs++;
+					if( j != ctx.recurse_level-1 )
+						ctx.DIAG_deep_cutoffs++;
                     break;
                 }
             }
-            if( score < beta[recurse_level] )
+            if( score < ctx.beta[ctx.recurse_level] )
             {
                 #ifdef EXTRA_DEBUG_CODE1
-                DebugPrintf(( "%s [%lu] Beta update: score=%d < old beta[%d] = %d\n",
-                                indent(recurse_level), tag,
-                                score, recurse_level, beta[recurse_level] ));
+                DebugPrintf(( "%s [%lu] Beta update: score=%d < old ctx.beta[%d] = %d\n",
+                                indent(ctx.recurse_level), tag,
+                                score, ctx.recurse_level, ctx.beta[ctx.recurse_level] ));
                 #endif
-                beta[recurse_level] = score;
+                ctx.beta[ctx.recurse_level] = score;
             }
 			#endif
             min   = score;
             besti = i;
 			{
-				int l = recurse_level-1;
-				scores[l][l] = min;
-				moves [l][l] = ml.moves[besti];
+				int l = ctx.recurse_level-1;
+				ctx.scores[l][l] = min;
+				ctx.moves [l][l] = ml.moves[besti];
 				for( int j=l+1; j<MAX_DEPTH; j++ )
 				{
-					scores[j][l] = scores[j][l+1];
-					moves [j][l] = moves [j][l+1];
+					ctx.scores[j][l] = ctx.scores[j][l+1];
+					ctx.moves [j][l] = ctx.moves [j][l+1];
 				}
 			}
         }
 	 	PopMove( ml.moves[i] );
     }
-    recurse_level--;
+
+    // Store the result, unless abandoned part way through. Not at the root,
+    //  its move list may have had moves removed (see the Multi-PV and
+    //  repitition avoidance versions of CalculateNextMove())
+    if( use_tt && ctx.recurse_level>1 && besti>=0 && !*ctx.stop )
+        tt_store( key, ml.moves[besti], min, draft, min>=hi ? TT_LOWER : (min<=lo ? TT_UPPER : TT_EXACT) );
+    ctx.recurse_level--;
     return( min );
 }
 
@@ -6,12 +6,33 @@
  ****************************************************************************/
 #ifndef CHESSENGINE_H
 #define CHESSENGINE_H
+#include <atomic>
+#include <vector>
 #include "ChessEvaluation.h"
 
 // TripleHappyChess
 namespace thc
 {
 
+#define ENGINE_MAX_DEPTH 30
+
+// Search state. Each search thread has its own (in its own copy of the
+//  engine), only the transposition table is shared between them
+struct SEARCH_CONTEXT
+{
+    Move moves [ENGINE_MAX_DEPTH][ENGINE_MAX_DEPTH];    // PV of each level in
+    int  scores[ENGINE_MAX_DEPTH][ENGINE_MAX_DEPTH];    //  its own column
+    int  alpha[ENGINE_MAX_DEPTH];   // best white score to date at each level
+    int  beta [ENGINE_MAX_DEPTH];   // best black score to date at each level
+    int  recurse_level;
+    int  depth;
+    int  balance;
+    std::atomic<bool> *stop;        // abandon the search when set
+    int  DIAG_make_move_primary;
+    int  DIAG_cutoffs;
+    int  DIAG_deep_cutoffs;
+};
+
 class ChessEngine: public ChessEvaluation
 {
 public:
@@ -19,11 +40,13 @@ public:
     // Default contructor
     ChessEngine() : ChessEvaluation() 
     {
+        NewGame();
     }
 
     // Copy constructor
     ChessEngine( const ChessPosition& src ) : ChessEvaluation( src ) 
     {
+        NewGame();
     }
 
     // Assignment operator
@@ -50,6 +73,15 @@ public:
     // Retrieve PV (primary variation?), call after CalculateNextMove()
     void GetPV( std::vector<Move> &pv );
 
+    // Size of the transposition table in megabytes, like the Hash setting
+    //  for UCI engines (0 for no table). Takes effect at the next search
+    static void SetHash( int hash_mb );
+
+    // Number of threads to search with (0 for one per core). Helper threads
+    //  search the same position as the main thread, slightly deeper or not,
+    //  and speed it up by sharing the transposition table ("Lazy SMP")
+    static void SetThreads( int nbr_threads );
+
     // Run test(s)
     void Test();
 
@@ -60,6 +92,31 @@ private:
     //#
     //###################################
 
+    // Search state, and what the last search found
+    SEARCH_CONTEXT ctx;
+    Move pv_array[ENGINE_MAX_DEPTH];
+    unsigned int pv_count;
+
+    // Multi-PV mode's move list, moves are removed as they are reported
+    MOVELIST multipv_ml;
+
+    // Repitition avoidance version's record of recent scores, used to cut
+    //  thinking short when the game is clearly won or lost
+    bool winning_ring[2];
+    bool losing_ring[2];
+    int  ring_idx;
+    int  killing;
+    int  multiplier[30];
+
+    // Clear everything remembered from earlier searches
+    void NewGame();
+
+    // Set up ctx for a new search
+    void NewSearch( int balance, int depth );
+
+    // Score(), with helper threads if configured
+    int ScoreSmp( MOVELIST &ml, int &besti );
+
     // Internal version for repitition avoidance
     bool CalculateNextMove( MOVELIST &ml, bool &only_move, int &score, int &besti, int balance, int depth );
 
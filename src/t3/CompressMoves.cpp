@@ -95,7 +95,7 @@ CompressMoves & CompressMoves::operator= (const CompressMoves & copy_from_me )
     }
     for( int i=0; i<64; i++ )
     {
-        Tracker *p = copy_from_me.trackers[64];
+        Tracker *p = copy_from_me.trackers[i];
         Tracker *q=0;
         if( p )
         {
@@ -7,13 +7,17 @@
 #define _CRT_SECURE_NO_DEPRECATE
 #include <stdio.h>
 #include <stdlib.h>
+#include <map>
+#include <algorithm>
 #include "thc.h"
 #include "Portability.h"
 #include "DebugPrintf.h"
 #include "sqlite3.h"
 #include "CompressMoves.h"
 #include "DbPrimitives.h"
+#include "PositionIndex.h"
 #include "Database.h"
+#include "DbQuery.h"
 #include "wx/msgout.h"
 #include "wx/progdlg.h"
 
@@ -24,21 +28,65 @@ static sqlite3 *gbl_handle;
 // A prepared statement for fetching from positions table
 static sqlite3_stmt *gbl_stmt;
 
-// Whereabouts we are in the virtual list control
-static int gbl_expected;
-
 // Whereabouts we are in the virtual list control
 static int gbl_current;
 
 // Number of elements in the virtual list control
 static int gbl_count;
 
+// GetRow() reads the rows of an SQL query a page at a time. Each page is found
+//  with a keyset seek, starting from the nearest row whose sort key we know,
+//  either end of the list or a page boundary row read earlier, so scrolling in
+//  either direction or jumping to the end doesn't make SQLite step over every
+//  row before the one we want. The sort key is (white,rowid) for the start
+//  position, game_id otherwise.
+// Note that unlike the count, pages are still fetched on the GUI thread,
+//  because the virtual list control asks for row text synchronously, see
+//  FetchPage() for how long that can take
+#define PAGE_SIZE 100
+#define MAX_PAGES 16
+struct DB_PAGE_ROW
+{
+    std::string white;
+    bool white_null;    // NULL sorts before any string
+    sqlite3_int64 rowid;
+    int game_id;
+};
+static std::map< int, std::vector<DB_PAGE_ROW> > gbl_pages;
+
+// Sort keys of the first and last rows of every page passed over so far,
+//  indexed by row. Unlike gbl_pages these are never dropped, a jump to a part
+//  of the list we haven't visited walks from the nearest one (recording more
+//  as it goes) and a jump to a page we've seen before needs no walk at all
+static std::map< int, DB_PAGE_ROW > gbl_row_keys;
+
+// Optional position index file, when present and up to date position queries
+//  are answered from it and SQLite is only used to fetch the game rows
+static PositionIndex gbl_index;
+
+// True if the current query is being answered from the position index, the
+//  matching games are streamed from a posting list in list control order
+static bool gbl_use_index;
+static PostingCursor gbl_index_cursor;
+
+// Set if the move_stats table exists and has been populated
+static bool gbl_has_move_stats;
+
+// Set if games refer to the players table by white_id and black_id
+static bool gbl_has_players;
+
+// Runs the slow queries in the background, with its own connection
+static DbQuery gbl_query;
+
+// Kind of position keys in the database, see db_position_key()
+static DB_KEY_KIND gbl_key_kind = DB_KEY_SQUARES;
+
 // The position we are looking for
 thc::ChessPosition gbl_position;
 uint64_t gbl_hash;
 void db_set_gbl_position( thc::ChessPosition &pos )   // FIXME this is an abomination
 {
-    uint64_t hash = pos.Hash64Calculate();
+    uint64_t hash = db_position_key( gbl_key_kind, pos );
     gbl_hash = hash;
     gbl_position = pos;
 }
@@ -52,11 +100,67 @@ Database::Database()
     
     // If connection failed, handle returns NULL
     tprintf( "DATABASE CONSTRUCTOR %s\n", retval ? "FAILED" : "SUCCESSFUL" );
+
+    // Databases built before Zobrist keys were introduced use squares only keys
+    sqlite3_stmt *stmt;
+    if( !retval && 0 == sqlite3_prepare_v2( gbl_handle, "PRAGMA user_version", -1, &stmt, 0 ) )
+    {
+        if( sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_int(stmt,0) == DB_KEY_ZOBRIST )
+            gbl_key_kind = DB_KEY_ZOBRIST;
+        sqlite3_finalize(stmt);
+    }
+    tprintf( "POSITION KEYS %s\n", gbl_key_kind==DB_KEY_ZOBRIST ? "ZOBRIST" : "SQUARES ONLY" );
+
+    // Use the position index only if it was built from the database as it is
+    //  now. Any write to the database since then changes the file change
+    //  counter, the games checks catch a database rebuilt from scratch that
+    //  happens to arrive at the same counter
+    if( !retval && gbl_index.Open(DB_INDEX_FILE) )
+    {
+        int max_game_id = -1;
+        int nbr_games = -1;
+        if( 0 == sqlite3_prepare_v2( gbl_handle, "SELECT MAX(game_id), COUNT(*) FROM games", -1, &stmt, 0 ) )
+        {
+            if( sqlite3_step(stmt) == SQLITE_ROW )
+            {
+                max_game_id = sqlite3_column_int(stmt,0);
+                nbr_games   = sqlite3_column_int(stmt,1);
+            }
+            sqlite3_finalize(stmt);
+        }
+        if( max_game_id != gbl_index.MaxGameId() || nbr_games != gbl_index.NbrGames() ||
+            db_file_change_counter(DB_FILE) != gbl_index.ChangeCounter() || gbl_index.KeyKind() != gbl_key_kind )
+        {
+            tprintf( "POSITION INDEX OUT OF DATE, IGNORED\n" );
+            gbl_index.Close();
+        }
+        else
+            tprintf( "POSITION INDEX LOADED\n" );
+    }
+
+    // Databases built before the move_stats table was introduced don't have it
+    if( !retval && 0 == sqlite3_prepare_v2( gbl_handle, "SELECT 1 FROM move_stats LIMIT 1", -1, &stmt, 0 ) )
+    {
+        gbl_has_move_stats = (sqlite3_step(stmt) == SQLITE_ROW);
+        sqlite3_finalize(stmt);
+    }
+    tprintf( "MOVE STATS %s\n", gbl_has_move_stats ? "AVAILABLE" : "NOT AVAILABLE" );
+
+    // Databases built before the players table (or its white_games_before
+    //  column) was introduced don't have it
+    if( !retval && 0 == sqlite3_prepare_v2( gbl_handle, "SELECT white_id, white_games_before FROM games, players WHERE player_id=white_id LIMIT 1", -1, &stmt, 0 ) )
+    {
+        gbl_has_players = true;
+        sqlite3_finalize(stmt);
+    }
+    if( !retval )
+        gbl_query.Open(DB_FILE);
 }
 
 Database::~Database()
 {
     cprintf( "DATABASE DESTRUCTOR\n" );
+    gbl_query.Close();
 #if 0
     if( gbl_stmt )
     {
@@ -78,16 +182,26 @@ int Database::SetPosition( thc::ChessRules &cr )
 }
 
 
-int Database::SetPosition( thc::ChessRules &cr, std::string &player_name )
+// Set up for a new position, returns the number of matching games if that is
+//  known already, otherwise count_query is the SQL to count them
+int Database::PositionQuery( thc::ChessRules &cr, std::string &player_name, std::string &count_query )
 {
+    count_query = "";
     if( !gbl_handle )
         return 0;
-    gbl_expected = -1;
+    if( gbl_stmt )
+    {
+        sqlite3_finalize(gbl_stmt);
+        gbl_stmt = NULL;
+    }
+    gbl_pages.clear();
+    gbl_row_keys.clear();
+    gbl_use_index = false;
     int game_count = 0;
     this->player_name = player_name;
     
     //cr.Forsyth("r1bqk2r/ppp1bppp/2n1pn2/3p4/Q1PP4/P3PN2/1P1N1PPP/R1B1KB1R b KQkq - 0 7");
-    gbl_hash = cr.Hash64Calculate();
+    gbl_hash = db_position_key( gbl_key_kind, cr );
     gbl_position = cr;
     
     // select matching rows from the table
@@ -99,8 +213,18 @@ int Database::SetPosition( thc::ChessRules &cr, std::string &player_name )
     hash = (int)(temp);
     thc::ChessPosition start_pos;
     is_start_pos = false;
+
+    // Filter on the integer player_id rather than the name
+    int player_id = -1;
+    if( player_name.length()>0 && gbl_has_players )
+        player_id = PlayerId(player_name);
     if( player_name.length() == 0 )
         where_white="";
+    else if( gbl_has_players )
+    {
+        sprintf( buf, " WHERE games.white_id=%d", player_id );
+        where_white = buf;
+    }
     else
     {
         where_white = " WHERE games.white='";
@@ -109,6 +233,11 @@ int Database::SetPosition( thc::ChessRules &cr, std::string &player_name )
     }
     if( player_name.length() == 0 )
         white_and = "";
+    else if( gbl_has_players )
+    {
+        sprintf( buf, "games.white_id=%d AND ", player_id );
+        white_and = buf;
+    }
     else
     {
         white_and = "games.white='";
@@ -116,15 +245,41 @@ int Database::SetPosition( thc::ChessRules &cr, std::string &player_name )
         white_and += + "' AND ";
     }
     if( cr == start_pos )
-    {
         is_start_pos = true;
+    else if( player_name.length()==0 && gbl_index.IsOpen() )
+    {
+        // No SQL needed, the position index has the game_ids in order
+        gbl_use_index = true;
+        game_count = gbl_index.Find( gbl_hash, gbl_index_cursor );
+        tprintf( "Game count = %d (position index)\n", game_count );
+        gbl_count = game_count;
+        return game_count;
+    }
+    if( is_start_pos )
+    {
         sprintf( buf, "SELECT COUNT(*) from games%s", where_white.c_str() );
     }
     else
     {
-        sprintf( buf, "SELECT COUNT(*) from games, positions_%d WHERE %spositions_%d.position_hash=%d AND games.game_id = positions_%d.game_id",
-                table_nbr, white_and.c_str(), table_nbr, hash, table_nbr );
+        // A game is counted once, even if it reaches the position more than once
+        if( white_and.length() == 0 )
+            sprintf( buf, "SELECT COUNT(DISTINCT game_id) from positions_%d WHERE position_hash=%d", table_nbr, hash );
+        else
+            sprintf( buf, "SELECT COUNT(DISTINCT positions_%d.game_id) from games, positions_%d WHERE %spositions_%d.position_hash=%d AND games.game_id = positions_%d.game_id",
+                table_nbr, table_nbr, white_and.c_str(), table_nbr, hash, table_nbr );
     }
+    count_query = buf;
+    gbl_count = 0;
+    return 0;
+}
+
+int Database::SetPosition( thc::ChessRules &cr, std::string &player_name )
+{
+    std::string count_query;
+    int game_count = PositionQuery( cr, player_name, count_query );
+    if( count_query.length() == 0 )
+        return game_count;
+    const char *buf = count_query.c_str();
     //sprintf( buf, "SELECT COUNT(*) from games, positions_%d WHERE games.white = 'Carlsen, Magnus'  AND positions_%d.position_hash=%d AND games.game_id = positions_%d.game_id", table_nbr, table_nbr, hash, table_nbr );
     //    sprintf( buf, "SELECT COUNT(*) from games JOIN positions_%d ON games.game_id = positions_%d.game_id WHERE games.white = 'Carlsen, Magnus' AND positions_%d.position_hash=%d", table_nbr, table_nbr, table_nbr, hash );
     //    sprintf( buf, "SELECT COUNT(*) from positions_%d WHERE position_hash=%d", table_nbr, hash );
@@ -210,19 +365,19 @@ static int virtual_dump_game( DB_GAME_INFO *info, int game_id )
                 {
                     // sqlite3_column_text returns a const void* , typecast it to const char*
                     const char *val = (const char*)sqlite3_column_text(stmt,col);
-                    info->white = val;
+                    info->white = val ? val : "";
                     break;
                 }
                 case 1:
                 {
                     const char *val = (const char*)sqlite3_column_text(stmt,col);
-                    info->black = val;
+                    info->black = val ? val : "";
                     break;
                 }
                 case 2:
                 {
                     const char *val = (const char*)sqlite3_column_text(stmt,col);
-                    info->result = val;
+                    info->result = val ? val : "*";
                     break;
                 }
                 case 3:
@@ -242,19 +397,62 @@ static int virtual_dump_game( DB_GAME_INFO *info, int game_id )
     return 0;
 }
 
+// If we know the ply where the game reaches the searched position, play
+//  through to it without calculating a hash after every move. Checks the
+//  position with a single full hash calculation at the end, in case the ply
+//  was found for some other position. Returns bool found
+static bool fast_forward( DB_GAME_INFO *info, CompressMoves &press, const char *&blob, int &nbr )
+{
+    if( info->ply <= 0 )
+        return false;
+    size_t len = info->str_blob.length();
+    for( int count=0; count<info->ply; count++ )
+    {
+        thc::Move mv;
+        int nbr_used = nbr<len ? press.decompress_move( blob, mv ) : 0;
+        if( nbr_used == 0 )
+            return false;
+        blob += nbr_used;
+        nbr += nbr_used;
+    }
+    return db_position_key( gbl_key_kind, press.cr ) == gbl_hash;
+}
+
 void db_calculate_move_txt( DB_GAME_INFO *info )
 {
     CompressMoves press;
     std::string move_txt;
     size_t len = info->str_blob.length();
     const char *blob = (const char*)info->str_blob.c_str();
-    uint64_t hash = press.cr.Hash64Calculate();
-    bool triggered=(hash==gbl_hash), first=true;
-    for( int count=0, nbr=0; nbr<len; count++ )
+    int count=0, nbr=0;
+    bool triggered = fast_forward( info, press, blob, nbr ), first=true;
+    if( triggered )
+        count = info->ply;
+    else
     {
-        
-        thc::ChessRules cr = press.cr;
+        // Start again, looking for the position the slow way
+        press = CompressMoves();
+        blob = (const char*)info->str_blob.c_str();
+        nbr = 0;
+    }
+    uint64_t hash = db_position_key( gbl_key_kind, press.cr );
+    triggered = triggered || (hash==gbl_hash);
+    for( ; nbr<len; count++ )
+    {
+        // Peek at the move rather than copying the whole ChessRules, while
+        //  it is still to be played press.cr is the position before it
         thc::Move mv;
+        std::string s;
+        if( triggered )
+        {
+            press.decompress_move_stay( blob, mv );
+            s = mv.NaturalOut(&press.cr);
+        }
+        else if( gbl_key_kind != DB_KEY_ZOBRIST )
+        {
+            press.decompress_move_stay( blob, mv );
+            hash = press.cr.Hash64Update( hash, mv );
+        }
         int nbr_used = press.decompress_move( blob, mv );
         if( nbr_used == 0 )
             break;
@@ -262,7 +460,6 @@ void db_calculate_move_txt( DB_GAME_INFO *info )
         nbr += nbr_used;
         if( triggered )
         {
-            std::string s = mv.NaturalOut(&cr);
             if( first )
             {
                 info->next_move = s;
@@ -284,9 +481,13 @@ void db_calculate_move_txt( DB_GAME_INFO *info )
                     break;
                 }
         }
-        hash = cr.Hash64Update( hash, mv );
-        if( hash == gbl_hash )
-            triggered = true;
+        else
+        {
+            if( gbl_key_kind == DB_KEY_ZOBRIST )
+                hash = press.cr.Zobrist();
+            if( hash == gbl_hash )
+                triggered = true;
+        }
     }
     info->move_txt = move_txt;
     //fprintf(f,"\n");
@@ -296,28 +497,60 @@ void db_calculate_move_txt( DB_GAME_INFO *info )
 
 }
 
-// Return index into vector where start position found
+// Return index into vector where start position found. If the game reaches
+//  the position more than once, that's the first time, the same ply as the
+//  position index records
 int db_calculate_move_vector( DB_GAME_INFO *info, std::vector<thc::Move> &moves )
 {
     CompressMoves press;
     size_t len = info->str_blob.length();
     const char *blob = (const char*)info->str_blob.c_str();
-    uint64_t hash = press.cr.Hash64Calculate();
+    uint64_t hash = db_position_key( gbl_key_kind, press.cr );
     moves.clear();
+
+    // If we know the ply, just decompress and check the position there
+    if( info->ply > 0 )
+    {
+        bool found = false;
+        for( int nbr=0; nbr<len;  )
+        {
+            thc::Move mv;
+            int nbr_used = press.decompress_move( blob, mv );
+            if( nbr_used == 0 )
+                break;
+            moves.push_back(mv);
+            blob += nbr_used;
+            nbr += nbr_used;
+            if( (int)moves.size() == info->ply )
+                found = (db_position_key(gbl_key_kind,press.cr) == gbl_hash);
+        }
+        if( found )
+            return info->ply;
+
+        // Otherwise start again, the slow way
+        press = CompressMoves();
+        blob = (const char*)info->str_blob.c_str();
+        moves.clear();
+    }
     int ret=0;
     for( int nbr=0; nbr<len;  )
     {
         thc::Move mv;
-        thc::ChessRules cr = press.cr;
+        if( gbl_key_kind != DB_KEY_ZOBRIST )
+        {
+            press.decompress_move_stay( blob, mv );    // as above, no ChessRules copy
+            hash = press.cr.Hash64Update( hash, mv );
+        }
         int nbr_used = press.decompress_move( blob, mv );
         if( nbr_used == 0 )
             break;
         moves.push_back(mv);
         blob += nbr_used;
         nbr += nbr_used;
-        hash = cr.Hash64Update( hash, mv );
-        if( hash == gbl_hash )
-            ret = moves.size();
+        if( gbl_key_kind == DB_KEY_ZOBRIST )
+            hash = press.cr.Zobrist();
+        if( ret==0 && hash==gbl_hash )
+            ret = (int)moves.size();
     }
     return ret;
 }
@@ -333,138 +566,369 @@ int Database::GetRow( DB_GAME_INFO *info, int row )
         return 0;
     }
     gbl_current = row;
-    cprintf( "db_virtual_row() IN row=%d, expected=%d,%smatch\n", row, gbl_expected, row==gbl_expected?" ":" no " );
+    info->ply = 0;
+    cprintf( "db_virtual_row() IN row=%d\n", row );
     int retval = -1;
     if( !gbl_handle || row>=gbl_count )
     {
         return retval;
     }
-    static int cols;
-    for(;;)
+    if( gbl_use_index )
     {
-        if( row == gbl_expected )
+        int game_id, ply;
+        if( !gbl_index_cursor.Seek( row, game_id, ply ) )
+            return retval;
+        retval = virtual_dump_game( info, game_id );
+        info->game_id = game_id;
+        info->ply = ply;
+        db_calculate_move_txt(info);
+        cprintf( "db_virtual_row() SUCCESS game_id = %d (position index)\n", game_id );
+        return retval;
+    }
+    int page_nbr = row/PAGE_SIZE;
+    if( !FetchPage(page_nbr) )
+        return retval;
+    std::vector<DB_PAGE_ROW> &page = gbl_pages[page_nbr];
+    unsigned int idx = row%PAGE_SIZE;
+    if( idx >= page.size() )
+        return retval;
+    int game_id = page[idx].game_id;
+    retval = virtual_dump_game( info, game_id );
+    info->game_id = game_id;
+    db_calculate_move_txt(info);
+    cprintf( "db_virtual_row() SUCCESS game_id = %d\n", game_id );
+    return retval;
+}
+
+// Build the query for a page of rows. Forward means in list order, from just
+//  after the anchor row, backward means in reverse list order from just
+//  before it. With no anchor, start at the beginning (or end) of the list
+std::string Database::PageQuery( bool forward, bool anchored, bool anchor_null, int limit )
+{
+    char buf[1000];
+    if( is_start_pos )
+    {
+        // Anchor is bound as parameters 1,2 = white, 3 = rowid. Rows with a
+        //  NULL white come first, and need IS NULL tests since NULL compares
+        //  neither less than nor greater than anything
+        std::string where = white_and;
+        if( anchored && forward )
+            where += anchor_null ? "(games.white IS NOT NULL OR games.rowid>?3) AND "
+                                 : "games.white>=?1 AND (games.white>?2 OR games.rowid>?3) AND ";
+        else if( anchored )
+            where += anchor_null ? "games.white IS NULL AND games.rowid<?3 AND "
+                                 : "(games.white IS NULL OR (games.white<=?1 AND (games.white<?2 OR games.rowid<?3))) AND ";
+        sprintf( buf, "SELECT games.white, games.rowid, games.game_id from games WHERE %s1 ORDER BY games.white %s, games.rowid %s LIMIT %d",
+                where.c_str(), forward?"ASC":"DESC", forward?"ASC":"DESC", limit );
+    }
+    else
+    {
+        // Anchor is bound as parameter 1 = game_id. The list is most recent
+        //  game first, so forward is descending game_id
+        uint64_t temp = gbl_hash;
+        int hash = (int)(temp);
+        int table_nbr = (int)((temp>>32)&(NBR_BUCKETS-1));
+        char anchor[100] = "";
+        if( anchored )
+            sprintf( anchor, " AND positions_%d.game_id%s?1", table_nbr, forward?"<":">" );
+        if( white_and.length() == 0 )
+            sprintf( buf, "SELECT DISTINCT '', positions_%d.game_id, positions_%d.game_id from positions_%d WHERE positions_%d.position_hash=%d%s ORDER BY positions_%d.game_id %s LIMIT %d",
+                    table_nbr, table_nbr, table_nbr, table_nbr, hash, anchor, table_nbr, forward?"DESC":"ASC", limit );
+        else
+            sprintf( buf, "SELECT DISTINCT '', positions_%d.game_id, positions_%d.game_id from positions_%d JOIN games ON games.game_id = positions_%d.game_id WHERE %spositions_%d.position_hash=%d%s ORDER BY positions_%d.game_id %s LIMIT %d",
+                    table_nbr, table_nbr, table_nbr, table_nbr, white_and.c_str(), table_nbr, hash, anchor, table_nbr, forward?"DESC":"ASC", limit );
+    }
+    return std::string(buf);
+}
+
+// The player whose games as white start the start position list at or just
+//  before row, and the row their games start at. Returns bool found
+static bool player_first_row( int row, std::string &name, int &first_row )
+{
+    bool found = false;
+    sqlite3_stmt *stmt;
+    if( 0 == sqlite3_prepare_v2( gbl_handle, "SELECT name, white_games_before FROM players WHERE white_games_before<=?1 AND white_games>0 ORDER BY white_games_before DESC LIMIT 1", -1, &stmt, 0 ) )
+    {
+        sqlite3_bind_int( stmt, 1, row );
+        if( sqlite3_step(stmt) == SQLITE_ROW )
         {
-            gbl_expected++;
-            for(;;)
-            {
-                // fetch a row's status
-                retval = sqlite3_step(gbl_stmt);
-                if( retval == SQLITE_ROW )
-                {
-                    // SQLITE_ROW means fetched a row
-                    
-                    // sqlite3_column_text returns a const void* , typecast it to const char*
-                    for( int col=0; col<cols; col++ )
-                    {
-                        const char *val = (const char*)sqlite3_column_text(gbl_stmt,col);
-                        //printf("%s:%s\t",sqlite3_column_name(gbl_stmt,col),val);
-                        if( col == 0 )
-                        {
-                            int game_id = atoi(val);
-                            retval = virtual_dump_game( info, game_id );
-                            db_calculate_move_txt(info);
-                            cprintf( "db_virtual_row() SUCCESS game_id = %d\n", game_id );
-                            return retval;
-                        }
-                    }
-                }
-                else if( retval == SQLITE_DONE )
-                {
-                    // All rows finished
-                    sqlite3_finalize(gbl_stmt);
-                    gbl_stmt = NULL;
-                    gbl_expected = -1;
-                    cprintf( "Limit reached\n");
-                    break;
-                }
-                else
-                {
-                    // Some error encountered
-                    cprintf("SOME ERROR ENCOUNTERED\n");
-                    return retval;
-                }
-            }
+            const char *val = (const char*)sqlite3_column_text(stmt,0);
+            name = val ? val : "";
+            first_row = sqlite3_column_int(stmt,1);
+            found = (val != NULL);
         }
-        else
+        sqlite3_finalize(stmt);
+    }
+    return found;
+}
+
+// Make sure a page of rows is in the cache, returns bool ok. Usually that's
+//  one indexed seek and PAGE_SIZE rows. A jump to a far away part of the list
+//  we haven't visited is different, there's no way to seek to a row number,
+//  so we walk the rows from the nearest known one. In the start position list
+//  with no player filter, the players table tells us where each player's
+//  games start, so that walk is over some of one player's games. For other
+//  lists it's over all the rows between, and the GUI stalls for as long as
+//  that takes (position lists usually come from the position index instead)
+bool Database::FetchPage( int page_nbr )
+{
+    if( gbl_pages.count(page_nbr) )
+        return true;
+    int first = page_nbr*PAGE_SIZE;
+    int nbr = std::min( PAGE_SIZE, gbl_count-first );
+    if( nbr <= 0 )
+        return false;
+
+    // Seek from whichever of the two ends of the list, or the known row keys,
+    //  leaves the fewest rows to walk over. Row -1 is the start of the list and
+    //  row gbl_count is the end, neither needs an anchor
+    bool forward = true;
+    int anchor_row = -1;
+    int skip = first;
+    if( gbl_count-(first+nbr) < skip )
+    {
+        forward = false;
+        anchor_row = gbl_count;
+        skip = gbl_count-(first+nbr);
+    }
+    std::map< int, DB_PAGE_ROW >::iterator it = gbl_row_keys.lower_bound(first+nbr);
+    if( it!=gbl_row_keys.end() && it->first-(first+nbr) < skip )
+    {
+        forward = false;
+        anchor_row = it->first;
+        skip = it->first-(first+nbr);
+    }
+    it = gbl_row_keys.lower_bound(first);
+    if( it != gbl_row_keys.begin() )
+    {
+        --it;
+        if( first-(it->first+1) < skip )
+        {
+            forward = true;
+            anchor_row = it->first;
+            skip = first-(it->first+1);
+        }
+    }
+    bool anchored = (anchor_row>=0 && anchor_row<gbl_count);
+    DB_PAGE_ROW anchor;
+    if( anchored )
+        anchor = gbl_row_keys[anchor_row];
+
+    // Or seek to the first game of the player the page starts in, the anchor
+    //  is just before the first of their games, (name,0)
+    std::string name;
+    int player_row;
+    if( skip>PAGE_SIZE && is_start_pos && gbl_has_players && white_and.length()==0 &&
+        player_first_row(first,name,player_row) && first-player_row < skip )
+    {
+        forward = true;
+        anchor_row = player_row-1;
+        skip = first-player_row;
+        anchored = (anchor_row >= 0);
+        anchor.white = name;
+        anchor.white_null = false;
+        anchor.rowid = 0;
+        anchor.game_id = 0;
+    }
+    std::string query = PageQuery( forward, anchored, anchored && anchor.white_null, skip+nbr );
+    cprintf( "FetchPage(%d) skip %d query: %s\n", page_nbr, skip, query.c_str() );
+    sqlite3_stmt *stmt;
+    int retval = sqlite3_prepare_v2( gbl_handle, query.c_str(), -1, &stmt, 0 );
+    if( retval )
+    {
+        cprintf("SELECTING DATA FROM DB FAILED 2\n");
+        return false;
+    }
+    if( anchored && is_start_pos )
+    {
+        sqlite3_bind_text ( stmt, 1, anchor.white.c_str(), -1, SQLITE_TRANSIENT );
+        sqlite3_bind_text ( stmt, 2, anchor.white.c_str(), -1, SQLITE_TRANSIENT );
+        sqlite3_bind_int64( stmt, 3, anchor.rowid );
+    }
+    else if( anchored )
+        sqlite3_bind_int( stmt, 1, anchor.game_id );
+
+    // Walk over the skipped rows keeping only the sort keys of page boundary
+    //  rows, then keep the page itself
+    std::vector<DB_PAGE_ROW> rows;
+    int row = anchor_row;
+    while( SQLITE_ROW == (retval=sqlite3_step(stmt)) )
+    {
+        row += (forward ? 1 : -1);
+        DB_PAGE_ROW r;
+        const char *val = (const char*)sqlite3_column_text(stmt,0);
+        r.white      = val ? val : "";
+        r.white_null = (val == NULL);
+        r.rowid      = sqlite3_column_int64(stmt,1);
+        r.game_id    = sqlite3_column_int(stmt,2);
+        if( row%PAGE_SIZE==0 || row%PAGE_SIZE==PAGE_SIZE-1 )
+            gbl_row_keys[row] = r;
+        if( row>=first && row<first+nbr )
+            rows.push_back(r);
+    }
+    sqlite3_finalize(stmt);
+    if( retval != SQLITE_DONE )
+    {
+        cprintf("SOME ERROR ENCOUNTERED\n");
+        return false;
+    }
+    if( !forward )
+        std::reverse( rows.begin(), rows.end() );
+
+    // Keep a window of pages, dropping the one furthest from this one
+    if( gbl_pages.size() >= MAX_PAGES )
+    {
+        std::map< int, std::vector<DB_PAGE_ROW> >::iterator furthest = gbl_pages.begin();
+        if( page_nbr-gbl_pages.begin()->first < gbl_pages.rbegin()->first-page_nbr )
+            furthest = --gbl_pages.end();
+        gbl_pages.erase(furthest);
+    }
+    gbl_pages[page_nbr] = rows;
+    return true;
+}
+
+
+// Read game_id, white, black, result, moves columns from a row
+void db_read_game_columns( sqlite3_stmt *stmt, int cols, DB_GAME_INFO &info )
+{
+    // sqlite3_column_text returns a const void* , typecast it to const char*
+    for( int col=0; col<cols; col++ )
+    {
+        if( col == 0 )
+        {
+            const char *val = (const char*)sqlite3_column_text(stmt,col);
+            info.game_id = atoi(val);
+        }
+        else if( col == 1 )
         {
-            // select matching rows from the table
-            char buf[1000];
-            gbl_expected = row;
-            // sprintf( buf, "SELECT game_id from positions WHERE position_hash=%d LIMIT %d,100", gbl_hash, row );
-//            sprintf( buf, "SELECT positions.game_id from positions JOIN games ON games.game_id = positions.game_id AND positions.position_hash=%d ORDER BY games.white LIMIT %d,100", gbl_hash, row );
-            //sprintf( buf, "SELECT positions.game_id from positions JOIN games ON games.game_id = positions.game_id AND positions.position_hash=%d LIMIT %d,100", gbl_hash, row );
-            uint64_t temp = gbl_hash;
-            int hash = (int)(temp);
-            int table_nbr = (int)((temp>>32)&(NBR_BUCKETS-1));
-            // sprintf( buf, "SELECT positions_%d.game_id from positions_%d JOIN games ON games.game_id = positions_%d.game_id AND positions_%d.position_hash=%d LIMIT %d,100",
-            //        table_nbr, table_nbr, table_nbr, table_nbr, hash, row );
-            if( is_start_pos )
+            const char *val = (const char*)sqlite3_column_text(stmt,col);
+            info.white = val ? std::string(val) : "Whoops";
+        }
+        else if( col == 2 )
+        {
+            const char *val = (const char*)sqlite3_column_text(stmt,col);
+            info.black = val ? std::string(val) : "Whoops";
+        }
+        else if( col == 3 )
+        {
+            const char *val = (const char*)sqlite3_column_text(stmt,col);
+            info.result = val ? std::string(val) : "*";
+        }
+        else if( col == 4 )
+        {
+            int len = sqlite3_column_bytes(stmt,col);
+            //fprintf(f,"Move len = %d\n",len);
+            const char *blob = (const char*)sqlite3_column_blob(stmt,col);
+            if( len && blob )
             {
-                sprintf( buf,
-                        "SELECT games.game_id from games%s ORDER BY games.white ASC LIMIT %d,100", where_white.c_str(), row );
+                std::string str_blob(blob,len);
+                info.str_blob = str_blob;
             }
             else
-            {
-                sprintf( buf,
-//#define NO_REVERSE
-#ifdef NO_REVERSE
-                        "SELECT games.game_id from games JOIN positions_%d ON games.game_id = positions_%d.game_id WHERE %spositions_%d.position_hash=%d LIMIT %d,100",
-#else
-                        "SELECT games.game_id from games JOIN positions_%d ON games.game_id = positions_%d.game_id WHERE %spositions_%d.position_hash=%d ORDER BY games.rowid DESC LIMIT %d,100",
-#endif
-                        table_nbr, table_nbr, white_and.c_str(), table_nbr, hash, row );
-            }
-            retval = sqlite3_prepare_v2( gbl_handle, buf, -1, &gbl_stmt, 0 );
-            cprintf( "db_virtual_row() START query: %s\n",buf);
-            if( retval )
-            {
-                cprintf("SELECTING DATA FROM DB FAILED 2\n");
-                return retval;
-            }
-
-            // Read the number of rows fetched
-            cols = sqlite3_column_count(gbl_stmt);
+                info.str_blob = "";
         }
     }
 }
 
-
-int Database::LoadAllGames( std::vector<DB_GAME_INFO> &cache, int nbr_games )
+// Load the games found in the position index, one prepared statement for all
+static int load_games_from_index( std::vector<DB_GAME_INFO> &cache, int nbr_games, wxProgressDialog &progress )
 {
-    gbl_protect_recursion = true;
+    sqlite3_stmt *stmt;
+    int retval = sqlite3_prepare_v2( gbl_handle, "SELECT game_id, white, black, result, moves from games WHERE game_id=?", -1, &stmt, 0 );
+    if( retval )
+    {
+        cprintf("SELECTING DATA FROM DB FAILED 3\n");
+        return retval;
+    }
+    int cols = sqlite3_column_count(stmt);
+    int game_id, ply;
+    gbl_index_cursor.Rewind();
+    while( gbl_index_cursor.Next(game_id,ply) )
+    {
+        sqlite3_bind_int( stmt, 1, game_id );
+        retval = sqlite3_step(stmt);
+        if( retval == SQLITE_ROW )
+        {
+            DB_GAME_INFO info;
+            db_read_game_columns( stmt, cols, info );
+            info.ply = ply;
+            cache.push_back( info );
+            retval = SQLITE_DONE;
+        }
+        sqlite3_reset(stmt);
+        if( retval != SQLITE_DONE )
+        {
+            // Some error encountered
+            cprintf("SOME ERROR ENCOUNTERED\n");
+            break;
+        }
+        int percent = (cache.size()*100) / (nbr_games?nbr_games:1);
+        if( percent < 1 )
+            percent = 1;
+        if( !progress.Update( percent>100 ? 100 : percent ) )
+        {
+            cache.clear();
+            break;
+        }
+    }
+    sqlite3_finalize(stmt);
+    cprintf("LoadAllGames(): %u game_ids loaded (position index)\n", cache.size() );
+    return retval;
+}
 
-    wxProgressDialog progress( "Loading games", "Loading games", 100, NULL,
-                              wxPD_APP_MODAL+
-                              wxPD_AUTO_HIDE+
-                              wxPD_ELAPSED_TIME+
-                              wxPD_CAN_ABORT+
-                              wxPD_ESTIMATED_TIME );
-    
-    int retval=-1;
-    cache.clear();
-    
+// The SQL to read all the games for the current position, in list order
+std::string Database::GamesQuery()
+{
     // select matching rows from the table
     char buf[1000];
-    gbl_expected = -1;
     uint64_t temp = gbl_hash;
     int hash = (int)(temp);
     int table_nbr = (int)((temp>>32)&(NBR_BUCKETS-1));
     if( is_start_pos )
     {
         sprintf( buf,
-                "SELECT games.game_id from games%s ORDER BY games.white ASC", where_white.c_str() );
+                "SELECT games.game_id, games.white, games.black, games.result, games.moves from games%s ORDER BY games.white ASC, games.rowid ASC", where_white.c_str() );
     }
     else
     {
-        sprintf( buf,
 #ifdef NO_REVERSE
+        sprintf( buf,
                 "SELECT games.game_id, games.white, games.black, games.result, games.moves from games, positions_%d WHERE games.game_id = positions_%d.game_id AND %spositions_%d.position_hash=%d",
                 //"SELECT games.game_id, games.white, games.black, games.result, games.moves from games JOIN positions_%d ON games.game_id = positions_%d.game_id WHERE %spositions_%d.position_hash=%d",
+                table_nbr, table_nbr, white_and.c_str(), table_nbr, hash);
 #else
-                "SELECT games.game_id, games.white, games.black, games.result, games.moves from games JOIN positions_%d ON games.game_id = positions_%d.game_id WHERE %spositions_%d.position_hash=%d ORDER BY games.rowid DESC",
+        // Each game once, even if it reaches the position more than once
+        sprintf( buf,
+                "SELECT games.game_id, games.white, games.black, games.result, games.moves from games WHERE %sgames.game_id IN (SELECT game_id FROM positions_%d WHERE position_hash=%d) ORDER BY games.rowid DESC",
+                white_and.c_str(), table_nbr, hash);
 #endif
-                table_nbr, table_nbr, white_and.c_str(), table_nbr, hash);
     }
+    return std::string(buf);
+}
+
+int Database::LoadAllGames( std::vector<DB_GAME_INFO> &cache, int nbr_games )
+{
+    gbl_protect_recursion = true;
+
+    wxProgressDialog progress( "Loading games", "Loading games", 100, NULL,
+                              wxPD_APP_MODAL+
+                              wxPD_AUTO_HIDE+
+                              wxPD_ELAPSED_TIME+
+                              wxPD_CAN_ABORT+
+                              wxPD_ESTIMATED_TIME );
+    
+    int retval=-1;
+    cache.clear();
+    if( gbl_use_index )
+    {
+        retval = load_games_from_index( cache, nbr_games, progress );
+        gbl_protect_recursion = false;
+        return retval;
+    }
+    
+    // select matching rows from the table
+    std::string query = GamesQuery();
+    const char *buf = query.c_str();
     cprintf( "LoadAllGames() START query: %s\n",buf);
     retval = sqlite3_prepare_v2( gbl_handle, buf, -1, &gbl_stmt, 0 );
     if( retval )
@@ -484,44 +948,7 @@ int Database::LoadAllGames( std::vector<DB_GAME_INFO> &cache, int nbr_games )
             DB_GAME_INFO info;
 
             // SQLITE_ROW means fetched a row
-            
-            // sqlite3_column_text returns a const void* , typecast it to const char*
-            for( int col=0; col<cols; col++ )
-            {
-                if( col == 0 )
-                {
-                    const char *val = (const char*)sqlite3_column_text(gbl_stmt,col);
-                    info.game_id = atoi(val);
-                }
-                else if( col == 1 )
-                {
-                    const char *val = (const char*)sqlite3_column_text(gbl_stmt,col);
-                    info.white = val ? std::string(val) : "Whoops";
-                }
-                else if( col == 2 )
-                {
-                    const char *val = (const char*)sqlite3_column_text(gbl_stmt,col);
-                    info.black = val ? std::string(val) : "Whoops";
-                }
-                else if( col == 3 )
-                {
-                    const char *val = (const char*)sqlite3_column_text(gbl_stmt,col);
-                    info.result = val ? std::string(val) : "*";
-                }
-                else if( col == 4 )
-                {
-                    int len = sqlite3_column_bytes(gbl_stmt,col);
-                    //fprintf(f,"Move len = %d\n",len);
-                    const char *blob = (const char*)sqlite3_column_blob(gbl_stmt,col);
-                    if( len && blob )
-                    {
-                        std::string str_blob(blob,len);
-                        info.str_blob = str_blob;
-                    }
-                    else
-                        info.str_blob = "";
-                }
-            }
+            db_read_game_columns( gbl_stmt, cols, info );
             cache.push_back( info );
 
             int percent = (cache.size()*100) / (nbr_games?nbr_games:1);
@@ -553,10 +980,120 @@ int Database::LoadAllGames( std::vector<DB_GAME_INFO> &cache, int nbr_games )
     return retval;
 }
 
+int Database::SetPositionAsync( thc::ChessRules &cr, std::string &player_name, wxEvtHandler *dest )
+{
+    DB_QUERY query;
+    query.kind  = DB_QUERY_COUNT;
+    query.dest  = dest;
+    query.count = PositionQuery( cr, player_name, query.sql );
+    if( query.sql.length() > 0 )
+        query.count = -1;
+
+    // The list is empty until the count arrives
+    gbl_count = 0;
+    cprintf( "SetPositionAsync() query: %s\n", query.sql.c_str() );
+    return gbl_query.Submit( query );
+}
+
+int Database::LoadAllGamesAsync( wxEvtHandler *dest )
+{
+    DB_QUERY query;
+    query.dest  = dest;
+    query.count = gbl_count;
+    if( gbl_use_index )
+    {
+        // Just read the games, the position index has the game_ids
+        query.kind = DB_QUERY_GAMES_BY_ID;
+        int game_id, ply;
+        gbl_index_cursor.Rewind();
+        while( gbl_index_cursor.Next(game_id,ply) )
+        {
+            query.game_ids.push_back(game_id);
+            query.plies.push_back(ply);
+        }
+    }
+    else
+    {
+        query.kind = DB_QUERY_GAMES;
+        query.sql  = GamesQuery();
+    }
+    cprintf( "LoadAllGamesAsync() query: %s\n", query.sql.c_str() );
+    return gbl_query.Submit( query );
+}
+
+// The count from a SetPositionAsync() query, returns false if superseded
+bool Database::TakeCount( int query_id, int &count )
+{
+    DB_QUERY_RESULT result;
+    if( !gbl_query.TakeResult( query_id, result ) || result.kind!=DB_QUERY_COUNT )
+        return false;
+    gbl_pages.clear();
+    gbl_row_keys.clear();
+    gbl_count = count = result.count;
+    tprintf( "Game count = %d\n", count );
+    return true;
+}
+
+// The games from a LoadAllGamesAsync() query, returns false if superseded
+bool Database::TakeGames( int query_id, std::vector<DB_GAME_INFO> &cache )
+{
+    DB_QUERY_RESULT result;
+    if( !gbl_query.TakeResult( query_id, result ) || result.kind==DB_QUERY_COUNT || !result.ok )
+        return false;
+    cache.swap( result.games );
+    return true;
+}
+
+void Database::CancelQuery()
+{
+    gbl_query.Cancel();
+}
+
+// The player_id for a name, or -1 (which matches no games) if not found
+int Database::PlayerId( std::string &name )
+{
+    int player_id = -1;
+    sqlite3_stmt *stmt;
+    if( 0 == sqlite3_prepare_v2( gbl_handle, "SELECT player_id FROM players WHERE name=?", -1, &stmt, 0 ) )
+    {
+        sqlite3_bind_text( stmt, 1, name.c_str(), -1, SQLITE_TRANSIENT );
+        if( sqlite3_step(stmt) == SQLITE_ROW )
+            player_id = sqlite3_column_int(stmt,0);
+        sqlite3_finalize(stmt);
+    }
+    return player_id;
+}
+
 // Returns row
 int Database::FindRow( std::string &name )
 {
     int row=0;
+    if( gbl_has_players )
+    {
+        // The start position list is in white player order, so the row is the
+        //  number of games for players before name, kept in the players table.
+        //  One seek in the players name index, or if name is after them all,
+        //  one seek to the last of them
+        sqlite3_stmt *stmt;
+        bool found = false;
+        if( 0 == sqlite3_prepare_v2( gbl_handle, "SELECT white_games_before FROM players WHERE name>=? ORDER BY name LIMIT 1", -1, &stmt, 0 ) )
+        {
+            sqlite3_bind_text( stmt, 1, name.c_str(), -1, SQLITE_TRANSIENT );
+            if( sqlite3_step(stmt) == SQLITE_ROW )
+            {
+                row = sqlite3_column_int(stmt,0);
+                found = true;
+            }
+            sqlite3_finalize(stmt);
+        }
+        if( !found && 0 == sqlite3_prepare_v2( gbl_handle, "SELECT white_games_before+white_games FROM players ORDER BY name DESC LIMIT 1", -1, &stmt, 0 ) )
+        {
+            if( sqlite3_step(stmt) == SQLITE_ROW )
+                row = sqlite3_column_int(stmt,0);
+            sqlite3_finalize(stmt);
+        }
+        return row;
+    }
     char upper='A', lower='a';
     if( isalpha(name[0]) )
     {
@@ -573,15 +1110,13 @@ int Database::FindRow( std::string &name )
         if( okay )
         {
             const char *val = (const char*)sqlite3_column_text(gbl_stmt,0);
-            std::string srow(val);
-            if( srow >= name ) //&& (*val==lower || *val==upper) )
+            if( val && std::string(val) >= name ) //&& (*val==lower || *val==upper) )
                 break;
             row++;
         }
     }
     sqlite3_finalize(gbl_stmt);
     gbl_stmt = NULL;
-    gbl_expected = -1;
     return row;
 }
 
@@ -603,3 +1138,37 @@ int Database::GetCurrent()
     return gbl_current;
 }
 
+
+bool Database::HasMoveStats()
+{
+    return gbl_has_move_stats;
+}
+
+// One indexed query instead of loading and replaying every game that reaches
+//  the position. Returns the number of different moves played
+int Database::LoadMoveStats( thc::ChessRules &cr, std::map< uint32_t, MOVE_STATS > &stats )
+{
+    stats.clear();
+    if( !gbl_handle || !gbl_has_move_stats )
+        return 0;
+    sqlite3_stmt *stmt;
+    int retval = sqlite3_prepare_v2( gbl_handle, "SELECT move, games, white_wins, black_wins, draws FROM move_stats WHERE position_hash=?", -1, &stmt, 0 );
+    if( retval )
+    {
+        cprintf("SELECTING DATA FROM DB FAILED 4\n");
+        return 0;
+    }
+    sqlite3_bind_int64( stmt, 1, (sqlite3_int64)db_position_key(gbl_key_kind,cr) );
+    while( SQLITE_ROW == sqlite3_step(stmt) )
+    {
+        uint32_t imv = (uint32_t)sqlite3_column_int(stmt,0);
+        MOVE_STATS ms;
+        ms.nbr_games      = sqlite3_column_int(stmt,1);
+        ms.nbr_white_wins = sqlite3_column_int(stmt,2);
+        ms.nbr_black_wins = sqlite3_column_int(stmt,3);
+        ms.nbr_draws      = sqlite3_column_int(stmt,4);
+        stats[imv] = ms;
+    }
+    sqlite3_finalize(stmt);
+    return (int)stats.size();
+}
@@ -9,12 +9,25 @@
 #include <stdint.h>
 #include <string>
 #include <vector>
+#include <map>
 #include "thc.h"
 #include "GameDocument.h"
 
+class wxEvtHandler;
+
+// Ids of the wxThreadEvents that report on asynchronous queries, the query id
+//  is in GetInt()
+enum
+{
+    ID_DB_QUERY_DONE     = 10100,   // finished, collect the result with TakeCount() or TakeGames()
+    ID_DB_QUERY_PROGRESS = 10101    // loading games, percentage done in GetExtraLong()
+};
+
 struct DB_GAME_INFO
 {
+    DB_GAME_INFO() { game_id=0; ply=0; transpo_nbr=0; }
     int game_id;
+    int ply;            // ply at which the game reaches the searched position, 0 if not known
     std::string white;
     std::string black;
     std::string result;
@@ -24,6 +37,20 @@ struct DB_GAME_INFO
     int transpo_nbr;
 };
 
+// Each move in a given position has stats associated with it
+struct MOVE_STATS
+{
+    int nbr_games;
+    int nbr_white_wins;
+    int nbr_black_wins;
+    int nbr_draws;
+    
+    // Sort according to number of games
+    bool operator < (const MOVE_STATS& ms)  const { return nbr_games < ms.nbr_games; }
+    bool operator > (const MOVE_STATS& ms)  const { return nbr_games > ms.nbr_games; }
+    bool operator == (const MOVE_STATS& ms) const { return nbr_games == ms.nbr_games; }
+};
+
 //FIXME - reorganise these
 void db_calculate_move_txt( DB_GAME_INFO *info );
 int  db_calculate_move_vector( DB_GAME_INFO *info, std::vector<thc::Move> &moves );
@@ -42,8 +69,27 @@ public:
     bool TestPrevRow();
     int GetCurrent();
     int FindRow( std::string &name );
+
+    // As SetPosition() and LoadAllGames(), but the SQL runs on a query thread
+    //  and ID_DB_QUERY_DONE is sent to dest when it finishes. Starting a new
+    //  query abandons the previous one. Return the query id
+    int  SetPositionAsync( thc::ChessRules &cr, std::string &player_name, wxEvtHandler *dest );
+    int  LoadAllGamesAsync( wxEvtHandler *dest );
+    bool TakeCount( int query_id, int &count );
+    bool TakeGames( int query_id, std::vector<DB_GAME_INFO> &cache );
+    void CancelQuery();
+
+    // Aggregated move statistics calculated when the database was built, if
+    //  available. Map each move (as a uint32_t) in the position to its stats
+    bool HasMoveStats();
+    int  LoadMoveStats( thc::ChessRules &cr, std::map< uint32_t, MOVE_STATS > &stats );
     
 private:
+    int  PositionQuery( thc::ChessRules &cr, std::string &player_name, std::string &count_query );
+    std::string GamesQuery();
+    int  PlayerId( std::string &name );
+    bool FetchPage( int page_nbr );
+    std::string PageQuery( bool forward, bool anchored, bool anchor_null, int limit );
     std::string player_name;
     bool is_start_pos;
     std::string where_white;
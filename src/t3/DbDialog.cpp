@@ -63,6 +63,8 @@ BEGIN_EVENT_TABLE( DbDialog, wxDialog )
     EVT_CHECKBOX   ( ID_DB_CHECKBOX,    DbDialog::OnCheckBox )
     EVT_COMBOBOX   ( ID_DB_COMBO,       DbDialog::OnComboBox )
     EVT_LISTBOX(ID_DB_LISTBOX_STATS, DbDialog::OnNextMove)
+    EVT_THREAD(ID_DB_QUERY_DONE,     DbDialog::OnQueryDone)
+    EVT_THREAD(ID_DB_QUERY_PROGRESS, DbDialog::OnQueryProgress)
 
     //EVT_MENU( wxID_SELECTALL, DbDialog::OnSelectAll )
     EVT_LIST_ITEM_FOCUSED(ID_PGN_LISTBOX, DbDialog::OnListFocused)
@@ -317,6 +319,12 @@ DbDialog::DbDialog
     Create( parent, id, "Title FIXME", pos, size, style );
 }
 
+DbDialog::~DbDialog()
+{
+    // Don't leave the query thread working for (or sending events to) us
+    objs.db->CancelQuery();
+}
+
 // Pre window creation initialisation
 void DbDialog::Init()
 {
@@ -326,6 +334,10 @@ void DbDialog::Init()
     db_game_set = false;
     activated_at_least_once = false;
     transpo_activated = false;
+    cache_depth = 0;
+    count_query_id = 0;
+    games_query_id = 0;
+    games_query_depth = 0;
     wxAcceleratorEntry entries[5];
     entries[0].Set(wxACCEL_CTRL,  (int) 'X',     wxID_CUT);
     entries[1].Set(wxACCEL_CTRL,  (int) 'C',     wxID_COPY);
@@ -380,12 +392,13 @@ void DbDialog::CreateControls()
     wxBoxSizer* box_sizer = new wxBoxSizer(wxVERTICAL);
     top_sizer->Add(box_sizer, 0, wxALIGN_CENTER_HORIZONTAL|wxALL, 5);
 
-    // A friendly message
-    gbl_nbr = objs.db->SetPosition( cr ); //gc->gds.size();
-    char buf[200];
-    sprintf(buf,"List of %d matching games from the database",gbl_nbr);
+    // A friendly message, the games are counted in the background and
+    //  OnQueryDone() fills in the list
+    std::string no_player;
+    gbl_nbr = 0;
+    count_query_id = objs.db->SetPositionAsync( cr, no_player, this );
     title_ctrl = new wxStaticText( this, wxID_STATIC,
-        buf, wxDefaultPosition, wxDefaultSize, 0 );
+        "Counting matching games in the database", wxDefaultPosition, wxDefaultSize, 0 );
     box_sizer->Add(title_ctrl, 0, wxALIGN_LEFT|wxALL, 5);
 
     // Spacer
@@ -877,13 +890,12 @@ void DbDialog::OnReload( wxCommandEvent& WXUNUSED(event) )
     }
     else
     {
-        gbl_nbr = objs.db->SetPosition( cr, sname );
-        char buf[200];
-        sprintf(buf,"List of %d matching games from the database",gbl_nbr);
-        title_ctrl->SetLabel( buf );
-        cprintf( "Reloading, %d games\n", gbl_nbr);
-        list_ctrl->SetItemCount(gbl_nbr);
-        list_ctrl->RefreshItems(0,gbl_nbr-1);
+        cprintf( "Reloading\n" );
+        gbl_nbr = 0;
+        count_query_id = objs.db->SetPositionAsync( cr, sname, this );
+        games_query_id = 0;
+        title_ctrl->SetLabel( "Counting matching games in the database" );
+        list_ctrl->SetItemCount(0);
     }
 }
 
@@ -968,17 +980,72 @@ double AutoTimer::End()
 
 void DbDialog::OnUtility( wxCommandEvent& WXUNUSED(event) )
 {
+    if( objs.db->HasMoveStats() )
     {
-        AutoTimer at("1) Load games into memory");
-        
-        // Load all the matching games from the database
-        objs.db->LoadAllGames( cache, gbl_nbr );
-    }
-    {
-        AutoTimer at("2) Calculate stats");
+        // No need to load the games, they are read as the list is scrolled
+        AutoTimer at("Calculate stats from database");
+        cache.clear();
         moves_from_base_position.clear();
         moves_in_this_position.clear();
         StatsCalculate();
+        return;
+    }
+
+    // Load all the matching games from the database in the background,
+    //  OnQueryDone() calculates the stats when they arrive
+    games_query_depth = 0;
+    games_query_id = objs.db->LoadAllGamesAsync( this );
+    title_ctrl->SetLabel( "Loading games from the database" );
+}
+
+// A query running in the background has finished
+void DbDialog::OnQueryDone( wxThreadEvent& event )
+{
+    int query_id = event.GetInt();
+    if( query_id!=0 && query_id==count_query_id )
+    {
+        count_query_id = 0;
+        int nbr;
+        if( !objs.db->TakeCount( query_id, nbr ) )
+            return;
+        cprintf( "OnQueryDone(): %d games\n", nbr );
+        gbl_nbr = nbr;
+        gbl_last_item = -1;
+        char buf[200];
+        sprintf(buf,"List of %d matching games from the database",gbl_nbr);
+        title_ctrl->SetLabel( buf );
+        list_ctrl->SetItemCount(gbl_nbr);
+        list_ctrl->RefreshItems(0,gbl_nbr-1);
+        if( gbl_nbr > 0 )
+        {
+            list_ctrl->SetItemState(0, wxLIST_STATE_SELECTED, wxLIST_STATE_SELECTED);
+            list_ctrl->ReceiveFocus(0);
+        }
+    }
+    else if( query_id!=0 && query_id==games_query_id )
+    {
+        games_query_id = 0;
+        if( !objs.db->TakeGames( query_id, cache ) )
+            return;
+        AutoTimer at("Calculate stats");
+        cache_depth = games_query_depth;
+        if( cache_depth == 0 )
+        {
+            moves_from_base_position.clear();
+            moves_in_this_position.clear();
+        }
+        StatsCalculate();
+    }
+}
+
+// Loading games in the background
+void DbDialog::OnQueryProgress( wxThreadEvent& event )
+{
+    if( event.GetInt()!=0 && event.GetInt()==games_query_id )
+    {
+        char buf[200];
+        sprintf( buf, "Loading games from the database, %ld%%", event.GetExtraLong() );
+        title_ctrl->SetLabel( buf );
     }
 }
 
@@ -1011,8 +1078,27 @@ void DbDialog::StatsCalculate()
     extern void db_set_gbl_position( thc::ChessPosition &pos );   // FIXME this is an abomination
     db_set_gbl_position( cr_to_match );   // FIXME this is an abomination
 
-    // hash to match
-    uint64_t gbl_hash = cr_to_match.Hash64Calculate();
+    // hash to match, matches are confirmed by comparing positions so the
+    //  Zobrist key is fine whatever kind of keys the database uses
+    uint64_t gbl_hash = cr_to_match.Zobrist();
+
+    // Games loaded for a position don't include all the games for the
+    //  positions before it, so if we have gone back, drop them
+    if( cache.size()>0 && moves_from_base_position.size()<cache_depth )
+        cache.clear();
+
+    // Without games in memory, use the stats calculated when the database
+    //  was built and let the list control read games from the database
+    bool from_database = (cache.size()==0 && objs.db->HasMoveStats());
+    if( from_database )
+    {
+        // The games are counted in the background, OnQueryDone() fills in the list
+        std::string no_player;
+        objs.db->LoadMoveStats( cr_to_match, stats );
+        count_query_id = objs.db->SetPositionAsync( cr_to_match, no_player, this );
+        games_query_id = 0;
+        gbl_last_item = -1;
+    }
     
     int maxlen = 1000000;   // absurdly large until a match found
 
@@ -1043,19 +1129,18 @@ void DbDialog::StatsCalculate()
             PATH_TO_POSITION ptp;
             size_t len = info.str_blob.length();
             const char *blob = (const char*)info.str_blob.c_str();
-            uint64_t hash = ptp.press.cr.Hash64Calculate();
+            uint64_t hash = ptp.press.cr.Zobrist();
             int nbr=0;
             found = (hash==gbl_hash && ptp.press.cr==cr_to_match );
             while( !found && nbr<len && nbr<maxlen )
             {
-                thc::ChessRules cr_hash = ptp.press.cr;
                 thc::Move mv;
                 int nbr_used = ptp.press.decompress_move( blob, mv );
                 if( nbr_used == 0 )
                     break;
                 blob += nbr_used;
                 nbr += nbr_used;
-                hash = cr_hash.Hash64Update( hash, mv );
+                hash = ptp.press.cr.Zobrist();
                 if( hash == gbl_hash && ptp.press.cr==cr_to_match )
                     found = true;
             }
@@ -1203,15 +1288,21 @@ void DbDialog::StatsCalculate()
         wxString wstr(buf);
         strings.Add(wstr);
     }
+    if( from_database )
+        strings.Add( wxString("Load games to find transpositions") );
     list_ctrl_transpo->InsertItems( strings, 0 );
 
-    gbl_nbr = games.size();
+    // Until OnQueryDone() has the count of games from the database, the list is empty
+    gbl_nbr = from_database ? 0 : games.size();
     list_ctrl->SetItemCount(gbl_nbr);
     list_ctrl->RefreshItems( 0, gbl_nbr-1 );
     list_ctrl->SetItemState(0, wxLIST_STATE_SELECTED, wxLIST_STATE_SELECTED);
     list_ctrl->ReceiveFocus(0);
     char buf[200];
-    sprintf(buf,"List of %d matching games from the database",gbl_nbr);
+    if( from_database )
+        strcpy( buf, "Counting matching games in the database" );
+    else
+        sprintf(buf,"List of %d matching games from the database",gbl_nbr);
     title_ctrl->SetLabel( buf );
 
     int top = list_ctrl->GetTopItem();
@@ -1227,6 +1318,15 @@ void DbDialog::StatsCalculate()
 void DbDialog::OnTabSelected( wxBookCtrlEvent& event )
 {
     transpo_activated = (1==event.GetSelection());
+
+    // Transpositions need the games, so load them now if stats came from the database
+    if( transpo_activated && cache.size()==0 && objs.db->HasMoveStats() && games_query_id==0 )
+    {
+        games_query_depth = moves_from_base_position.size();
+        games_query_id = objs.db->LoadAllGamesAsync( this );
+        title_ctrl->SetLabel( "Loading games from the database" );
+        return;
+    }
     int top = list_ctrl->GetTopItem();
     int count = 1 + list_ctrl->GetCountPerPage();
     if( count > gbl_nbr )
@@ -1241,6 +1341,11 @@ void DbDialog::OnNextMove( wxCommandEvent &event )
 {
     int idx = event.GetSelection();
     cprintf( "DbDialog::OnNextMove(%d)\n", idx );
+
+    // Whatever we were counting or loading is for the position we are leaving
+    objs.db->CancelQuery();
+    count_query_id = 0;
+    games_query_id = 0;
     if( idx==0 && moves_from_base_position.size()>0 )
     {
         moves_from_base_position.pop_back();
@@ -1264,8 +1369,8 @@ void DbDialog::OnNextMove( wxCommandEvent &event )
     // Map each move in the position to move stats
     std::map< uint32_t, MOVE_STATS > stats;
     
-    // hash to match
-    uint64_t gbl_hash = cr.Hash64Calculate();
+    // hash to match (Zobrist, as above)
+    uint64_t gbl_hash = cr.Zobrist();
     
     // For each game
     for( unsigned int game_idx=0; game_idx<games.size(); game_idx++ )
@@ -1294,19 +1399,18 @@ void DbDialog::OnNextMove( wxCommandEvent &event )
             PATH_TO_POSITION ptp;
             size_t len = info.str_blob.length();
             const char *blob = (const char*)info.str_blob.c_str();
-            uint64_t hash = ptp.press.cr.Hash64Calculate();
+            uint64_t hash = ptp.press.cr.Zobrist();
             int nbr=0;
             found = (hash==gbl_hash && ptp.press.cr==this->cr );
             while( !found && nbr<len )
             {
-                thc::ChessRules cr = ptp.press.cr;
                 thc::Move mv;
                 int nbr_used = ptp.press.decompress_move( blob, mv );
                 if( nbr_used == 0 )
                     break;
                 blob += nbr_used;
                 nbr += nbr_used;
-                hash = cr.Hash64Update( hash, mv );
+                hash = ptp.press.cr.Zobrist();
                 if( hash == gbl_hash && ptp.press.cr==this->cr )
                     found = true;
             }
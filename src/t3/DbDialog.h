@@ -34,20 +34,6 @@ enum
 
 class wxVirtualListCtrl;
 
-// Each move in a given position has stats associated with it
-struct MOVE_STATS
-{
-    int nbr_games;
-    int nbr_white_wins;
-    int nbr_black_wins;
-    int nbr_draws;
-    
-    // Sort according to number of games
-    bool operator < (const MOVE_STATS& ms)  const { return nbr_games < ms.nbr_games; }
-    bool operator > (const MOVE_STATS& ms)  const { return nbr_games > ms.nbr_games; }
-    bool operator == (const MOVE_STATS& ms) const { return nbr_games == ms.nbr_games; }
-};
-
 // Individual path to a given position
 struct PATH_TO_POSITION
 {
@@ -96,6 +82,8 @@ public:
         long style = wxCAPTION|wxRESIZE_BORDER|wxSYSTEM_MENU|wxCLOSE_BOX
     );
 
+    ~DbDialog();
+
     // Member initialisation
     void Init();
 
@@ -129,6 +117,8 @@ public:
     void OnListColClick( wxListEvent &event );
     void OnTabSelected( wxBookCtrlEvent &event );
     void OnNextMove( wxCommandEvent &event );
+    void OnQueryDone( wxThreadEvent& event );
+    void OnQueryProgress( wxThreadEvent& event );
 
     // wxEVT_COMMAND_BUTTON_CLICKED event handler for wxID_OK
     void OnOkClick( wxCommandEvent& event );
@@ -201,6 +191,10 @@ private:
     int file_game_idx;
     bool db_game_set;
     std::vector<DB_GAME_INFO> cache;    // games from database
+    unsigned int cache_depth;           // cache has the games for the position this many moves from base position
+    int count_query_id;                 // background queries we are waiting for, or 0
+    int games_query_id;
+    unsigned int games_query_depth;     // cache_depth for the games being loaded
     std::vector<thc::Move> moves_in_this_position;
     std::vector<thc::Move> moves_from_base_position;
     GameDocument db_game;
@@ -6,11 +6,19 @@
  ****************************************************************************/
 #define _CRT_SECURE_NO_WARNINGS
 #include <stdio.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include "thc.h"
 #include "PgnRead.h"
 #include "CompressMoves.h"
 #include "DbPrimitives.h"
 #include "DbMaintenance.h"
+#include "MemoryMap.h"
 
 //-- Temp - hardwire .pgn file and database name
 #define PGN_FILE        "/Users/billforster/Documents/ChessDatabases/twic_minimal_overlap.pgn"
@@ -27,6 +35,17 @@ static void game_to_qgn_file( const char *event, const char *site, const char *d
 static void compress_moves_to_str( int nbr_moves, thc::Move *moves, char *dst, thc::ChessPosition *positions );
 static void decompress_moves_from_str( int nbr_moves, char *src, thc::Move *moves, thc::ChessPosition *positions  );
 static void verify_compression_algorithm( int nbr_moves, thc::Move *moves );
+static void pipeline_import( const char *buf, size_t len, int nbr_workers );
+
+// Speed test, count games and checksum the position hashes
+struct SPEED_TEST
+{
+    int nbr_games;
+    int nbr_moves;
+    uint64_t checksum;
+};
+static void pipeline_game( void *context, const char *event, const char *site, const char *white, const char *black,
+                          const char *result, int nbr_moves, thc::Move *moves, uint64_t *hashes );
 
 void db_maintenance_speed_tests()
 {
@@ -82,24 +101,21 @@ void db_maintenance_decompress_pgn()
 
 void db_maintenance_verify_compression()
 {
-    ifile = fopen( PGN_FILE, "rt" );
-    if( !ifile )
+    MemoryMap map;
+    if( !map.Open( PGN_FILE, true ) )
         printf( "Cannot open %s\n", PGN_FILE );
     else
     {
         PgnRead *pgn = new PgnRead('V');
-        pgn->Process(ifile);
+        pgn->Process( map.Data(), map.Length() );
+        delete pgn;
     }
-    if( ifile )
-        fclose(ifile);
-    if( ofile )
-        fclose(ofile);
 }
 
 void db_maintenance_compress_pgn()
 {
-    ifile = fopen( PGN_FILE, "rt" );
-    if( !ifile )
+    MemoryMap map;
+    if( !map.Open( PGN_FILE, true ) )
         printf( "Cannot open %s\n", PGN_FILE );
     else
     {
@@ -109,36 +125,109 @@ void db_maintenance_compress_pgn()
         else
         {
             PgnRead *pgn = new PgnRead('P');
-            pgn->Process(ifile);
+            pgn->Process( map.Data(), map.Length() );
+            delete pgn;
+            fclose(ofile);
+            ofile = NULL;
         }
     }
-    if( ifile )
-        fclose(ifile);
-    if( ofile )
-        fclose(ofile);
 }
 
 
-void db_maintenance_create_or_append_to_database(  const char *pgn_filename )
+void db_maintenance_create_or_append_to_database(  const char *pgn_filename, int nbr_threads )
 {
-    ifile = fopen( pgn_filename , "rt" );
-    if( !ifile )
+    MemoryMap map;
+    if( !map.Open( pgn_filename, true ) )
         printf( "Cannot open %s\n", pgn_filename );
     else
     {
-        PgnRead *pgn = new PgnRead('A');
+        if( nbr_threads <= 0 )
+        {
+            nbr_threads = std::thread::hardware_concurrency();
+            if( nbr_threads <= 0 )
+                nbr_threads = 1;
+        }
         db_primitive_open_multi();
         db_primitive_transaction_begin();
         db_primitive_count_games();
-        pgn->Process(ifile);
+        unsigned long base_time = GetTickCount();
+        if( nbr_threads == 1 )
+        {
+            PgnRead *pgn = new PgnRead('A');
+            pgn->UseZobristKeys( db_primitive_key_kind() == DB_KEY_ZOBRIST );
+            pgn->Process( map.Data(), map.Length() );
+            delete pgn;
+        }
+        else
+        {
+            pipeline_import( map.Data(), map.Length(), nbr_threads );
+        }
+        unsigned long load_time = GetTickCount();
         db_primitive_create_indexes_multi();
         db_primitive_transaction_end();
+        unsigned long end_time = GetTickCount();
+        int nbr_games = db_primitive_nbr_games_appended();
         db_primitive_close();
+        unsigned long elapsed = end_time - base_time;
+        printf( "Appended %d games in %lu ms (load %lu ms, index %lu ms), %.0f games/sec, %d threads\n",
+                    nbr_games, elapsed, load_time-base_time, end_time-load_time,
+                    elapsed ? (nbr_games*1000.0)/elapsed : 0.0, nbr_threads );
     }
-    if( ifile )
-        fclose(ifile);
-    if( ofile )
-        fclose(ofile);
+}
+
+// Compare the character at a time PgnRead::Process(FILE*) with the buffer
+//  scanning PgnRead::Process() on a memory mapped file
+void db_maintenance_pgn_read_speed_test( const char *pgn_filename )
+{
+    SPEED_TEST results[2];
+    for( int i=0; i<2; i++ )
+    {
+        SPEED_TEST *r = &results[i];
+        r->nbr_games = 0;
+        r->nbr_moves = 0;
+        r->checksum  = 0;
+        PgnRead *pgn = new PgnRead('B',r);
+        unsigned long base_time = GetTickCount();
+        size_t len = 0;
+        if( i == 0 )
+        {
+            ifile = fopen( pgn_filename, "rt" );
+            if( !ifile )
+            {
+                printf( "Cannot open %s\n", pgn_filename );
+                delete pgn;
+                return;
+            }
+            fseek( ifile, 0, SEEK_END );
+            len = ftell( ifile );
+            rewind( ifile );
+            pgn->Process(ifile);
+            fclose(ifile);
+            ifile = NULL;
+        }
+        else
+        {
+            MemoryMap map;
+            if( !map.Open( pgn_filename, true ) )
+            {
+                printf( "Cannot open %s\n", pgn_filename );
+                delete pgn;
+                return;
+            }
+            len = map.Length();
+            pgn->Process( map.Data(), map.Length() );
+        }
+        unsigned long elapsed = GetTickCount() - base_time;
+        delete pgn;
+        double mb = len / (1024.0*1024.0);
+        printf( "%s: %.1f MB, %d games, %d moves in %lu ms, %.1f MB/s\n",
+                   i==0 ? "PgnRead::Process(FILE*)" : "PgnRead::Process(buffer)",
+                   mb, r->nbr_games, r->nbr_moves, elapsed, elapsed ? (mb*1000.0)/elapsed : 0.0 );
+    }
+    bool same = results[0].nbr_games==results[1].nbr_games &&
+                results[0].nbr_moves==results[1].nbr_moves &&
+                results[0].checksum ==results[1].checksum;
+    printf( "Results %s\n", same ? "match" : "DO NOT MATCH" );
 }
 
 void db_maintenance_create_extra_indexes()
@@ -150,7 +239,16 @@ void db_maintenance_create_extra_indexes()
     db_primitive_close();
 }
 
-void hook_gameover( char callback_code, const char *event, const char *site, const char *date, const char *round,
+// Build the standalone position index that Database uses in preference to the
+//  positions_N tables, run this after every append
+void db_maintenance_create_position_index()
+{
+    db_primitive_open_multi();
+    db_primitive_build_position_index( DB_INDEX_FILE );
+    db_primitive_close();
+}
+
+void hook_gameover( char callback_code, void *callback_context, const char *event, const char *site, const char *date, const char *round,
                   const char *white, const char *black, const char *result, const char *white_elo, const char *black_elo, const char *eco,
                   int nbr_moves, thc::Move *moves, uint64_t *hashes )
 {
@@ -164,6 +262,20 @@ void hook_gameover( char callback_code, const char *event, const char *site, con
             
         // Verify
         case 'V': verify_compression_algorithm( nbr_moves, moves ); break;
+
+        // Append, multi-threaded pipeline worker
+        case 'M': pipeline_game( callback_context, event, site, white, black, result, nbr_moves, moves, hashes ); break;
+
+        // Speed test
+        case 'B':
+        {
+            SPEED_TEST *r = (SPEED_TEST *)callback_context;
+            r->nbr_games++;
+            r->nbr_moves += nbr_moves;
+            for( int i=0; i<nbr_moves; i++ )
+                r->checksum = r->checksum*31 + hashes[i];
+            break;
+        }
     }
 }
 
@@ -556,3 +668,203 @@ static void verify_compression_algorithm( int nbr_moves, thc::Move *moves )
 }
 
 
+/*
+ * Multi-threaded import pipeline
+ *
+ *  One reader thread splits the memory mapped .pgn file into chunks that end
+ *  on game boundaries. N worker threads, each with its own PgnRead (and so its own
+ *  ChessRules), parse the moves, compress them and calculate position
+ *  hashes. The calling thread is the single writer, it inserts chunks into
+ *  the database strictly in file order, so game ids are the same as a
+ *  single threaded import would assign.
+ */
+
+#define PIPELINE_CHUNK_SIZE     (4*1024*1024)
+#define PIPELINE_MAX_IN_FLIGHT  4               // chunks per worker, bounds memory use
+
+// One game parsed and compressed by a worker, waiting for the writer
+struct PIPELINE_GAME
+{
+    std::string event;
+    std::string site;
+    std::string white;
+    std::string black;
+    std::string result;
+    std::string blob;
+    std::vector<thc::Move> moves;
+    std::vector<uint64_t> hashes;
+};
+
+// A chunk of .pgn text, and the games parsed from it
+struct PIPELINE_CHUNK
+{
+    int seq;
+    const char *pgn_text;
+    size_t len;
+    std::vector<PIPELINE_GAME> games;
+};
+
+struct PIPELINE
+{
+    std::mutex mtx;
+    std::condition_variable cv_work;    // signalled when a chunk is ready to parse
+    std::condition_variable cv_done;    // signalled when a chunk is ready to write
+    std::condition_variable cv_space;   // signalled when the writer retires a chunk
+    std::deque<PIPELINE_CHUNK *> work;
+    std::map<int,PIPELINE_CHUNK *> done;
+    int  in_flight;
+    int  max_in_flight;
+    int  nbr_chunks;
+    bool reader_finished;
+};
+
+// Called by a worker's PgnRead for each game in its chunk
+static void pipeline_game( void *context, const char *event, const char *site, const char *white, const char *black,
+                          const char *result, int nbr_moves, thc::Move *moves, uint64_t *hashes )
+{
+    PIPELINE_CHUNK *chunk = (PIPELINE_CHUNK *)context;
+    chunk->games.push_back( PIPELINE_GAME() );
+    PIPELINE_GAME &game = chunk->games.back();
+    game.event  = event;
+    game.site   = site;
+    game.white  = white;
+    game.black  = black;
+    game.result = result;
+    char blob_buf[1000];
+    int blob_len = db_primitive_compress_moves( nbr_moves, moves, blob_buf, sizeof(blob_buf) );
+    game.blob.assign( blob_buf, blob_len );
+    game.moves.assign( moves, moves+nbr_moves );
+    game.hashes.assign( hashes, hashes+nbr_moves );
+}
+
+// Return the offset of the start of the first game's tag section at or after
+//  offset idx in buf, or len if there isn't one. A game starts with a '[' at
+//  the start of a line, where the previous non blank line is not itself a tag
+static size_t pipeline_next_game_boundary( const char *buf, size_t len, size_t idx )
+{
+    while( idx < len )
+    {
+        const char *p = (const char *)memchr( buf+idx, '[', len-idx );
+        if( !p )
+            break;
+        idx = p-buf;
+        if( idx>0 && buf[idx-1]=='\n' )
+        {
+            // Find the start of the previous non blank line
+            const char *q = p-1;
+            while( q>buf && (*q=='\n' || *q=='\r' || *q==' ' || *q=='\t') )
+                q--;
+            while( q>buf && *(q-1)!='\n' )
+                q--;
+            if( *q != '[' )
+                return idx;
+        }
+        idx++;
+    }
+    return len;
+}
+
+static void pipeline_reader( PIPELINE *pipe, const char *buf, size_t len )
+{
+    int seq = 0;
+    size_t offset = 0;
+    while( offset < len )
+    {
+        size_t split = len;
+        if( len-offset > PIPELINE_CHUNK_SIZE )
+            split = pipeline_next_game_boundary( buf, len, offset+PIPELINE_CHUNK_SIZE );
+        PIPELINE_CHUNK *chunk = new PIPELINE_CHUNK;
+        chunk->seq = seq++;
+        chunk->pgn_text = buf+offset;
+        chunk->len = split-offset;
+        offset = split;
+        std::unique_lock<std::mutex> lock(pipe->mtx);
+        while( pipe->in_flight >= pipe->max_in_flight )
+            pipe->cv_space.wait(lock);
+        pipe->in_flight++;
+        pipe->work.push_back(chunk);
+        pipe->cv_work.notify_one();
+    }
+    std::lock_guard<std::mutex> lock(pipe->mtx);
+    pipe->nbr_chunks = seq;
+    pipe->reader_finished = true;
+    pipe->cv_work.notify_all();
+    pipe->cv_done.notify_all();
+}
+
+static void pipeline_worker( PIPELINE *pipe )
+{
+    for(;;)
+    {
+        PIPELINE_CHUNK *chunk;
+        {
+            std::unique_lock<std::mutex> lock(pipe->mtx);
+            while( pipe->work.empty() && !pipe->reader_finished )
+                pipe->cv_work.wait(lock);
+            if( pipe->work.empty() )
+                break;
+            chunk = pipe->work.front();
+            pipe->work.pop_front();
+        }
+        PgnRead *pgn = new PgnRead('M',chunk);
+        pgn->UseZobristKeys( db_primitive_key_kind() == DB_KEY_ZOBRIST );
+        pgn->Process( chunk->pgn_text, chunk->len );
+        delete pgn;
+        std::lock_guard<std::mutex> lock(pipe->mtx);
+        pipe->done[chunk->seq] = chunk;
+        pipe->cv_done.notify_one();
+    }
+}
+
+static void pipeline_import( const char *buf, size_t len, int nbr_workers )
+{
+    PIPELINE pipe;
+    pipe.in_flight = 0;
+    pipe.max_in_flight = nbr_workers*PIPELINE_MAX_IN_FLIGHT;
+    pipe.nbr_chunks = -1;
+    pipe.reader_finished = false;
+    std::thread reader( pipeline_reader, &pipe, buf, len );
+    std::vector<std::thread> workers;
+    for( int i=0; i<nbr_workers; i++ )
+        workers.push_back( std::thread( pipeline_worker, &pipe ) );
+
+    // Write chunks in file order
+    for( int seq=0; ; seq++ )
+    {
+        PIPELINE_CHUNK *chunk = NULL;
+        {
+            std::unique_lock<std::mutex> lock(pipe.mtx);
+            for(;;)
+            {
+                std::map<int,PIPELINE_CHUNK *>::iterator it = pipe.done.find(seq);
+                if( it != pipe.done.end() )
+                {
+                    chunk = it->second;
+                    pipe.done.erase(it);
+                    break;
+                }
+                if( pipe.reader_finished && seq >= pipe.nbr_chunks )
+                    break;
+                pipe.cv_done.wait(lock);
+            }
+        }
+        if( !chunk )
+            break;
+        for( size_t i=0; i<chunk->games.size(); i++ )
+        {
+            PIPELINE_GAME &game = chunk->games[i];
+            db_primitive_insert_game_compressed( game.white.c_str(), game.black.c_str(), game.event.c_str(), game.site.c_str(),
+                                                 game.result.c_str(), game.blob.c_str(), (int)game.blob.length(),
+                                                 (int)game.hashes.size(), game.moves.empty() ? NULL : &game.moves[0],
+                                                 game.hashes.empty() ? NULL : &game.hashes[0] );
+        }
+        printf( "Chunk %d, %d games written\n", seq+1, db_primitive_nbr_games_appended() );
+        delete chunk;
+        std::lock_guard<std::mutex> lock(pipe.mtx);
+        pipe.in_flight--;
+        pipe.cv_space.notify_one();
+    }
+    reader.join();
+    for( size_t i=0; i<workers.size(); i++ )
+        workers[i].join();
+}
@@ -10,9 +10,11 @@
 void db_maintenance_compress_pgn();
 void db_maintenance_decompress_pgn();
 void db_maintenance_verify_compression();
-void db_maintenance_create_or_append_to_database( const char *pgn_filename );
+void db_maintenance_create_or_append_to_database( const char *pgn_filename, int nbr_threads=0 );  // 0 = one per core
 void db_maintenance_create_extra_indexes();
+void db_maintenance_create_position_index();
 //void db_maintenance_append_to_database();
 void db_maintenance_speed_tests();
+void db_maintenance_pgn_read_speed_test( const char *pgn_filename );
 
 #endif // DB_MAINTENANCE_H
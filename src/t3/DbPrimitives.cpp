@@ -6,16 +6,25 @@
  ****************************************************************************/
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #include <vector>
+#include <string.h>
 #include <algorithm>
+#include <map>
+#include <string>
 #include "thc.h"
 #include "sqlite3.h"
 #include "CompressMoves.h"
+#include "ExternalSort.h"
+#include "PositionIndex.h"
 #include "DbPrimitives.h"
-static void purge_bucket(int bucket_idx);
 static void purge_buckets();
+static void purge_move_stats();
+static void load_players();
+static void purge_players();
 #define NBR_BUCKETS 4096
-#define PURGE_QUOTA 10000
+#define POSITIONS_MEMORY_BUDGET (64*1024*1024)   // bytes of (table,hash,game_id) rows held before spilling a sorted run
+#define MOVE_STATS_MEMORY_BUDGET (64*1024*1024)  // bytes of (hash,move,result) rows held before spilling a sorted run
 
 static int report( const char * txt )
 {
@@ -147,6 +156,73 @@ int db_primitive_random_test_program()
 // Handle for database connection
 static sqlite3 *handle;
 static int game_id;
+static int game_id_base;
+
+// Each player is given a player_id the first time we see them. The ids of all
+//  the players in the database are kept in memory while importing
+struct PLAYER
+{
+    int player_id;
+    int white_games;        // games as white not yet added to the players table
+    int white_games_total;  // games as white, added or not
+    int white_games_before; // as in the players table, -1 if not set
+};
+static std::map<std::string,PLAYER> players;
+static bool players_loaded;
+static bool players_changed;    // so white_games_before needs recalculating
+static int next_player_id;
+
+// Bulk loading uses prepared statements, each INSERT is parsed once then
+//  reused with fresh bindings for every row
+static sqlite3_stmt *stmt_insert_game;
+static sqlite3_stmt *stmt_insert_positions[NBR_BUCKETS];
+static sqlite3_stmt *stmt_insert_move_stats;
+static sqlite3_stmt *stmt_update_move_stats;
+static sqlite3_stmt *stmt_insert_player;
+static sqlite3_stmt *stmt_update_player;
+static sqlite3_stmt *stmt_update_player_before;
+
+static sqlite3_stmt *bulk_stmt( sqlite3_stmt **pstmt, const char *sql )
+{
+    if( *pstmt == NULL )
+    {
+        int retval = sqlite3_prepare_v2( handle, sql, -1, pstmt, 0 );
+        if( retval )
+        {
+            printf( "sqlite3_prepare_v2(%s) FAILED %s\n", sql, sqlite3_errmsg(handle) );
+            *pstmt = NULL;
+        }
+    }
+    return *pstmt;
+}
+
+static void bulk_finalize()
+{
+    if( stmt_insert_game )
+        sqlite3_finalize(stmt_insert_game);
+    stmt_insert_game = NULL;
+    if( stmt_insert_move_stats )
+        sqlite3_finalize(stmt_insert_move_stats);
+    stmt_insert_move_stats = NULL;
+    if( stmt_update_move_stats )
+        sqlite3_finalize(stmt_update_move_stats);
+    stmt_update_move_stats = NULL;
+    if( stmt_insert_player )
+        sqlite3_finalize(stmt_insert_player);
+    stmt_insert_player = NULL;
+    if( stmt_update_player )
+        sqlite3_finalize(stmt_update_player);
+    stmt_update_player = NULL;
+    if( stmt_update_player_before )
+        sqlite3_finalize(stmt_update_player_before);
+    stmt_update_player_before = NULL;
+    for( int i=0; i<NBR_BUCKETS; i++ )
+    {
+        if( stmt_insert_positions[i] )
+            sqlite3_finalize(stmt_insert_positions[i]);
+        stmt_insert_positions[i] = NULL;
+    }
+}
 
 void db_primitive_open()
 {
@@ -181,6 +257,105 @@ void db_primitive_open()
     }
 }
 
+// Players tables created before white_games_before don't have it. It's filled
+//  in (from NULL) by purge_players()
+static bool upgrade_players_table()
+{
+    sqlite3_stmt *stmt;
+    if( 0 == sqlite3_prepare_v2( handle, "SELECT white_games_before FROM players LIMIT 1", -1, &stmt, 0 ) )
+    {
+        sqlite3_finalize(stmt);
+        return true;
+    }
+    report( "Add white_games_before to players table");
+    int retval = sqlite3_exec( handle, "ALTER TABLE players ADD COLUMN white_games_before INTEGER", 0, 0, 0 );
+    if( retval )
+    {
+        printf("sqlite3_exec(ALTER TABLE players) FAILED %s\n", sqlite3_errmsg(handle) );
+        return false;
+    }
+    return true;
+}
+
+// Databases created before the players table have no white_id and black_id
+//  columns, add them and fill in the players table from the names
+static bool upgrade_games_table()
+{
+    sqlite3_stmt *stmt;
+    if( 0 == sqlite3_prepare_v2( handle, "SELECT white_id FROM games LIMIT 1", -1, &stmt, 0 ) )
+    {
+        sqlite3_finalize(stmt);
+        return true;
+    }
+    report( "Add player ids to games table");
+    const char *upgrade[] =
+    {
+        "BEGIN TRANSACTION",
+        "ALTER TABLE games ADD COLUMN white_id INTEGER",
+        "ALTER TABLE games ADD COLUMN black_id INTEGER",
+        "INSERT OR IGNORE INTO players(name,white_games) SELECT white, COUNT(*) FROM games GROUP BY white",
+        "INSERT OR IGNORE INTO players(name,white_games) SELECT black, 0 FROM games GROUP BY black",
+        "UPDATE games SET white_id=(SELECT player_id FROM players WHERE name=games.white), black_id=(SELECT player_id FROM players WHERE name=games.black)",
+        "COMMIT TRANSACTION",
+        NULL
+    };
+    for( int i=0; upgrade[i]; i++ )
+    {
+        char *errmsg;
+        int retval = sqlite3_exec( handle, upgrade[i], 0, 0, &errmsg );
+        if( retval )
+        {
+            printf("sqlite3_exec(%s) FAILED %s\n", upgrade[i], errmsg );
+            sqlite3_exec( handle, "ROLLBACK TRANSACTION", 0, 0, 0 );
+            return false;
+        }
+    }
+    report( "Add player ids to games table end");
+    return true;
+}
+
+// Kind of key positions are indexed by, see DB_KEY_KIND
+static DB_KEY_KIND key_kind;
+
+// An empty database takes DB_KEY_KIND_NEW, otherwise we keep to the kind of
+//  key the database was built with
+static bool open_key_kind()
+{
+    sqlite3_stmt *stmt;
+    int user_version = 0;
+    bool empty = true;
+    if( 0 == sqlite3_prepare_v2( handle, "PRAGMA user_version", -1, &stmt, 0 ) )
+    {
+        if( sqlite3_step(stmt) == SQLITE_ROW )
+            user_version = sqlite3_column_int(stmt,0);
+        sqlite3_finalize(stmt);
+    }
+    if( 0 == sqlite3_prepare_v2( handle, "SELECT 1 FROM games LIMIT 1", -1, &stmt, 0 ) )
+    {
+        empty = (sqlite3_step(stmt) != SQLITE_ROW);
+        sqlite3_finalize(stmt);
+    }
+    key_kind = (user_version==DB_KEY_ZOBRIST ? DB_KEY_ZOBRIST : DB_KEY_SQUARES);
+    if( empty && key_kind!=DB_KEY_KIND_NEW )
+    {
+        char buf[80];
+        sprintf( buf, "PRAGMA user_version=%d", DB_KEY_KIND_NEW );
+        if( sqlite3_exec(handle,buf,0,0,0) )
+        {
+            printf("sqlite3_exec(%s) FAILED\n", buf );
+            return false;
+        }
+        key_kind = DB_KEY_KIND_NEW;
+    }
+    printf( "Positions keyed by %s\n", key_kind==DB_KEY_ZOBRIST ? "Zobrist key" : "squares only hash" );
+    return true;
+}
+
+DB_KEY_KIND db_primitive_key_kind()
+{
+    return key_kind;
+}
+
 void db_primitive_open_multi()
 {
     printf( "db_primitive_open_multi()\n" );
@@ -199,12 +374,31 @@ void db_primitive_open_multi()
     
     // Create tables if not existing
     report( "Create games table");
-    retval = sqlite3_exec(handle,"CREATE TABLE IF NOT EXISTS games (game_id INTEGER, white TEXT, black TEXT, result TEXT, moves BLOB)",0,0,0);
+    retval = sqlite3_exec(handle,"CREATE TABLE IF NOT EXISTS games (game_id INTEGER, white TEXT, black TEXT, result TEXT, moves BLOB, white_id INTEGER, black_id INTEGER)",0,0,0);
     if( retval )
     {
         printf("sqlite3_exec(CREATE games) FAILED\n");
         return;
     }
+
+    // Player names are interned, games refer to the players by player_id. The
+    //  UNIQUE constraint gives an index on name, used for type to find, along
+    //  with white_games_before, the number of games as white of all players
+    //  whose names sort before this one
+    report( "Create players table");
+    retval = sqlite3_exec(handle,"CREATE TABLE IF NOT EXISTS players (player_id INTEGER PRIMARY KEY, name TEXT UNIQUE, white_games INTEGER, white_games_before INTEGER)",0,0,0);
+    if( retval )
+    {
+        printf("sqlite3_exec(CREATE players) FAILED\n");
+        return;
+    }
+    if( !upgrade_players_table() )
+        return;
+    if( !upgrade_games_table() )
+        return;
+    load_players();     // so white_games_before is filled in if it's missing
+    if( !open_key_kind() )
+        return;
     report( "Create positions tables");
     for( int i=0; i<NBR_BUCKETS; i++ )
     {
@@ -218,6 +412,17 @@ void db_primitive_open_multi()
         }
     }
     report( "Create positions tables end");
+
+    // Aggregated results of each move played in each position, see purge_move_stats(),
+    //  the rows are stored in key order, so no separate index is needed
+    report( "Create move_stats table");
+    retval = sqlite3_exec(handle,"CREATE TABLE IF NOT EXISTS move_stats (position_hash INTEGER, move INTEGER, games INTEGER, white_wins INTEGER, black_wins INTEGER, draws INTEGER, "
+                                 "PRIMARY KEY(position_hash,move)) WITHOUT ROWID",0,0,0);
+    if( retval )
+    {
+        printf("sqlite3_exec(CREATE move_stats) FAILED\n");
+        return;
+    }
 }
 
 void db_primitive_delete_previous_data()
@@ -305,6 +510,25 @@ void db_primitive_create_indexes_multi()
     if( retval )
     {
         printf("sqlite3_exec(CREATE INDEX games) FAILED\n");
+        return;
+    }
+    report( "Create games(white_id) index");
+    retval = sqlite3_exec(handle,"CREATE INDEX IF NOT EXISTS idx_white_id ON games(white_id)",0,0,0);
+    report( "Create games(white_id) index end");
+    if( retval )
+    {
+        printf("sqlite3_exec(CREATE INDEX white_id) FAILED\n");
+        return;
+    }
+
+    // Lets the game list find the player at a given row of the start position
+    //  list, see Database::FetchPage()
+    report( "Create players(white_games_before) index");
+    retval = sqlite3_exec(handle,"CREATE INDEX IF NOT EXISTS idx_players_before ON players(white_games_before)",0,0,0);
+    report( "Create players(white_games_before) index end");
+    if( retval )
+    {
+        printf("sqlite3_exec(CREATE INDEX white_games_before) FAILED\n");
     }
 }
 
@@ -438,6 +662,9 @@ void db_primitive_speed_tests()
 void db_primitive_close()
 {
     purge_buckets();
+    bulk_finalize();
+    players.clear();
+    players_loaded = false;
 
     // Close the handle to free memory
     sqlite3_close(handle);
@@ -703,9 +930,16 @@ int db_primitive_count_games()
     }
     printf("Get games count end\n");
     game_id = game_count;
+    game_id_base = game_count;
     return game_count;
 }
 
+// Number of games added since db_primitive_count_games() was called
+int db_primitive_nbr_games_appended()
+{
+    return game_id - game_id_base;
+}
+
 
 void db_primitive_insert_game( const char *white, const char *black, const char *event, const char *site, const char *result, int nbr_moves, thc::Move *moves, uint32_t *hashes  )
 {
@@ -764,7 +998,7 @@ void db_primitive_insert_game( const char *white, const char *black, const char
     }
     *put = '\0';
     //printf( "%d %s\n", nbr_moves, blob_buf );
-    sprintf( insert_buf, "INSERT INTO games VALUES(%d,'%s','%s','%s',X'%s')", game_id, white_buf, black_buf, result, blob_buf );
+    sprintf( insert_buf, "INSERT INTO games(game_id,white,black,result,moves) VALUES(%d,'%s','%s','%s',X'%s')", game_id, white_buf, black_buf, result, blob_buf );
     //printf( "%s\n", insert_buf );
     int retval = sqlite3_exec( handle, insert_buf,0,0,&errmsg);
     if( retval )
@@ -783,49 +1017,399 @@ void db_primitive_insert_game( const char *white, const char *black, const char
     game_id++;
 }
 
-std::vector<std::pair<int,int>> buckets[NBR_BUCKETS];
-static void purge_buckets()
+/*
+ * Position rows are built with an external sort. Rows accumulate in memory
+ *  up to POSITIONS_MEMORY_BUDGET, then are sorted and spilled to a temporary
+ *  file as a run. When the positions are finally flushed the runs are k-way
+ *  merged, so every positions_N table is written once, strictly in
+ *  (position_hash,game_id) order. Compared with many small interleaved
+ *  flushes this builds compact, unfragmented B-trees, and memory use is
+ *  bounded no matter how big the import.
+ */
+struct POSITION_ROW
 {
-    for( int i=0; i<NBR_BUCKETS; i++ )
+    int32_t  table_nbr;     // 32 bits so there is no padding, see ExternalSort
+    int32_t  hash;
+    int32_t  game_id;
+    bool operator <( const POSITION_ROW &other ) const
     {
-        purge_bucket(i);
+        if( table_nbr != other.table_nbr )
+            return table_nbr < other.table_nbr;
+        if( hash != other.hash )
+            return hash < other.hash;
+        return game_id < other.game_id;
     }
+};
+
+static ExternalSort<POSITION_ROW> positions_sort( POSITIONS_MEMORY_BUDGET );
+static unsigned long positions_count;
+
+static void add_position_row( int table_nbr, int hash, int game_id )
+{
+    POSITION_ROW row;
+    row.table_nbr = table_nbr;
+    row.hash      = hash;
+    row.game_id   = game_id;
+    positions_sort.Add(row);
+    positions_count++;
 }
 
-static void purge_bucket( int bucket_idx )
+static bool insert_position_row( const POSITION_ROW &row )
 {
-    char *errmsg;
-    char insert_buf[2000];
-    std::vector<std::pair<int,int>> *bucket = &buckets[bucket_idx];
-    int count = bucket->size();
-    if( count > 0 )
+    sqlite3_stmt *stmt = stmt_insert_positions[row.table_nbr];
+    if( !stmt )
     {
-        std::sort( bucket->begin(), bucket->end() );
         char buf[100];
-        sprintf( buf, "purge bucket %d, %d items", bucket_idx, count );
-        report( buf );
-        for( int j=0; j<count; j++ )
+        sprintf( buf, "INSERT INTO positions_%d VALUES(?,?)", row.table_nbr );
+        stmt = bulk_stmt( &stmt_insert_positions[row.table_nbr], buf );
+        if( !stmt )
+            return false;
+    }
+    sqlite3_bind_int( stmt, 1, row.game_id );
+    sqlite3_bind_int( stmt, 2, row.hash );
+    int retval = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    if( retval != SQLITE_DONE )
+    {
+        printf("sqlite3_step(INSERT 3) FAILED %s\n", sqlite3_errmsg(handle) );
+        return false;
+    }
+    return true;
+}
+
+// Merge all runs (plus the pending rows) and insert into the positions tables
+static void purge_buckets()
+{
+    purge_players();
+    purge_move_stats();
+    if( positions_count == 0 )
+        return;
+    char buf[100];
+    sprintf( buf, "insert positions, %lu rows, %d runs", positions_count, positions_sort.NbrRuns() );
+    report( buf );
+    POSITION_ROW row;
+    while( positions_sort.Next(row) )
+    {
+        if( !insert_position_row(row) )
+            break;
+    }
+    positions_sort.Clear();
+    positions_count = 0;
+    report( "insert positions end" );
+}
+
+/*
+ * Move statistics are accumulated the same way as position rows. Every move
+ *  of every game contributes a (position_hash,move,result) row, the rows are
+ *  externally sorted, then each run of equal (position_hash,move) rows is
+ *  summed into one move_stats row. When appending to a database that already
+ *  has stats, existing rows are updated in place. The counts are of games, a
+ *  game that plays the same move in the same position more than once (by
+ *  repetition) contributes one row. The positions tables are different, they
+ *  get a row for every ply, repeats and all, and the queries on them count
+ *  DISTINCT game_ids instead.
+ */
+struct MOVE_STATS_ROW
+{
+    uint64_t hash;          // position before the move
+    uint32_t move;          // thc::Move, as a 32 bit integer
+    int32_t  result;        // one of the MOVE_STATS_RESULT values below
+    bool operator <( const MOVE_STATS_ROW &other ) const
+    {
+        if( hash != other.hash )
+            return hash < other.hash;
+        return move < other.move;
+    }
+};
+enum { MOVE_STATS_RESULT_OTHER, MOVE_STATS_RESULT_WHITE_WINS, MOVE_STATS_RESULT_BLACK_WINS, MOVE_STATS_RESULT_DRAW };
+
+static ExternalSort<MOVE_STATS_ROW> move_stats_sort( MOVE_STATS_MEMORY_BUDGET );
+static unsigned long move_stats_count;
+
+static void add_move_stats_rows( const char *result, int nbr_moves, const thc::Move *moves, const uint64_t *hashes )
+{
+    static uint64_t start_hash[2];
+    if( start_hash[key_kind] == 0 )
+    {
+        thc::ChessRules cr;
+        start_hash[key_kind] = db_position_key( key_kind, cr );
+    }
+
+    // The position before the first move isn't in hashes[], it's taken to be
+    //  the standard start position. Skip any game that doesn't start there
+    //  (PgnRead doesn't pass on [FEN] games, so there shouldn't be any)
+    if( nbr_moves > 0 )
+    {
+        thc::ChessRules cr;
+        cr.PlayMove( moves[0] );
+        if( db_position_key(key_kind,cr) != hashes[0] )
+            return;
+    }
+    MOVE_STATS_ROW row;
+    row.result = MOVE_STATS_RESULT_OTHER;
+    if( 0 == strcmp(result,"1-0") )
+        row.result = MOVE_STATS_RESULT_WHITE_WINS;
+    else if( 0 == strcmp(result,"0-1") )
+        row.result = MOVE_STATS_RESULT_BLACK_WINS;
+    else if( 0 == strcmp(result,"1/2-1/2") )
+        row.result = MOVE_STATS_RESULT_DRAW;
+    static std::vector<MOVE_STATS_ROW> rows;
+    rows.clear();
+    for( int i=0; i<nbr_moves; i++ )
+    {
+        row.hash = (i==0 ? start_hash[key_kind] : hashes[i-1]);
+        memcpy( &row.move, &moves[i], sizeof(row.move) );
+        rows.push_back(row);
+    }
+
+    // Once per game, sorting brings any repeats together
+    std::sort( rows.begin(), rows.end() );
+    for( unsigned int i=0; i<rows.size(); i++ )
+    {
+        if( i==0 || rows[i-1]<rows[i] )
         {
-            std::pair<int,int> duo = (*bucket)[j];
-            sprintf( insert_buf, "INSERT INTO positions_%d VALUES(%d,%d)", bucket_idx, duo.second, duo.first );
-            int retval = sqlite3_exec( handle, insert_buf,0,0,&errmsg);
-            if( retval )
+            move_stats_sort.Add(rows[i]);
+            move_stats_count++;
+        }
+    }
+}
+
+// Insert a new move_stats row, or add to an existing one
+static bool upsert_move_stats( uint64_t hash, uint32_t move, const int counts[4], bool try_update )
+{
+    sqlite3_stmt *stmt;
+    if( try_update )
+    {
+        stmt = bulk_stmt( &stmt_update_move_stats, "UPDATE move_stats SET games=games+?, white_wins=white_wins+?, black_wins=black_wins+?, draws=draws+? WHERE position_hash=? AND move=?" );
+        if( !stmt )
+            return false;
+        sqlite3_bind_int  ( stmt, 1, counts[0] );
+        sqlite3_bind_int  ( stmt, 2, counts[MOVE_STATS_RESULT_WHITE_WINS] );
+        sqlite3_bind_int  ( stmt, 3, counts[MOVE_STATS_RESULT_BLACK_WINS] );
+        sqlite3_bind_int  ( stmt, 4, counts[MOVE_STATS_RESULT_DRAW] );
+        sqlite3_bind_int64( stmt, 5, (sqlite3_int64)hash );
+        sqlite3_bind_int  ( stmt, 6, (int)move );
+        int retval = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+        if( retval != SQLITE_DONE )
+        {
+            printf("sqlite3_step(UPDATE move_stats) FAILED %s\n", sqlite3_errmsg(handle) );
+            return false;
+        }
+        if( sqlite3_changes(handle) > 0 )
+            return true;
+    }
+    stmt = bulk_stmt( &stmt_insert_move_stats, "INSERT INTO move_stats VALUES(?,?,?,?,?,?)" );
+    if( !stmt )
+        return false;
+    sqlite3_bind_int64( stmt, 1, (sqlite3_int64)hash );
+    sqlite3_bind_int  ( stmt, 2, (int)move );
+    sqlite3_bind_int  ( stmt, 3, counts[0] );
+    sqlite3_bind_int  ( stmt, 4, counts[MOVE_STATS_RESULT_WHITE_WINS] );
+    sqlite3_bind_int  ( stmt, 5, counts[MOVE_STATS_RESULT_BLACK_WINS] );
+    sqlite3_bind_int  ( stmt, 6, counts[MOVE_STATS_RESULT_DRAW] );
+    int retval = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    if( retval != SQLITE_DONE )
+    {
+        printf("sqlite3_step(INSERT move_stats) FAILED %s\n", sqlite3_errmsg(handle) );
+        return false;
+    }
+    return true;
+}
+
+// Merge all runs, sum the rows for each (position,move) and write them to move_stats
+static void purge_move_stats()
+{
+    if( move_stats_count == 0 )
+        return;
+    char buf[100];
+    sprintf( buf, "move stats, %lu rows, %d runs", move_stats_count, move_stats_sort.NbrRuns() );
+    report( buf );
+
+    // Only need to look for existing rows if the table isn't empty to start with
+    bool try_update = false;
+    sqlite3_stmt *stmt;
+    if( 0 == sqlite3_prepare_v2( handle, "SELECT 1 FROM move_stats LIMIT 1", -1, &stmt, 0 ) )
+    {
+        try_update = (sqlite3_step(stmt) == SQLITE_ROW);
+        sqlite3_finalize(stmt);
+    }
+
+    // If the database already had games but no stats, it predates the stats
+    //  table and partial stats would be misleading, so leave it empty
+    if( !try_update && game_id_base > 0 )
+    {
+        report( "move stats skipped, database was created without them" );
+        move_stats_sort.Clear();
+        move_stats_count = 0;
+        return;
+    }
+    MOVE_STATS_ROW row, prev;
+    int counts[4] = {0,0,0,0};    // counts[0] is number of games
+    bool ok = true;
+    while( ok && move_stats_sort.Next(row) )
+    {
+        if( counts[0]>0 && (row.hash!=prev.hash || row.move!=prev.move) )
+        {
+            ok = upsert_move_stats( prev.hash, prev.move, counts, try_update );
+            counts[0] = counts[1] = counts[2] = counts[3] = 0;
+        }
+        counts[0]++;
+        if( row.result != MOVE_STATS_RESULT_OTHER )
+            counts[row.result]++;
+        prev = row;
+    }
+    if( ok && counts[0]>0 )
+        upsert_move_stats( prev.hash, prev.move, counts, try_update );
+    move_stats_sort.Clear();
+    move_stats_count = 0;
+    report( "move stats end" );
+}
+
+// Compress a game's moves into a blob buffer, return the number of bytes used
+int db_primitive_compress_moves( int nbr_moves, thc::Move *moves, char *blob_buf, int blob_buflen )
+{
+    CompressMoves press;
+    char *put = blob_buf;
+    for( int i=0; i<nbr_moves && put<blob_buf+blob_buflen-10; i++ )
+    {
+        thc::Move mv = moves[i];
+        int nbr = press.compress_move( mv, put );
+        if( nbr == 0 )
+            break;
+        put += nbr;
+    }
+    return (int)(put-blob_buf);
+}
+
+void db_primitive_insert_game_multi( const char *white, const char *black, const char *event, const char *site, const char *result, int nbr_moves, thc::Move *moves, uint64_t *hashes  )
+{
+    char blob_buf[1000];    // about 500 moves each
+    int blob_len = db_primitive_compress_moves( nbr_moves, moves, blob_buf, sizeof(blob_buf) );
+    db_primitive_insert_game_compressed( white, black, event, site, result, blob_buf, blob_len, nbr_moves, moves, hashes );
+}
+
+static void load_players()
+{
+    players.clear();
+    next_player_id = 1;
+    players_loaded = true;
+    players_changed = false;
+    sqlite3_stmt *stmt;
+    if( sqlite3_prepare_v2( handle, "SELECT player_id, name, white_games, white_games_before FROM players", -1, &stmt, 0 ) )
+    {
+        printf("SELECTING DATA FROM DB FAILED %s\n", sqlite3_errmsg(handle) );
+        return;
+    }
+    while( sqlite3_step(stmt) == SQLITE_ROW )
+    {
+        PLAYER p;
+        p.player_id = sqlite3_column_int(stmt,0);
+        p.white_games = 0;
+        p.white_games_total = sqlite3_column_int(stmt,2);
+        p.white_games_before = -1;
+        if( sqlite3_column_type(stmt,3) != SQLITE_NULL )
+            p.white_games_before = sqlite3_column_int(stmt,3);
+        else
+            players_changed = true;
+        const char *name = (const char *)sqlite3_column_text(stmt,1);
+        players[name?name:""] = p;
+        if( p.player_id >= next_player_id )
+            next_player_id = p.player_id+1;
+    }
+    sqlite3_finalize(stmt);
+}
+
+static int intern_player( const char *name, bool white )
+{
+    if( !players_loaded )
+        load_players();
+    std::map<std::string,PLAYER>::iterator it = players.find(name);
+    if( it == players.end() )
+    {
+        PLAYER p;
+        p.player_id = next_player_id++;
+        p.white_games = 0;
+        p.white_games_total = 0;
+        p.white_games_before = -1;
+        players_changed = true;
+        sqlite3_stmt *stmt = bulk_stmt( &stmt_insert_player, "INSERT INTO players(player_id,name,white_games) VALUES(?,?,0)" );
+        if( stmt )
+        {
+            sqlite3_bind_int ( stmt, 1, p.player_id );
+            sqlite3_bind_text( stmt, 2, name, -1, SQLITE_STATIC );
+            int retval = sqlite3_step(stmt);
+            sqlite3_reset(stmt);
+            if( retval != SQLITE_DONE )
+                printf("sqlite3_step(INSERT player) FAILED %s\n", sqlite3_errmsg(handle) );
+        }
+        it = players.insert( std::pair<std::string,PLAYER>(name,p) ).first;
+    }
+    if( white )
+    {
+        it->second.white_games++;
+        it->second.white_games_total++;
+        players_changed = true;
+    }
+    return it->second.player_id;
+}
+
+// Add the games each player has had as white since the last purge, and
+//  recalculate white_games_before. The map is in name order, the same as the
+//  players table's name index
+static void purge_players()
+{
+    std::map<std::string,PLAYER>::iterator it;
+    if( !players_changed )
+        return;
+    for( it=players.begin(); it!=players.end(); it++ )
+    {
+        if( it->second.white_games == 0 )
+            continue;
+        sqlite3_stmt *stmt = bulk_stmt( &stmt_update_player, "UPDATE players SET white_games=white_games+? WHERE player_id=?" );
+        if( !stmt )
+            return;
+        sqlite3_bind_int( stmt, 1, it->second.white_games );
+        sqlite3_bind_int( stmt, 2, it->second.player_id );
+        int retval = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+        if( retval != SQLITE_DONE )
+        {
+            printf("sqlite3_step(UPDATE player) FAILED %s\n", sqlite3_errmsg(handle) );
+            return;
+        }
+        it->second.white_games = 0;
+    }
+    int before = 0;
+    for( it=players.begin(); it!=players.end(); it++ )
+    {
+        if( it->second.white_games_before != before )
+        {
+            sqlite3_stmt *stmt = bulk_stmt( &stmt_update_player_before, "UPDATE players SET white_games_before=? WHERE player_id=?" );
+            if( !stmt )
+                return;
+            sqlite3_bind_int( stmt, 1, before );
+            sqlite3_bind_int( stmt, 2, it->second.player_id );
+            int retval = sqlite3_step(stmt);
+            sqlite3_reset(stmt);
+            if( retval != SQLITE_DONE )
             {
-                printf("sqlite3_exec(INSERT 3) FAILED %s\n", errmsg );
+                printf("sqlite3_step(UPDATE player) FAILED %s\n", sqlite3_errmsg(handle) );
                 return;
             }
+            it->second.white_games_before = before;
         }
-        bucket->clear();
+        before += it->second.white_games_total;
     }
+    players_changed = false;
 }
 
-void db_primitive_insert_game_multi( const char *white, const char *black, const char *event, const char *site, const char *result, int nbr_moves, thc::Move *moves, uint64_t *hashes  )
+// Insert a game whose moves have already been compressed
+void db_primitive_insert_game_compressed( const char *white, const char *black, const char *event, const char *site, const char *result,
+                                          const char *blob, int blob_len, int nbr_moves, const thc::Move *moves, const uint64_t *hashes )
 {
     //printf( "db_primitive_gameover(%s,%s)\n", white, black );
-    //uint32_t *move_ptr = (uint32_t *)moves;
-    char *errmsg;
-    char insert_buf[2000];
-    char blob_buf[1000];    // about 500 moves each
     char white_buf[200];
     char black_buf[200];
     strcpy( white_buf, white );
@@ -848,56 +1432,113 @@ void db_primitive_insert_game_multi( const char *white, const char *black, const
             *s = '_';
         s++;
     }
-    CompressMoves press;
-    char *put = blob_buf;
-    for( int i=0; i<nbr_moves && put<blob_buf+sizeof(blob_buf)-10; i++ )
+
+    // Bind the compressed moves directly as a BLOB, no hex X'...' literal
+    int white_id = intern_player( white_buf, true );
+    int black_id = intern_player( black_buf, false );
+    sqlite3_stmt *stmt = bulk_stmt( &stmt_insert_game, "INSERT INTO games VALUES(?,?,?,?,?,?,?)" );
+    if( stmt )
     {
-        char buf[2];
-        thc::Move mv = moves[i];
-        int nbr = press.compress_move( mv, buf );
-        /* std::string s = mv.TerseOut();
-         if( nbr == 1 )
-         printf( "compress temp> %s -> %02x\n", s.c_str(), buf[0]&0xff );
-         else if( nbr == 2 )
-         printf( "compress temp> %s -> %02x,%02x\n", s.c_str(), buf[0]&0xff, buf[1]&0xff );
-         else
-         printf( "nbr == 0 ?\n"); */
-        if( nbr == 0 )
-            break;
-        for( int j=0; j<nbr && j<2; j++ )
+        sqlite3_bind_int ( stmt, 1, game_id );
+        sqlite3_bind_text( stmt, 2, white_buf, -1, SQLITE_STATIC );
+        sqlite3_bind_text( stmt, 3, black_buf, -1, SQLITE_STATIC );
+        sqlite3_bind_text( stmt, 4, result,    -1, SQLITE_STATIC );
+        sqlite3_bind_blob( stmt, 5, blob, blob_len, SQLITE_STATIC );
+        sqlite3_bind_int ( stmt, 6, white_id );
+        sqlite3_bind_int ( stmt, 7, black_id );
+        int retval = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+        if( retval != SQLITE_DONE )
         {
-            char c = buf[j];
-            char hi = (c>>4)&0x0f;
-            *put++ = (hi>=10 ? hi-10+'A' : hi+'0');
-            char lo = c&0x0f;
-            *put++ = (lo>=10 ? lo-10+'A' : lo+'0');
+            printf("sqlite3_step(INSERT 1) FAILED %s\n", sqlite3_errmsg(handle) );
         }
-        //printf( "%s %s\n", (i<nbr_moves?"true":"false"), (put<blob_buf+sizeof(blob_buf-10) ? "true" ? "false") );
-    }
-    *put = '\0';
-    //printf( "%d %s\n", nbr_moves, blob_buf );
-    sprintf( insert_buf, "INSERT INTO games VALUES(%d,'%s','%s','%s',X'%s')", game_id, white_buf, black_buf, result, blob_buf );
-    //printf( "%s\n", insert_buf );
-    int retval = sqlite3_exec( handle, insert_buf,0,0,&errmsg);
-    if( retval )
-    {
-        printf("sqlite3_exec(INSERT 1) FAILED %s\n", errmsg );
     }
+    if( moves )
+        add_move_stats_rows( result, nbr_moves, moves, hashes );
     for( int i=0; i<nbr_moves; i++ )
     {
-        uint64_t hash64 = *hashes++;
+        uint64_t hash64 = hashes[i];
         int hash32 = (int)(hash64);
         int table_nbr = ((int)(hash64>>32))&(NBR_BUCKETS-1);
-        std::vector<std::pair<int,int>> *bucket = &buckets[table_nbr];
-        std::pair<int,int> duo(hash32,game_id);
-        bucket->push_back(duo);
-        int count = bucket->size();
-        if( count >= PURGE_QUOTA )
-            purge_bucket(table_nbr);
+        add_position_row( table_nbr, hash32, game_id );
     }
     game_id++;
 }
 
+// SQLite bumps the 4 byte big endian file change counter at offset 24 of the
+//  database header every time a transaction changes the database (we don't
+//  use WAL mode, which doesn't). Returns 0 if the file can't be read
+uint32_t db_file_change_counter( const char *db_filename )
+{
+    unsigned char buf[28];
+    FILE *f = fopen( db_filename, "rb" );
+    if( !f )
+        return 0;
+    size_t len = fread( buf, 1, sizeof(buf), f );
+    fclose(f);
+    if( len != sizeof(buf) )
+        return 0;
+    return ((uint32_t)buf[24]<<24) | ((uint32_t)buf[25]<<16) | ((uint32_t)buf[26]<<8) | buf[27];
+}
 
-
-
+// Build a standalone position index file (.tpi) from the games table. Each
+//  game is replayed from its compressed moves, so the index also records the
+//  ply at which every position is reached. The number of games and the
+//  database file change counter are recorded so Database can tell whether the
+//  index is still up to date
+bool db_primitive_build_position_index( const char *tpi_filename )
+{
+    uint32_t change_counter = db_file_change_counter( sqlite3_db_filename(handle,"main") );
+    sqlite3_stmt *stmt;
+    int retval = sqlite3_prepare_v2( handle, "SELECT game_id, moves FROM games", -1, &stmt, 0 );
+    if( retval )
+    {
+        printf("SELECTING DATA FROM DB FAILED %s\n", sqlite3_errmsg(handle) );
+        return false;
+    }
+    report( "position index, replay games" );
+    ExternalSort<TPI_RECORD> sort( POSITIONS_MEMORY_BUDGET );
+    int max_game_id = -1;
+    int nbr_games = 0;
+    while( (retval=sqlite3_step(stmt)) == SQLITE_ROW )
+    {
+        TPI_RECORD rec;
+        rec.game_id = sqlite3_column_int(stmt,0);
+        if( rec.game_id > max_game_id )
+            max_game_id = rec.game_id;
+        int len = sqlite3_column_bytes(stmt,1);
+        const char *blob = (const char*)sqlite3_column_blob(stmt,1);
+        CompressMoves press;
+        rec.ply = 0;
+        for( int nbr=0; blob && nbr<len; )
+        {
+            thc::Move mv;
+            int nbr_used = press.decompress_move( blob+nbr, mv );
+            if( nbr_used == 0 )
+                break;
+            nbr += nbr_used;
+            rec.hash = db_position_key( key_kind, press.cr );
+            rec.ply++;
+            sort.Add(rec);
+        }
+        nbr_games++;
+    }
+    sqlite3_finalize(stmt);
+    if( retval != SQLITE_DONE )
+    {
+        printf("SOME ERROR ENCOUNTERED %s\n", sqlite3_errmsg(handle) );
+        return false;
+    }
+    char buf[100];
+    sprintf( buf, "position index, write %d games, %d runs", nbr_games, sort.NbrRuns() );
+    report( buf );
+    PositionIndexWriter writer;
+    bool ok = writer.Begin( tpi_filename );
+    TPI_RECORD rec;
+    while( ok && sort.Next(rec) )
+        ok = writer.Add(rec);
+    ok = writer.End(max_game_id,key_kind,nbr_games,change_counter) && ok;
+    sprintf( buf, "position index, %s, %lu records, %lu positions", ok?"done":"FAILED", (unsigned long)writer.NbrRecords(), (unsigned long)writer.NbrKeys() );
+    report( buf );
+    return ok;
+}
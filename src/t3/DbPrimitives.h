@@ -17,12 +17,38 @@
 #ifdef THC_MAC
 #define DB_FILE             "/Users/billforster/Documents/ChessDatabases/rebuild.sqlite3"
 #define DB_MAINTENANCE_FILE "/Users/billforster/Documents/ChessDatabases/rebuild.sqlite3"
+#define DB_INDEX_FILE       "/Users/billforster/Documents/ChessDatabases/rebuild.tpi"
+#define DB_ANALYSIS_FILE    "/Users/billforster/Documents/ChessDatabases/analysis.sqlite3"
 #else
 #define DB_FILE             "/Users/Bill/Documents/T3Database/rebuild.sqlite3"
 #define DB_MAINTENANCE_FILE "/Users/Bill/Documents/T3Database/rebuild.sqlite3"
+#define DB_INDEX_FILE       "/Users/Bill/Documents/T3Database/rebuild.tpi"
+#define DB_ANALYSIS_FILE    "/Users/Bill/Documents/T3Database/analysis.sqlite3"
 #endif
 
 
+// Positions are found in the database by a 64 bit key. Databases built before
+//  ChessRules::Zobrist() was available use Hash64Calculate(), which only
+//  covers the squares, so positions differing only in side to move, castling
+//  or en passant share a key. New databases opt into the Zobrist key. The
+//  kind of key is recorded in the database as PRAGMA user_version
+enum DB_KEY_KIND
+{
+    DB_KEY_SQUARES = 0,
+    DB_KEY_ZOBRIST = 1
+};
+#define DB_KEY_KIND_NEW DB_KEY_ZOBRIST     // kind of key for new databases
+
+inline uint64_t db_position_key( DB_KEY_KIND kind, thc::ChessPosition &pos )
+{
+    return kind==DB_KEY_ZOBRIST ? pos.ZobristCalculate() : pos.Hash64Calculate();
+}
+
+// As above, but with no calculation needed for a Zobrist key
+inline uint64_t db_position_key( DB_KEY_KIND kind, thc::ChessRules &cr )
+{
+    return kind==DB_KEY_ZOBRIST ? cr.Zobrist() : cr.Hash64Calculate();
+}
 
 void db_primitive_open();
 void db_primitive_open_multi();
@@ -34,8 +60,15 @@ void db_primitive_create_indexes_multi();
 void db_primitive_create_extra_indexes();
 void db_primitive_close();
 int  db_primitive_count_games();
+int  db_primitive_nbr_games_appended();
+DB_KEY_KIND db_primitive_key_kind();
 void db_primitive_insert_game( const char *white, const char *black, const char *event, const char *site, const char *result, int nbr_moves, thc::Move *moves, uint32_t *hashes  );
 void db_primitive_insert_game_multi( const char *white, const char *black, const char *event, const char *site, const char *result, int nbr_moves, thc::Move *moves, uint64_t *hashes  );
+void db_primitive_insert_game_compressed( const char *white, const char *black, const char *event, const char *site, const char *result,
+                                          const char *blob, int blob_len, int nbr_moves, const thc::Move *moves, const uint64_t *hashes );
+int  db_primitive_compress_moves( int nbr_moves, thc::Move *moves, char *blob_buf, int blob_buflen );
+bool db_primitive_build_position_index( const char *tpi_filename );
+uint32_t db_file_change_counter( const char *db_filename );
 
 int  db_primitive_random_test_program();
 void db_primitive_show_games( bool connect );
@@ -0,0 +1,233 @@
+/****************************************************************************
+ *  Database query thread, runs the slow queries on a connection of its own
+ *   so the GUI stays responsive, and abandons them when they are superseded
+ *  Author:  Bill Forster
+ *  License: MIT license. Full text of license is in associated file LICENSE
+ *  Copyright 2010-2014, Bill Forster <billforsternz at gmail dot com>
+ ****************************************************************************/
+#define _CRT_SECURE_NO_DEPRECATE
+#include "wx/wx.h"
+#include "DebugPrintf.h"
+#include "DbQuery.h"
+
+DbQuery::DbQuery()
+{
+    handle = NULL;
+    quit = false;
+    have_pending = false;
+    next_id = 0;
+    latest_id = 0;
+    running_id = 0;
+}
+
+DbQuery::~DbQuery()
+{
+    Close();
+}
+
+bool DbQuery::Open( const char *db_file )
+{
+    Close();
+    if( SQLITE_OK != sqlite3_open_v2( db_file, &handle, SQLITE_OPEN_READONLY, NULL ) )
+    {
+        cprintf( "DbQuery: cannot open %s\n", db_file );
+        if( handle )
+            sqlite3_close(handle);
+        handle = NULL;
+        return false;
+    }
+    quit = false;
+
+    // sqlite3_interrupt() does nothing if it arrives before a statement
+    //  starts, so superseded queries also check for themselves
+    sqlite3_progress_handler( handle, 1000, ProgressHandler, this );
+    worker = std::thread( &DbQuery::Run, this );
+    return true;
+}
+
+// Called by SQLite every 1000 virtual machine instructions, a non zero
+//  return abandons the query with SQLITE_INTERRUPT
+int DbQuery::ProgressHandler( void *context )
+{
+    DbQuery *dq = (DbQuery *)context;
+    return dq->running_id != dq->latest_id;
+}
+
+void DbQuery::Close()
+{
+    if( worker.joinable() )
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            quit = true;
+            latest_id = ++next_id;
+            sqlite3_interrupt(handle);
+        }
+        cv.notify_one();
+        worker.join();
+    }
+    if( handle )
+        sqlite3_close(handle);
+    handle = NULL;
+}
+
+int DbQuery::Submit( DB_QUERY &query )
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    query.id = latest_id = ++next_id;
+    if( !worker.joinable() )
+    {
+        // No connection, report failure (or a count we already know) straight away
+        done = DB_QUERY_RESULT();
+        done.id    = query.id;
+        done.kind  = query.kind;
+        done.ok    = (query.kind==DB_QUERY_COUNT && query.count>=0);
+        done.count = done.ok ? query.count : 0;
+        Post( query, ID_DB_QUERY_DONE, 0 );
+        return query.id;
+    }
+    pending = query;
+    have_pending = true;
+
+    // Abandon the query in progress (if any). We hold the lock, so the worker
+    //  can't have started on the new query yet
+    sqlite3_interrupt(handle);
+    cv.notify_one();
+    return query.id;
+}
+
+void DbQuery::Cancel()
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    latest_id = ++next_id;
+    have_pending = false;
+    pending = DB_QUERY();
+    if( handle )
+        sqlite3_interrupt(handle);
+}
+
+bool DbQuery::TakeResult( int query_id, DB_QUERY_RESULT &result )
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    if( query_id!=latest_id || done.id!=query_id )
+        return false;
+    result = DB_QUERY_RESULT();
+    std::swap( result, done );
+    return true;
+}
+
+// Called with mtx held, so Cancel() and Submit() can't race with it
+void DbQuery::Post( DB_QUERY &query, int event_id, long extra )
+{
+    if( !query.dest || query.id!=latest_id )
+        return;
+    wxThreadEvent *event = new wxThreadEvent( wxEVT_THREAD, event_id );
+    event->SetInt( query.id );
+    event->SetExtraLong( extra );
+    wxQueueEvent( query.dest, event );
+}
+
+void DbQuery::Run()
+{
+    for(;;)
+    {
+        DB_QUERY query;
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            while( !quit && !have_pending )
+                cv.wait(lock);
+            if( quit )
+                return;
+            std::swap( query, pending );
+            have_pending = false;
+            running_id = query.id;
+        }
+        DB_QUERY_RESULT result;
+        result.id   = query.id;
+        result.kind = query.kind;
+        if( query.kind == DB_QUERY_COUNT )
+            result.ok = RunCount( query, result );
+        else
+            result.ok = RunGames( query, result );
+        std::lock_guard<std::mutex> lock(mtx);
+        if( query.id == latest_id )
+        {
+            std::swap( done, result );
+            Post( query, ID_DB_QUERY_DONE, 0 );
+        }
+    }
+}
+
+bool DbQuery::RunCount( DB_QUERY &query, DB_QUERY_RESULT &result )
+{
+    if( query.count >= 0 )
+    {
+        result.count = query.count;
+        return true;
+    }
+    sqlite3_stmt *stmt;
+    if( sqlite3_prepare_v2( handle, query.sql.c_str(), -1, &stmt, 0 ) )
+    {
+        cprintf( "DbQuery: SELECTING DATA FROM DB FAILED\n" );
+        return false;
+    }
+    int retval = sqlite3_step(stmt);
+    if( retval == SQLITE_ROW )
+        result.count = sqlite3_column_int(stmt,0);
+    sqlite3_finalize(stmt);
+    if( retval == SQLITE_INTERRUPT )
+        cprintf( "DbQuery: count %d superseded\n", query.id );
+    return retval == SQLITE_ROW;
+}
+
+bool DbQuery::RunGames( DB_QUERY &query, DB_QUERY_RESULT &result )
+{
+    bool by_id = (query.kind == DB_QUERY_GAMES_BY_ID);
+    const char *sql = by_id ? "SELECT game_id, white, black, result, moves from games WHERE game_id=?" : query.sql.c_str();
+    sqlite3_stmt *stmt;
+    if( sqlite3_prepare_v2( handle, sql, -1, &stmt, 0 ) )
+    {
+        cprintf( "DbQuery: SELECTING DATA FROM DB FAILED\n" );
+        return false;
+    }
+    int cols = sqlite3_column_count(stmt);
+    int expected = by_id ? (int)query.game_ids.size() : query.count;
+    int last_percent = 0;
+    int retval = SQLITE_DONE;
+    for( unsigned int i=0; query.id==latest_id; i++ )
+    {
+        if( by_id )
+        {
+            if( i >= query.game_ids.size() )
+                break;
+            sqlite3_reset(stmt);
+            sqlite3_bind_int( stmt, 1, query.game_ids[i] );
+        }
+        retval = sqlite3_step(stmt);
+        if( retval != SQLITE_ROW )
+        {
+            if( by_id && retval==SQLITE_DONE )
+                continue;   // game missing, skip it
+            break;
+        }
+        DB_GAME_INFO info;
+        db_read_game_columns( stmt, cols, info );
+        if( by_id )
+            info.ply = query.plies[i];
+        result.games.push_back( info );
+        int percent = (int)((result.games.size()*100) / (expected>0?expected:1));
+        if( percent > 100 )
+            percent = 100;
+        if( percent > last_percent )
+        {
+            last_percent = percent;
+            std::lock_guard<std::mutex> lock(mtx);
+            Post( query, ID_DB_QUERY_PROGRESS, percent );
+        }
+    }
+    sqlite3_finalize(stmt);
+    bool ok = (query.id==latest_id && (retval==SQLITE_DONE || (by_id && retval==SQLITE_ROW)));
+    result.count = (int)result.games.size();
+    cprintf( "DbQuery: %d games loaded%s\n", result.count, ok ? "" : ", superseded" );
+    return ok;
+}
@@ -0,0 +1,90 @@
+/****************************************************************************
+ *  Database query thread, runs the slow queries on a connection of its own
+ *   so the GUI stays responsive, and abandons them when they are superseded
+ *  Author:  Bill Forster
+ *  License: MIT license. Full text of license is in associated file LICENSE
+ *  Copyright 2010-2014, Bill Forster <billforsternz at gmail dot com>
+ ****************************************************************************/
+#ifndef DB_QUERY_H
+#define DB_QUERY_H
+#include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "sqlite3.h"
+#include "Database.h"
+
+// Read game_id, white, black, result, moves columns from a row (Database.cpp)
+void db_read_game_columns( sqlite3_stmt *stmt, int cols, DB_GAME_INFO &info );
+
+enum DB_QUERY_KIND
+{
+    DB_QUERY_COUNT,         // run sql, result is a single integer (or count if already known)
+    DB_QUERY_GAMES,         // run sql, rows are game_id, white, black, result, moves
+    DB_QUERY_GAMES_BY_ID    // read the games listed in game_ids
+};
+
+struct DB_QUERY
+{
+    DB_QUERY() { id=0; kind=DB_QUERY_COUNT; count=-1; dest=NULL; }
+    int id;
+    DB_QUERY_KIND kind;
+    std::string sql;
+    int count;                      // count if known, otherwise -1. For games, the
+                                    //  expected number of games (for progress)
+    std::vector<int> game_ids;      // DB_QUERY_GAMES_BY_ID only
+    std::vector<int> plies;
+    wxEvtHandler *dest;             // where to send ID_DB_QUERY_DONE/PROGRESS
+};
+
+struct DB_QUERY_RESULT
+{
+    DB_QUERY_RESULT() { id=0; kind=DB_QUERY_COUNT; ok=false; count=0; }
+    int id;
+    DB_QUERY_KIND kind;
+    bool ok;
+    int count;
+    std::vector<DB_GAME_INFO> games;
+};
+
+class DbQuery
+{
+public:
+    DbQuery();
+    ~DbQuery();
+    bool Open( const char *db_file );
+    void Close();
+
+    // Queue a query, any earlier query that hasn't finished is superseded
+    //  (interrupted if it is running). Returns the query id
+    int Submit( DB_QUERY &query );
+
+    // Abandon any outstanding query. No events for it are sent after this
+    void Cancel();
+
+    // Collect the result of a query after its ID_DB_QUERY_DONE event, returns
+    //  false if it has been superseded or cancelled in the meantime
+    bool TakeResult( int query_id, DB_QUERY_RESULT &result );
+
+private:
+    void Run();
+    bool RunCount( DB_QUERY &query, DB_QUERY_RESULT &result );
+    bool RunGames( DB_QUERY &query, DB_QUERY_RESULT &result );
+    void Post( DB_QUERY &query, int event_id, long extra );
+    static int ProgressHandler( void *context );
+    sqlite3 *handle;
+    std::thread worker;
+    std::mutex mtx;                 // protects everything below
+    std::condition_variable cv;
+    bool quit;
+    bool have_pending;
+    DB_QUERY pending;
+    DB_QUERY_RESULT done;
+    int next_id;
+    std::atomic<int> latest_id;     // only the most recent query is wanted
+    std::atomic<int> running_id;    // query the worker is running
+};
+
+#endif // DB_QUERY_H
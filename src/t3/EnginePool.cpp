@@ -0,0 +1,478 @@
+/****************************************************************************
+ * Engine pool - run several UCI engine processes at once to analyse
+ *  batches of games
+ *  Author:  Bill Forster
+ *  License: MIT license. Full text of license is in associated file LICENSE
+ *  Copyright 2010-2014, Bill Forster <billforsternz at gmail dot com>
+ ****************************************************************************/
+#define _CRT_SECURE_NO_DEPRECATE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include "DebugPrintf.h"
+#include "GameDocument.h"
+#include "GamesCache.h"
+#include "GameLogic.h"
+#include "Objects.h"
+#include "AnalysisCache.h"
+#include "EnginePool.h"
+using namespace std;
+using namespace thc;
+
+#define ENGINE_TIMEOUT_MS   20000   // for uciok, readyok and (beyond movetime) bestmove
+
+// One engine process, talked to synchronously by one worker thread at a time
+struct POOL_ENGINE
+{
+    pid_t  pid;
+    int    fd_read;
+    int    fd_write;
+    string pending;         // output read but not yet returned as a line
+    bool   dead;
+};
+
+// SIGPIPE is ignored (see EnginePool::Start()), so writing to an engine that
+//  has crashed fails with EPIPE and marks it dead
+static void engine_write_line( POOL_ENGINE &e, const string &s )
+{
+    string line = s + "\n";
+    const char *p = line.c_str();
+    size_t len = line.length();
+    while( !e.dead && len>0 )
+    {
+        ssize_t nbr_bytes = write( e.fd_write, p, len );
+        if( nbr_bytes < 0 && errno == EINTR )
+            continue;
+        if( nbr_bytes <= 0 )
+        {
+            e.dead = true;
+            break;
+        }
+        p   += nbr_bytes;
+        len -= nbr_bytes;
+    }
+}
+
+// Read a line of output, wait no more than timeout_ms (or forever if < 0)
+static bool engine_read_line( POOL_ENGINE &e, string &line, int timeout_ms )
+{
+    for(;;)
+    {
+        size_t offset = e.pending.find_first_of("\r\n");
+        if( offset != string::npos )
+        {
+            line = e.pending.substr(0,offset);
+            e.pending.erase(0,offset+1);
+            if( line.length() > 0 )
+                return true;
+            continue;
+        }
+        if( e.dead )
+            return false;
+        struct pollfd fds;
+        fds.fd = e.fd_read;
+        fds.events = POLLIN;
+        int ret = poll( &fds, 1, timeout_ms );
+        if( ret == 0 )
+            return false;   // timeout
+        if( ret < 0 )
+            continue;       // EINTR
+        char buf[4096];
+        int nbr_bytes = read( e.fd_read, buf, sizeof(buf) );
+        if( nbr_bytes <= 0 )
+        {
+            e.dead = true;
+            return false;
+        }
+        e.pending.append( buf, nbr_bytes );
+    }
+}
+
+// Read lines until one starts with a given token, returns false on timeout
+//  or if the engine dies
+static bool engine_wait_for( POOL_ENGINE &e, const char *token, int timeout_ms, vector<string> *lines=NULL )
+{
+    string line;
+    size_t len = strlen(token);
+    while( engine_read_line(e,line,timeout_ms) )
+    {
+        if( lines )
+            lines->push_back(line);
+        if( 0 == line.compare(0,len,token) && (line.length()==len || line[len]==' ') )
+            return true;
+    }
+    return false;
+}
+
+static POOL_ENGINE *engine_start( const char *engine_exe )
+{
+    int pipeto[2];      // pipe to feed the exec'ed program input
+    int pipefrom[2];    // pipe to get the exec'ed program output
+    if( pipe(pipeto) != 0 )
+        return NULL;
+    if( pipe(pipefrom) != 0 )
+    {
+        close( pipeto[0] );
+        close( pipeto[1] );
+        return NULL;
+    }
+    pid_t pid = fork();
+    if( pid < 0 )
+    {
+        close( pipeto[0] );
+        close( pipeto[1] );
+        close( pipefrom[0] );
+        close( pipefrom[1] );
+        return NULL;
+    }
+    if( pid == 0 )
+    {
+        dup2( pipeto[0], STDIN_FILENO );
+        dup2( pipefrom[1], STDOUT_FILENO  );
+        close( pipeto[0] );
+        close( pipeto[1] );
+        close( pipefrom[0] );
+        close( pipefrom[1] );
+        execlp( engine_exe, engine_exe, NULL );
+        _exit(255);
+    }
+    close( pipeto[0] );
+    close( pipefrom[1] );
+    POOL_ENGINE *e = new POOL_ENGINE;
+    e->pid      = pid;
+    e->fd_read  = pipefrom[0];
+    e->fd_write = pipeto[1];
+    e->dead     = false;
+    return e;
+}
+
+static void engine_stop( POOL_ENGINE *e )
+{
+    engine_write_line( *e, "quit" );
+    close( e->fd_write );
+
+    // Give it a little while to go quietly
+    string line;
+    while( engine_read_line(*e,line,2000) )
+        ;
+    close( e->fd_read );
+    if( 0 == waitpid(e->pid,NULL,WNOHANG) )
+    {
+        kill( e->pid, SIGKILL );
+        waitpid( e->pid, NULL, 0 );
+    }
+    delete e;
+}
+
+EnginePool::EnginePool()
+{
+}
+
+EnginePool::~EnginePool()
+{
+    Stop();
+}
+
+int EnginePool::Start( const ENGINE_POOL_CONFIG &config )
+{
+    Stop();
+    this->config = config;
+
+    // Otherwise a write to an engine that has crashed kills the whole program
+    signal( SIGPIPE, SIG_IGN );
+    int nbr_engines = config.nbr_engines;
+    if( nbr_engines <= 0 )
+    {
+        int nbr_cores = std::thread::hardware_concurrency();
+        int threads = config.threads_per_engine>0 ? config.threads_per_engine : 1;
+        nbr_engines = nbr_cores / threads;
+        if( nbr_engines <= 0 )
+            nbr_engines = 1;
+    }
+    for( int i=0; i<nbr_engines; i++ )
+    {
+        POOL_ENGINE *e = engine_start( config.engine_exe.c_str() );
+        if( !e )
+            break;
+
+        // Handshake, then set the options the engine has
+        vector<string> lines;
+        engine_write_line( *e, "uci" );
+        bool okay = engine_wait_for( *e, "uciok", ENGINE_TIMEOUT_MS, &lines );
+        bool have_threads=false, have_hash=false;
+        for( unsigned int j=0; okay && j<lines.size(); j++ )
+        {
+            const char *s = lines[j].c_str();
+            if( 0 == strncmp(s,"id name ",8) && engine_name.length()==0 )
+                engine_name = s+8;
+            else if( strstr(s,"option name Threads ") )
+                have_threads = true;
+            else if( strstr(s,"option name Hash ") )
+                have_hash = true;
+        }
+        char buf[100];
+        if( okay && have_threads && config.threads_per_engine>0 )
+        {
+            sprintf( buf, "setoption name Threads value %d", config.threads_per_engine );
+            engine_write_line( *e, buf );
+        }
+        if( okay && have_hash && config.hash_mb>0 )
+        {
+            sprintf( buf, "setoption name Hash value %d", config.hash_mb );
+            engine_write_line( *e, buf );
+        }
+        if( okay )
+        {
+            engine_write_line( *e, "isready" );
+            okay = engine_wait_for( *e, "readyok", ENGINE_TIMEOUT_MS );
+        }
+        if( !okay )
+        {
+            cprintf( "EnginePool: %s didn't start\n", config.engine_exe.c_str() );
+            engine_stop( e );
+            break;
+        }
+        engines.push_back( e );
+    }
+    cprintf( "EnginePool: %d engines started\n", (int)engines.size() );
+    return (int)engines.size();
+}
+
+void EnginePool::Stop()
+{
+    for( unsigned int i=0; i<engines.size(); i++ )
+        engine_stop( engines[i] );
+    engines.clear();
+}
+
+bool EnginePool::AnalysePosition( POOL_ENGINE &e, ChessRules &cr, ENGINE_ANALYSIS &analysis )
+{
+    analysis = ENGINE_ANALYSIS();
+    char buf[200];
+    engine_write_line( e, "position fen " + cr.ForsythPublish() );
+    if( config.depth > 0 )
+        sprintf( buf, "go depth %d", config.depth );
+    else
+        sprintf( buf, "go movetime %d", config.movetime_ms );
+    engine_write_line( e, buf );
+
+    // Keep the last principal variation (the first one, if multi-pv)
+    string info;
+    string line;
+    int timeout_ms = config.depth>0 ? -1 : config.movetime_ms+ENGINE_TIMEOUT_MS;
+    bool have_bestmove = false;
+    while( !have_bestmove && engine_read_line(e,line,timeout_ms) )
+    {
+        const char *s = line.c_str();
+        if( 0==strncmp(s,"info ",5) && strstr(s," pv ") &&
+            (!strstr(s," multipv ") || strstr(s," multipv 1 ")) )
+            info = line;
+        else if( 0 == strncmp(s,"bestmove",8) )
+            have_bestmove = true;
+    }
+
+    // If it timed out the engine is still searching, and the next position
+    //  would get this search's output. Stop it, and if it won't stop give up
+    //  on it
+    if( !have_bestmove && !e.dead )
+    {
+        engine_write_line( e, "stop" );
+        if( !engine_wait_for(e,"bestmove",ENGINE_TIMEOUT_MS) )
+            e.dead = true;
+        return false;
+    }
+    if( !have_bestmove || info.length()==0 )
+        return false;
+
+    // Interpret it the same way as GameLogic::KibitzUpdate()
+    analysis.info = info.substr(4);
+    const char *txt = info.c_str();
+    const char *s, *temp;
+    int rank_score_cp = 0;
+    s = strstr(txt,temp=" depth ");
+    if( s )
+        analysis.depth = atoi(s+strlen(temp));
+    s = strstr(txt,temp=" score cp ");
+    if( s )
+        rank_score_cp = atoi(s+strlen(temp));
+    s = strstr(txt,temp=" mate ");
+    if( s )
+    {
+        analysis.mate = atoi(s+strlen(temp));
+        if( analysis.mate > 0 )
+            rank_score_cp = 100000 - analysis.mate;
+        else if( analysis.mate < 0 )
+            rank_score_cp = -100000 - analysis.mate;
+    }
+    analysis.rank_score_cp = rank_score_cp;
+    analysis.score_cp = cr.WhiteToPlay() ? rank_score_cp : 0-rank_score_cp;
+    if( analysis.mate )
+        sprintf( buf, "#%d (depth %d)", analysis.mate, analysis.depth );
+    else
+        sprintf( buf, "%1.2f (depth %d)", ((double)analysis.score_cp)/100.0, analysis.depth );
+    analysis.txt = buf;
+    s = strstr(txt,temp=" pv ");
+    ChessRules cr_pv = cr;
+    const char *p = s+strlen(temp);
+    for(;;)
+    {
+        while( *p == ' ' )
+            p++;
+        Move move;
+        if( *p=='\0' || !move.TerseIn(&cr_pv,p) )
+            break;
+        analysis.pv.push_back( move );
+        cr_pv.PlayMove( move );
+        while( *p && *p!=' ' )
+            p++;
+    }
+    analysis.ok = (analysis.pv.size() > 0);
+    return analysis.ok;
+}
+
+void EnginePool::Analyse( vector< vector<ChessRules> > &games, vector< vector<ENGINE_ANALYSIS> > &results )
+{
+    results.clear();
+    results.resize( games.size() );
+    for( unsigned int i=0; i<games.size(); i++ )
+        results[i].resize( games[i].size() );
+    if( engines.size() == 0 )
+        return;
+
+    // Each engine takes the next game not yet taken, so one long game
+    //  doesn't leave the other engines idle
+    atomic<int> next(0);
+    atomic<int> nbr_done(0);
+    int nbr_games = (int)games.size();
+    auto worker = [&]( POOL_ENGINE *e )
+    {
+        int i;
+        while( !e->dead && (i=next++) < nbr_games )
+        {
+            engine_write_line( *e, "ucinewgame" );
+            for( unsigned int j=0; !e->dead && j<games[i].size(); j++ )
+                AnalysePosition( *e, games[i][j], results[i][j] );
+            int done = ++nbr_done;
+            if( done%10 == 0 || done==nbr_games )
+                cprintf( "EnginePool: %d of %d games analysed\n", done, nbr_games );
+        }
+    };
+    vector<thread> threads;
+    for( unsigned int t=1; t<engines.size(); t++ )
+        threads.push_back( thread(worker,engines[t]) );
+    worker( engines[0] );
+    for( unsigned int t=0; t<threads.size(); t++ )
+        threads[t].join();
+
+    // Games an engine died part way through are lost, its replacement is
+    //  left to the next Start()
+    for( unsigned int t=0; t<engines.size(); t++ )
+    {
+        if( engines[t]->dead )
+            cprintf( "EnginePool: engine %u died\n", t );
+    }
+
+    // Save the results for the kibitzer
+    AnalysisCache *cache = objs.analysis_cache;
+    if( cache )
+    {
+        cache->BeginBatch();
+        for( unsigned int i=0; i<games.size(); i++ )
+        {
+            for( unsigned int j=0; j<games[i].size(); j++ )
+            {
+                ENGINE_ANALYSIS &analysis = results[i][j];
+
+                // Bounds aren't real evaluations, remember exact scores only
+                if( !analysis.ok || strstr(analysis.info.c_str()," lowerbound") || strstr(analysis.info.c_str()," upperbound") )
+                    continue;
+                ANALYSIS_LINE line;
+                line.multipv  = 0;
+                line.depth    = analysis.depth;
+                line.score_cp = analysis.rank_score_cp;
+                line.engine_name = engine_name;
+                line.info     = analysis.info;
+                cache->Store( games[i][j].Zobrist(), line );
+            }
+        }
+        cache->EndBatch();
+    }
+}
+
+int EnginePool::AnnotateGames( GamesCache &gc )
+{
+    // Load the games, and list the positions before each main line move
+    vector<GameDocument *> docs;
+    vector< vector<ChessRules> > games;
+    for( unsigned int i=0; i<gc.gds.size(); i++ )
+    {
+        GameDocument *gd = gc.gds[i].get();
+        if( !gd->in_memory )
+        {
+            FILE *pgn_in = objs.gl->pf.ReopenRead( gd->pgn_handle );
+            if( pgn_in )
+            {
+                long fposn2 = gd->fposn2;
+                long end    = gd->fposn3;
+                fseek(pgn_in,fposn2,SEEK_SET);
+                long len = end-fposn2;
+                char *buf = new char [len];
+                if( len == (long)fread(buf,1,len,pgn_in) )
+                {
+                    std::string s(buf,len);
+                    thc::ChessRules cr;
+                    int nbr_converted;
+                    gd->PgnParse(true,nbr_converted,s,cr,NULL);
+                }
+                objs.gl->pf.Close( &objs.gl->gc_clipboard );
+                delete[] buf;
+            }
+        }
+        if( !gd->in_memory )
+            continue;
+        vector<ChessRules> positions;
+        ChessRules cr = gd->start_position;
+        VARIATION &main_line = gd->tree.variations[0];
+        for( unsigned int j=0; j<main_line.size(); j++ )
+        {
+            positions.push_back( cr );
+            cr.PlayMove( main_line[j].game_move.move );
+        }
+        docs.push_back( gd );
+        games.push_back( positions );
+    }
+
+    // Analyse them all, then write the results back on this thread
+    vector< vector<ENGINE_ANALYSIS> > results;
+    Analyse( games, results );
+    int nbr_annotated = 0;
+    for( unsigned int i=0; i<docs.size(); i++ )
+    {
+        bool annotated = false;
+        for( unsigned int j=0; j<results[i].size(); j++ )
+        {
+            ENGINE_ANALYSIS &analysis = results[i][j];
+            if( analysis.ok )
+            {
+                docs[i]->KibitzCaptureMainLine( j, engine_name.c_str(), analysis.txt.c_str(), analysis.pv );
+                annotated = true;
+            }
+        }
+        if( annotated )
+        {
+            docs[i]->Rebuild();
+            nbr_annotated++;
+        }
+    }
+    return nbr_annotated;
+}
@@ -0,0 +1,75 @@
+/****************************************************************************
+ * Engine pool - run several UCI engine processes at once to analyse
+ *  batches of games
+ *  Author:  Bill Forster
+ *  License: MIT license. Full text of license is in associated file LICENSE
+ *  Copyright 2010-2014, Bill Forster <billforsternz at gmail dot com>
+ ****************************************************************************/
+#ifndef ENGINE_POOL_H
+#define ENGINE_POOL_H
+#include <string>
+#include <vector>
+#include "ChessRules.h"
+
+class GamesCache;
+class GameDocument;
+
+struct ENGINE_POOL_CONFIG
+{
+    ENGINE_POOL_CONFIG() { nbr_engines=0; threads_per_engine=1; hash_mb=64; depth=0; movetime_ms=1000; }
+    std::string engine_exe;
+    int nbr_engines;            // 0 = enough to use every core
+    int threads_per_engine;     // UCI Threads option
+    int hash_mb;                // UCI Hash option
+    int depth;                  // search each position to this depth, or if 0 ..
+    int movetime_ms;            // .. for this long
+};
+
+// The last line of analysis the engine reported before its bestmove
+struct ENGINE_ANALYSIS
+{
+    ENGINE_ANALYSIS() { ok=false; depth=0; score_cp=0; rank_score_cp=0; mate=0; }
+    bool ok;
+    int  depth;
+    int  score_cp;              // white's point of view, like the kibitz display
+    int  rank_score_cp;         // side to move's point of view, mates as +-100000
+    int  mate;                  // moves to mate (side to move's point of view), 0 if none
+    std::vector<thc::Move> pv;
+    std::string txt;            // eg "0.35 (depth 18)", the kibitz format
+    std::string info;           // the engine's line, less the leading "info"
+};
+
+struct POOL_ENGINE;
+
+class EnginePool
+{
+public:
+    EnginePool();
+    ~EnginePool();
+
+    // Start the engines and wait for them to be ready, returns the number
+    //  started (0 if none could be)
+    int Start( const ENGINE_POOL_CONFIG &config );
+    void Stop();
+    const char *EngineName() { return engine_name.c_str(); }
+
+    // Analyse the positions of each game in turn, each game goes to the
+    //  next free engine. Blocks until all are done. The results are also
+    //  saved in the analysis cache, for the kibitzer
+    void Analyse( std::vector< std::vector<thc::ChessRules> > &games,
+                  std::vector< std::vector<ENGINE_ANALYSIS> > &results );
+
+    // Analyse the main line of each game in the cache (loading any that
+    //  aren't in memory), and write the evaluations and best lines into the
+    //  games. Returns the number of games annotated. Not called from any
+    //  menu or dialog yet
+    int AnnotateGames( GamesCache &gc );
+
+private:
+    bool AnalysePosition( POOL_ENGINE &e, thc::ChessRules &cr, ENGINE_ANALYSIS &analysis );
+    ENGINE_POOL_CONFIG config;
+    std::vector<POOL_ENGINE *> engines;
+    std::string engine_name;
+};
+
+#endif // ENGINE_POOL_H
@@ -0,0 +1,177 @@
+/****************************************************************************
+ *  Sort more records than fit in memory, using sorted runs in temporary
+ *  files and a k-way merge
+ *  Author:  Bill Forster
+ *  License: MIT license. Full text of license is in associated file LICENSE
+ *  Copyright 2010-2014, Bill Forster <billforsternz at gmail dot com>
+ ****************************************************************************/
+#ifndef EXTERNAL_SORT_H
+#define EXTERNAL_SORT_H
+#include <stdio.h>
+#include <vector>
+#include <queue>
+#include <algorithm>
+
+// T must be a plain old data type with an operator <, and no padding since
+//  records are written to the temporary files as they are in memory
+//  Usage: Add() all records, then Next() returns them in sorted order
+template <class T>
+class ExternalSort
+{
+public:
+    ExternalSort( size_t memory_budget, size_t read_buffer=4096 )
+    {
+        max_pending = memory_budget/sizeof(T);
+        if( max_pending < 1 )
+            max_pending = 1;
+        this->read_buffer = read_buffer;
+        merging = false;
+        pending_idx = 0;
+    }
+
+    ~ExternalSort()
+    {
+        Clear();
+    }
+
+    void Add( const T &rec )
+    {
+        // Grow towards the budget as needed, so a small sort doesn't take
+        //  all of it up front, and without overshooting it
+        if( pending.size() == pending.capacity() )
+        {
+            size_t n = pending.capacity()*2;
+            if( n < 1024 )
+                n = 1024;
+            pending.reserve( n<max_pending ? n : max_pending );
+        }
+        pending.push_back(rec);
+        if( pending.size() >= max_pending )
+            Spill();
+    }
+
+    // Number of sorted runs written to temporary files so far
+    int NbrRuns() const { return (int)runs.size(); }
+
+    // Return the next record in sorted order, false when all done
+    bool Next( T &rec )
+    {
+        if( !merging )
+            StartMerge();
+        if( runs.size() == 0 )
+        {
+            // Everything fitted in memory
+            if( pending_idx >= pending.size() )
+                return false;
+            rec = pending[pending_idx++];
+            return true;
+        }
+        if( heap.empty() )
+            return false;
+        HEAD head = heap.top();
+        heap.pop();
+        rec = head.first;
+        T next;
+        if( runs[head.second].Next(next) )
+            heap.push( HEAD(next,head.second) );
+        return true;
+    }
+
+    // Discard everything, ready to start again
+    void Clear()
+    {
+        for( size_t i=0; i<runs.size(); i++ )
+            fclose( runs[i].f );
+        runs.clear();
+        std::vector<T>().swap(pending);
+        heap = std::priority_queue< HEAD, std::vector<HEAD>, CMP >();
+        merging = false;
+        pending_idx = 0;
+    }
+
+private:
+
+    // Buffered reader for one sorted run
+    struct RUN
+    {
+        FILE *f;
+        std::vector<T> buf;
+        size_t idx;
+        size_t buf_size;
+        bool Next( T &rec )
+        {
+            if( idx >= buf.size() )
+            {
+                buf.resize( buf_size );
+                size_t nbr = fread( &buf[0], sizeof(T), buf_size, f );
+                buf.resize(nbr);
+                idx = 0;
+                if( nbr == 0 )
+                    return false;
+            }
+            rec = buf[idx++];
+            return true;
+        }
+    };
+    typedef std::pair<T,int> HEAD;     // smallest unmerged record of a run, run idx
+    struct CMP
+    {
+        bool operator()( const HEAD &a, const HEAD &b ) const { return b.first < a.first; }
+    };
+
+    // Sort the pending records and write them to a temporary file as a run
+    void Spill()
+    {
+        if( pending.size() == 0 )
+            return;
+        std::sort( pending.begin(), pending.end() );
+        FILE *f = tmpfile();
+        if( f && fwrite( &pending[0], sizeof(T), pending.size(), f ) == pending.size() )
+        {
+            RUN run;
+            run.f = f;
+            run.idx = 0;
+            run.buf_size = read_buffer;
+            runs.push_back(run);
+            pending.clear();
+        }
+        else
+        {
+            // Can't spill, keep going in memory instead
+            printf( "Cannot write temporary file for sort run\n" );
+            if( f )
+                fclose(f);
+            max_pending *= 2;
+        }
+    }
+
+    void StartMerge()
+    {
+        merging = true;
+        if( runs.size() == 0 )
+        {
+            std::sort( pending.begin(), pending.end() );
+            pending_idx = 0;
+            return;
+        }
+        Spill();
+        std::vector<T>().swap(pending);
+        for( size_t i=0; i<runs.size(); i++ )
+        {
+            rewind( runs[i].f );
+            T rec;
+            if( runs[i].Next(rec) )
+                heap.push( HEAD(rec,(int)i) );
+        }
+    }
+
+    size_t max_pending;
+    size_t read_buffer;
+    std::vector<T> pending;
+    size_t pending_idx;
+    std::vector<RUN> runs;
+    std::priority_queue< HEAD, std::vector<HEAD>, CMP > heap;
+    bool merging;
+};
+
+#endif // EXTERNAL_SORT_H
@@ -1247,6 +1247,46 @@ void GameDocument::KibitzCapture( MoveTree *node, const char *txt, std::vector<t
     }
 }
 
+// Like KibitzCaptureStart() but for batch analysis, so no display involved.
+//  Add the engine's line for the position before main line move imove, as a
+//  comment if the engine agrees with the move played, otherwise as a variation.
+//  Caller does the Rebuild()
+void GameDocument::KibitzCaptureMainLine( unsigned int imove, const char *engine_name, const char *txt, std::vector<thc::Move> &var )
+{
+    VARIATION &variation = tree.variations[0];
+    if( imove>=variation.size() || var.size()==0 )
+        return;
+    std::string tmp = txt;
+    int idx = tmp.find_first_of(')');
+    if( idx != std::string::npos )
+        tmp = tmp.substr(0,idx+1);
+    std::string s(engine_name);
+    s += " ";
+    s += tmp;
+    MoveTree &existing_node = variation[imove];
+    if( existing_node.game_move.move == var[0] )
+    {
+        std::string &comment = existing_node.game_move.comment;
+        if( comment.length() > 0 )
+            comment += " ";
+        comment += s;
+    }
+    else
+    {
+        VARIATION new_variation;
+        for( unsigned int i=0; i<var.size(); i++ )
+        {
+            MoveTree node;
+            node.game_move.move = var[i];
+            if( i == 0 )
+                node.game_move.pre_comment = s;
+            new_variation.push_back(node);
+        }
+        existing_node.variations.push_back( new_variation );
+    }
+    modified = true;
+}
+
 void GameDocument::Promote()
 {
     unsigned long pos = GetInsertionPoint();
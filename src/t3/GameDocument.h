@@ -114,6 +114,7 @@ public:
             GAME_MOVE &repeat_one_move      // eg variation = e4,c5 new_variation = Nf3,Nc6 etc.
                                             //  must make new_variation = c5,Nf3,Nc6 etc.
     );
+    void KibitzCaptureMainLine( unsigned int imove, const char *engine_name, const char *txt, std::vector<thc::Move> &var );
     void Promote();
     void Demote();
     bool PromotePaste( std::string &str );
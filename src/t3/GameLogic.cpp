@@ -37,6 +37,7 @@
 #include "CompressMoves.h"
 #include "Tabs.h"
 #include "Database.h"
+#include "AnalysisCache.h"
 using namespace std;
 using namespace thc;
 
@@ -67,6 +68,13 @@ GameLogic::GameLogic( Canvas *canvas, CtrlChessTxt *lb )
     engine_name[0] = '\0';
     under_our_program_control = false;
     kibitz_text_to_clear = false;
+    kibitz_cache_only = false;
+    kibitz_cache_key = 0;
+    for( int i=0; i<nbrof(kibitz_cache_depth); i++ )
+    {
+        kibitz_cache_depth[i] = 0;
+        kibitz_store[i].depth = 0;
+    }
     this->canvas = canvas;
     this->lb = lb;
     this->tabs = objs.tabs;
@@ -178,6 +186,7 @@ void GameLogic::ShowNewDocument()
 {
     human_or_pondering = HUMAN;
     kibitz = false;
+    KibitzCacheFlush();
     CmdClearKibitz(true);
     initial_position = gd.start_position;
     canvas->lb->SetGameDocument(&gd);
@@ -325,6 +334,7 @@ bool GameLogic::EngineChanged()
     if( kibitz )
     {
         kibitz = false;
+        KibitzCacheFlush();
         CmdClearKibitz();
     }
     if( objs.rybka )
@@ -461,15 +471,19 @@ void GameLogic::CmdKibitz()
                     char buf[128];
                     strcpy( buf, gd.master_position.ForsythPublish().c_str() );
                     ChessPosition pos = gd.master_position;
-                    objs.rybka->Kibitz( pos, buf );
+                    kibitz_pos = pos;
+                    if( !KibitzCacheLoad() )
+                        objs.rybka->Kibitz( pos, buf );
                 }
             }
             if( okay )
             {
                 kibitz = true;
                 kibitz_pos = gd.master_position;
+                kibitz_cache_key = kibitz_pos.ZobristCalculate();
                 objs.rybka->SuspendResume(true);
                 KibitzClearDisplay( true );
+                KibitzCacheShow();
             }
         }
         else
@@ -481,6 +495,7 @@ void GameLogic::CmdKibitz()
                 intro.sprintf( "Kibitzing by %s [stopped]", engine_name );
             canvas->Kibitz( 0, intro );
             kibitz = false;
+            KibitzCacheFlush();
             if( state!=THINKING && state!=PONDERING )
                 objs.rybka->KibitzStop();
             //objs.rybka->SuspendResume(false);
@@ -1946,10 +1961,11 @@ void GameLogic::OnIdle()
                             } while(!cleared);
                         }
                     }
+                    KibitzCacheShow();
                 }
                 if( !have_data )
                     break;
-                else
+                else if( !kibitz_cache_only )
                 {
                     DebugPrintf(( "Rybka kibitz; idx=%d, txt=%s\n", idx, buf ));
                     KibitzUpdate( idx, buf );
@@ -2533,8 +2549,16 @@ void GameLogic::NewState( GAME_STATE new_state, bool from_mouse_move )
             ChessPosition pos = gd.master_position;
             char buf[128];
             strcpy( buf, pos.ForsythPublish().c_str() );
-            kibitz_pos = pos;
-            objs.rybka->Kibitz( pos, buf );
+            if( !(pos == kibitz_pos) )
+            {
+                kibitz_pos = pos;
+                if( KibitzCacheLoad() )
+                    objs.rybka->KibitzStop();
+                else
+                    objs.rybka->Kibitz( pos, buf );
+            }
+            else if( !kibitz_cache_only )
+                objs.rybka->Kibitz( pos, buf );
         }
     }
     if( objs.rybka && (state==MANUAL||state==HUMAN||state==PONDERING||state==THINKING||(kibitz&&state==GAMEOVER) ) )
@@ -3379,7 +3403,7 @@ void GameLogic::CmdKibitzCaptureOne()
     }
 }
 
-void GameLogic::KibitzUpdate( int idx, const char *txt )
+void GameLogic::KibitzUpdate( int idx, const char *txt, bool from_cache )
 {
     wxString pv;
     bool have_moves=false;
@@ -3468,6 +3492,27 @@ void GameLogic::KibitzUpdate( int idx, const char *txt )
             }
         }
     }
+    if( !from_cache )
+    {
+        if( depth < kibitz_cache_depth[idx] )
+            return;     // keep showing the deeper cached line
+
+        // Bounds aren't real evaluations, remember exact scores only. The line
+        //  was read from gd.master_position, so make sure the kibitzer is
+        //  analysing that and not a stale position
+        if( have_moves && objs.analysis_cache && gd.master_position==kibitz_pos &&
+            !strstr(txt," lowerbound") && !strstr(txt," upperbound") )
+        {
+            if( kibitz_store[idx].depth>0 && depth>kibitz_store[idx].depth )
+                KibitzCacheFlush();
+            ANALYSIS_LINE &line = kibitz_store[idx];
+            line.multipv  = idx;
+            line.depth    = depth;
+            line.score_cp = rank_score_cp;
+            line.engine_name = engine_name;
+            line.info     = txt;
+        }
+    }
     if( !have_moves )
         candidate_move.Invalid();
     kibitz_pv   [idx] = pv;
@@ -3629,10 +3674,77 @@ void GameLogic::KibitzClearDisplay( bool intro )
         canvas->Kibitz(i+1, "" );
 }
 
+// Look for analysis of a new kibitz position (kibitz_pos) in the analysis
+//  cache, and show it straight away. Returns true if it's deep enough that the
+//  engine needn't be started
+bool GameLogic::KibitzCacheLoad()
+{
+    KibitzCacheFlush();     // lines for the previous position
+    kibitz_cache_key = kibitz_pos.ZobristCalculate();
+    bool had_cache = (kibitz_cache.size() > 0);
+    kibitz_cache.clear();
+    for( int i=0; i<nbrof(kibitz_cache_depth); i++ )
+        kibitz_cache_depth[i] = 0;
+    if( objs.analysis_cache )
+        objs.analysis_cache->Lookup( kibitz_cache_key, engine_name, kibitz_cache );
+    int min_depth = 0;
+    for( unsigned int i=0; i<kibitz_cache.size(); i++ )
+    {
+        ANALYSIS_LINE &line = kibitz_cache[i];
+        if( line.multipv<0 || line.multipv>=nbrof(kibitz_cache_depth) )
+            continue;
+        kibitz_cache_depth[line.multipv] = line.depth;
+        if( min_depth==0 || line.depth<min_depth )
+            min_depth = line.depth;
+    }
+    int target = objs.repository->engine.m_kibitz_cache_depth;
+    kibitz_cache_only = (target>0 && min_depth>=target);
+    if( had_cache || kibitz_cache.size()>0 )
+    {
+        KibitzClearDisplay( true );
+        KibitzClearMultiPV();
+        KibitzCacheShow();
+    }
+    return kibitz_cache_only;
+}
+
+// Write any waiting kibitz lines to the analysis cache, in one transaction
+void GameLogic::KibitzCacheFlush()
+{
+    if( !objs.analysis_cache )
+        return;
+    bool batch = false;
+    for( int i=0; i<nbrof(kibitz_store); i++ )
+    {
+        if( kibitz_store[i].depth > 0 )
+        {
+            if( !batch )
+                objs.analysis_cache->BeginBatch();
+            batch = true;
+            objs.analysis_cache->Store( kibitz_cache_key, kibitz_store[i] );
+            kibitz_store[i].depth = 0;
+        }
+    }
+    if( batch )
+        objs.analysis_cache->EndBatch();
+}
+
+void GameLogic::KibitzCacheShow()
+{
+    for( unsigned int i=0; i<kibitz_cache.size(); i++ )
+    {
+        ANALYSIS_LINE &line = kibitz_cache[i];
+        if( line.multipv>=0 && line.multipv<nbrof(kibitz_cache_depth) )
+            KibitzUpdate( line.multipv, line.info.c_str(), true );
+    }
+}
+
 void GameLogic::KibitzIntro()
 {
     wxString txt;
-    if( state == PONDERING )
+    if( kibitz_cache_only && kibitz_cache.size()>0 && (state==MANUAL||state==HUMAN||state==GAMEOVER) )
+        txt.sprintf( "Kibitzing by %s [cached]", kibitz_cache[0].engine_name.c_str() );
+    else if( state == PONDERING )
         txt.sprintf( "Analysis by %s [pondering %s]", engine_name, ponder_nmove_txt.c_str() );
     else if( state == THINKING )
         txt.sprintf( "Analysis by %s [running]", engine_name );
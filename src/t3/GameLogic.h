@@ -21,6 +21,7 @@
 #include "kibitzq.h"
 #include "Canvas.h"
 #include "GameState.h"
+#include "AnalysisCache.h"
 class GraphicBoard;
 
 class GameLogic
@@ -141,6 +142,9 @@ public:
     void StatusWarning();
     bool EditingLog();
 
+    // Write any waiting kibitz lines to the analysis cache
+    void KibitzCacheFlush();
+
 private:
 
     // Do a full undo operation (restore gameplay for non-MANUAL states)
@@ -163,7 +167,7 @@ private:
     bool StartPondering( thc::Move ponder );
 
     // Update kibitz while human thinking
-    void KibitzUpdate( int idx, const char *txt );
+    void KibitzUpdate( int idx, const char *txt, bool from_cache=false );
 
     // Update kibitz while engine thinking
     void KibitzUpdateEngineToMove( bool ponder, const char *txt );
@@ -201,6 +205,21 @@ private:
     void KibitzIntro();
     void KibitzClearMultiPV();
 
+    // Analysis of the kibitz position found in the analysis cache. Engine
+    //  lines shallower than the cached lines aren't shown
+    std::vector<ANALYSIS_LINE> kibitz_cache;
+    int                     kibitz_cache_depth[NBR_KIBITZ_LINES];
+    bool                    kibitz_cache_only;  // cached analysis deep enough, engine not running
+    bool KibitzCacheLoad();
+    void KibitzCacheShow();
+
+    // Engine lines for the kibitz position not yet written to the analysis
+    //  cache (depth 0 = none). The engine reports lines many times a second,
+    //  so they're written a batch at a time, when a line gets deeper or the
+    //  kibitz position changes
+    uint64_t                kibitz_cache_key;   // Zobrist() of kibitz_pos
+    ANALYSIS_LINE           kibitz_store[NBR_KIBITZ_LINES];
+
     // public data
 public:
     GAME_STATE state;
@@ -20,7 +20,10 @@
 #include "PgnFiles.h"
 #include "Lang.h"
 #include "GamesCache.h"
+#include "MemoryMap.h"
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
 using namespace std;
 
 static bool operator < (const smart_ptr<GameDocument>& left,
@@ -43,12 +46,166 @@ bool GamesCache::Load(std::string &filename )
     {
         pgn_filename = filename;
         gds.clear();
-        loaded = Load(pgn_file);
+
+        // Use the index if it was written for this version of the file,
+        //  otherwise scan the file and rewrite the index
+        time_t file_modification_time;
+        long filelen;
+        std::string idx_filename = filename + ".idx";
+        bool have_info = objs.gl->pf.GetFileInfo( pgn_handle, file_modification_time, filelen );
+        if( have_info && LoadIndex(idx_filename,file_modification_time,filelen) )
+            loaded = true;
+        else
+        {
+            gds.clear();
+            loaded = Load(pgn_file);
+            if( loaded && have_info )
+                SaveIndex(idx_filename,file_modification_time,filelen);
+        }
         objs.gl->pf.Close(NULL);  // clipboard only needed after ReopenModify()
     }
     return loaded;
 }
 
+// Sidecar index file format
+#define IDX_MAGIC   0x58444950      // "PIDX"
+#define IDX_VERSION 2       // 2: 64 bit file offsets
+
+// Read from the mapped index file, return false if past the end
+static bool idx_read( const char *&p, const char *end, void *dst, size_t len )
+{
+    if( (size_t)(end-p) < len )
+        return false;
+    memcpy( dst, p, len );
+    p += len;
+    return true;
+}
+
+static bool idx_read_str( const char *&p, const char *end, std::string &s )
+{
+    uint32_t len;
+    if( !idx_read(p,end,&len,sizeof(len)) || (size_t)(end-p) < len )
+        return false;
+    s.assign( p, len );
+    p += len;
+    return true;
+}
+
+static void idx_write_str( FILE *f, const std::string &s )
+{
+    uint32_t len = s.length();
+    fwrite( &len, sizeof(len), 1, f );
+    fwrite( s.c_str(), 1, len, f );
+}
+
+// Load games from the index, return true if the index is present, matches
+//  the .pgn file and is complete
+bool GamesCache::LoadIndex( const std::string &idx_filename, time_t file_modification_time, long filelen )
+{
+    MemoryMap idx_map;
+    if( !idx_map.Open(idx_filename.c_str(),true) )
+        return false;
+    const char *p   = idx_map.Data();
+    const char *end = p + idx_map.Length();
+    uint32_t magic=0, version=0, nbr_games=0;
+    int64_t idx_time=0, idx_len=0;
+    char lang[5];
+    int32_t nbr_with_moves=0;
+    bool ok = idx_read(p,end,&magic,sizeof(magic)) && magic==IDX_MAGIC &&
+              idx_read(p,end,&version,sizeof(version)) && version==IDX_VERSION &&
+              idx_read(p,end,&idx_time,sizeof(idx_time)) && idx_time==(int64_t)file_modification_time &&
+              idx_read(p,end,&idx_len,sizeof(idx_len)) && idx_len==(int64_t)filelen &&
+              idx_read(p,end,lang,sizeof(lang)) &&
+              idx_read(p,end,&nbr_with_moves,sizeof(nbr_with_moves)) &&
+              idx_read(p,end,&nbr_games,sizeof(nbr_games));
+    if( !ok )
+        return false;
+    gds.reserve( nbr_games );
+    GameDocument gd;
+    thc::ChessPosition initial_position;
+    for( uint32_t i=0; ok && i<nbr_games; i++ )
+    {
+        uint64_t fposn[4];
+        int32_t game_nbr;
+        std::string fen;
+        gd.Init(initial_position);
+        ok = idx_read(p,end,fposn,sizeof(fposn)) &&
+             idx_read(p,end,&game_nbr,sizeof(game_nbr)) &&
+             idx_read_str(p,end,gd.white)     && idx_read_str(p,end,gd.black) &&
+             idx_read_str(p,end,gd.event)     && idx_read_str(p,end,gd.site) &&
+             idx_read_str(p,end,gd.date)      && idx_read_str(p,end,gd.round) &&
+             idx_read_str(p,end,gd.result)    && idx_read_str(p,end,gd.eco) &&
+             idx_read_str(p,end,gd.white_elo) && idx_read_str(p,end,gd.black_elo) &&
+             idx_read_str(p,end,fen)          && idx_read_str(p,end,gd.prefix_txt) &&
+             idx_read_str(p,end,gd.moves_txt);
+        if( ok )
+        {
+            gd.fposn0 = fposn[0];
+            gd.fposn1 = fposn[1];
+            gd.fposn2 = fposn[2];
+            gd.fposn3 = fposn[3];
+            gd.game_nbr = game_nbr;
+            gd.pgn_handle = pgn_handle;
+            if( fen.length() > 0 )
+                gd.start_position.Forsyth(fen.c_str());
+            LangLine( gd.moves_txt, lang, LangGet() );
+            make_smart_ptr( GameDocument, new_doc, gd );
+            gds.push_back( new_doc );
+        }
+    }
+    if( !ok )
+    {
+        gds.clear();
+        return false;
+    }
+    game_nbr = nbr_with_moves;
+    return true;
+}
+
+// Write the index, any problem and the .pgn will just be scanned next time
+void GamesCache::SaveIndex( const std::string &idx_filename, time_t file_modification_time, long filelen )
+{
+    FILE *f = fopen( idx_filename.c_str(), "wb" );
+    if( !f )
+        return;
+    uint32_t magic=IDX_MAGIC, version=IDX_VERSION, nbr_games=gds.size();
+    int64_t idx_time=file_modification_time, idx_len=filelen;
+    int32_t nbr_with_moves=game_nbr;
+    fwrite( &magic, sizeof(magic), 1, f );
+    fwrite( &version, sizeof(version), 1, f );
+    fwrite( &idx_time, sizeof(idx_time), 1, f );
+    fwrite( &idx_len, sizeof(idx_len), 1, f );
+    fwrite( LangGet(), 5, 1, f );
+    fwrite( &nbr_with_moves, sizeof(nbr_with_moves), 1, f );
+    fwrite( &nbr_games, sizeof(nbr_games), 1, f );
+    thc::ChessPosition initial_position;
+    for( uint32_t i=0; i<nbr_games; i++ )
+    {
+        GameDocument *gd = gds[i].get();
+        uint64_t fposn[4] = { gd->fposn0, gd->fposn1, gd->fposn2, gd->fposn3 };
+        int32_t game_nbr = gd->game_nbr;
+        fwrite( fposn, sizeof(fposn), 1, f );
+        fwrite( &game_nbr, sizeof(game_nbr), 1, f );
+        idx_write_str( f, gd->white );
+        idx_write_str( f, gd->black );
+        idx_write_str( f, gd->event );
+        idx_write_str( f, gd->site );
+        idx_write_str( f, gd->date );
+        idx_write_str( f, gd->round );
+        idx_write_str( f, gd->result );
+        idx_write_str( f, gd->eco );
+        idx_write_str( f, gd->white_elo );
+        idx_write_str( f, gd->black_elo );
+        idx_write_str( f, gd->start_position==initial_position ? std::string("") : gd->start_position.ForsythPublish() );
+        idx_write_str( f, gd->prefix_txt );
+        idx_write_str( f, gd->moves_txt );
+    }
+    bool error = (ferror(f) != 0);
+    fclose(f);
+    if( error )
+        remove( idx_filename.c_str() );
+}
+
 bool GamesCache::IsLoaded()
 {
     return loaded;
@@ -59,6 +59,11 @@ private:     // Helpers
     // Check whether text s is a valid header, return true if it is,
     //  add info to a GameDocument, optionally clearing it first
     bool Tagline( GameDocument &gd,  const char *s );
+
+    // The sidecar index (filename.pgn.idx) saves rescanning a big .pgn
+    //  file that hasn't changed since the index was written
+    bool LoadIndex( const std::string &idx_filename, time_t file_modification_time, long filelen );
+    void SaveIndex( const std::string &idx_filename, time_t file_modification_time, long filelen );
 };
 
 #endif    // GAMES_CACHE_H
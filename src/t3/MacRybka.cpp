@@ -8,6 +8,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <poll.h>
 #include <sys/wait.h>
 #include <sys/time.h>
 
@@ -84,12 +85,6 @@ static void ErrorMessage( const char *filename_uci_exe, char *str )  //display d
 {
 }
 
-static int mac_fd_read;
-static int mac_fd_write;
-
-static fd_set mac_readfds;
-fd_set *mac_fd = &mac_readfds;
-
 
 unsigned long GetTickCount()
 {
@@ -122,24 +117,6 @@ void Sleep( int ms )
     select( 1, p, NULL, NULL, &tv );
 }
 
-int MacReadNonBlocking( int fd, char *buf, int max )
-{
-    int nbr_bytes = 0;
-    fd_set fds;
-    fd_set *p = &fds;
-    FD_ZERO(p);
-    FD_SET(fd,p);
-    struct timeval tv;
-    tv.tv_sec  = 0;
-    tv.tv_usec = 0;
-    select( fd+1, p, NULL, NULL, &tv );
-    if( FD_ISSET(fd,p) )
-    {
-        nbr_bytes = read(fd,buf,max);
-    }
-    return nbr_bytes;
-}
-
 void MacWrite( int fd, const char *buf )
 {
     write(fd,buf,strlen(buf));
@@ -188,6 +165,11 @@ Rybka::Rybka( const char *filename_uci_exe )
     custom4_first = true; 
 
     okay = false;
+    fd_read  = -1;
+    fd_write = -1;
+    fd_wake[0] = fd_wake[1] = -1;
+    reader_eof  = false;
+    wake_posted = false;
     suspended = false;
     first = true;
     gbl_move  = NULL;
@@ -248,9 +230,78 @@ Rybka::Rybka( const char *filename_uci_exe )
         //  get an EOF.
         close( pipeto[0] );
         close( pipefrom[1] );
-        mac_fd_read  = pipefrom[0];
-        mac_fd_write = pipeto[1];
-        okay = true;
+        fd_read  = pipefrom[0];
+        fd_write = pipeto[1];
+        if( pipe( fd_wake ) != 0 )
+        {
+            perror( "pipe() wake" );
+            fd_wake[0] = fd_wake[1] = -1;
+        }
+        else
+        {
+            reader = std::thread( &Rybka::ReaderThread, this );
+            okay = true;
+        }
+    }
+}
+
+// Block waiting for engine output, rather than polling for it from the GUI
+//  thread. Complete lines are queued for Run(), and the frame is sent an
+//  ID_ENGINE_OUTPUT event unless one is already on its way
+void Rybka::ReaderThread()
+{
+    std::string partial;
+    char buf[1024];
+    bool quit = false;
+    while( !quit )
+    {
+        struct pollfd fds[2];
+        fds[0].fd = fd_read;
+        fds[0].events = POLLIN;
+        fds[1].fd = fd_wake[0];
+        fds[1].events = POLLIN;
+        if( poll( fds, 2, -1 ) < 0 )
+            continue;   // EINTR
+        if( fds[1].revents )
+            break;
+        if( fds[0].revents == 0 )
+            continue;
+        int nbr_bytes = read( fd_read, buf, sizeof(buf) );
+        if( nbr_bytes <= 0 )
+        {
+            reader_eof = true;
+            quit = true;
+        }
+        bool have_line = false;
+        for( int i=0; i<nbr_bytes && !quit; i++ )
+        {
+            char c = buf[i];
+            if( c=='\n' || c=='\r' || partial.length()>=1022 )
+            {
+                if( partial.length() > 0 )
+                {
+                    // If the GUI falls behind, wait for it rather than lose
+                    //  lines (the engine blocks on its pipe meanwhile)
+                    while( !lines.Push(partial) )
+                    {
+                        struct pollfd wake;
+                        wake.fd = fd_wake[0];
+                        wake.events = POLLIN;
+                        if( poll( &wake, 1, 10 ) > 0 )
+                        {
+                            quit = true;
+                            break;
+                        }
+                    }
+                    have_line = true;
+                }
+                partial.clear();
+            }
+            else
+                partial += c;
+        }
+        if( (have_line || reader_eof) && !wake_posted.exchange(true) && objs.frame )
+            wxQueueEvent( objs.frame, new wxThreadEvent( wxEVT_THREAD, ID_ENGINE_OUTPUT ) );
     }
 }
 
@@ -518,24 +569,21 @@ void Rybka::Stop()
 bool Rybka::Run()
 {
     bool running;
-    char buf[1024+2];        //i/o buffer
-    //GetExitCodeProcess(pi.hProcess,&exit);      //check the process is running
-    running = true; //(exit==STILL_ACTIVE);
+
+    // Running until the engine closes its output and we've seen it all
+    wake_posted = false;
+    bool eof = reader_eof;
+    std::string line;
+    while( lines.Pop(line) )
+        line_out( line.c_str() );
+    running = !eof;
     if( running )
     {
-        int nbr_bytes = MacReadNonBlocking(mac_fd_read,buf,sizeof(buf)-2);
-        while( nbr_bytes > 0 )
-        {
-            DebugPrintfInner( "Read nbr_bytes=%d\n", nbr_bytes );
-            buf[nbr_bytes] = '\0';
-            user_hook_out(buf);
-            nbr_bytes = MacReadNonBlocking(mac_fd_read,buf,sizeof(buf)-2);
-        }
         const char *user_ptr = user_hook_in();
         if( user_ptr )      //check for user input.
         {
-            MacWrite(mac_fd_write,user_ptr);
-            MacWrite(mac_fd_write,"\n");
+            MacWrite(fd_write,user_ptr);
+            MacWrite(fd_write,"\n");
         }
     }
     return running;
@@ -543,6 +591,17 @@ bool Rybka::Run()
 
 Rybka::~Rybka()
 {
+    if( reader.joinable() )
+    {
+        MacWrite( fd_wake[1], "q" );
+        reader.join();
+    }
+    int fds[4] = { fd_read, fd_write, fd_wake[0], fd_wake[1] };
+    for( int i=0; i<4; i++ )
+    {
+        if( fds[i] >= 0 )
+            close( fds[i] );
+    }
 }
 
 #define DEPTH 8
@@ -1020,26 +1079,6 @@ const char *Rybka::user_hook_in()
     return s;
 }
 
-// Collect output from engine and break into lines
-void Rybka::user_hook_out( const char *s )
-{
-    static char buf[1024];
-    static int idx;
-    while( *s )
-    {
-        if( *s=='\n' || *s=='\r' || idx>=sizeof(buf)-2 )
-        {
-            buf[idx] = '\0';
-            if( buf[0] )
-                line_out(buf);
-            idx = 0;
-        }
-        else
-            buf[idx++] = *s;
-        s++;
-    }
-}
-
 // Interpret the output lines from UCI engine, print the relevant lines
 //  and advance the state machine when appropriate
 void Rybka::line_out( const char *s )
@@ -31,6 +31,8 @@ EVT_BUTTON( ID_MAINTENANCE_CMD_3, MaintenanceDialog::OnMaintenanceDecompress )
 EVT_BUTTON( ID_MAINTENANCE_CMD_4, MaintenanceDialog::OnMaintenanceVerify )
 EVT_BUTTON( ID_MAINTENANCE_CMD_5, MaintenanceDialog::OnMaintenanceCreate )
 EVT_BUTTON( ID_MAINTENANCE_CMD_6, MaintenanceDialog::OnMaintenanceExtraIndexes )
+EVT_BUTTON( ID_MAINTENANCE_CMD_7, MaintenanceDialog::OnMaintenancePgnReadSpeed )
+EVT_BUTTON( ID_MAINTENANCE_CMD_8, MaintenanceDialog::OnMaintenancePositionIndex )
 
 EVT_BUTTON( wxID_HELP, MaintenanceDialog::OnHelpClick )
 EVT_FILEPICKER_CHANGED( ID_TEMP_ENGINE_PICKER, MaintenanceDialog::OnFilePicked )
@@ -288,6 +290,12 @@ void MaintenanceDialog::CreateControls()
     wxButton* button_cmd_6 = new wxButton( this, ID_MAINTENANCE_CMD_6, wxT("&DANGER database add extra indexes"),
                                           wxDefaultPosition, wxDefaultSize, 0 );
     db_vert->Add( button_cmd_6, 0, wxALIGN_CENTER_VERTICAL|wxALL, 5);
+    wxButton* button_cmd_7 = new wxButton( this, ID_MAINTENANCE_CMD_7, wxT("&Test .pgn read speed"),
+                                          wxDefaultPosition, wxDefaultSize, 0 );
+    db_vert->Add( button_cmd_7, 0, wxALIGN_CENTER_VERTICAL|wxALL, 5);
+    wxButton* button_cmd_8 = new wxButton( this, ID_MAINTENANCE_CMD_8, wxT("&Build position index file .tpi"),
+                                          wxDefaultPosition, wxDefaultSize, 0 );
+    db_vert->Add( button_cmd_8, 0, wxALIGN_CENTER_VERTICAL|wxALL, 5);
     
     
     // A dividing line before the OK and Cancel buttons
@@ -423,6 +431,18 @@ void MaintenanceDialog::OnMaintenanceExtraIndexes( wxCommandEvent& WXUNUSED(even
     db_maintenance_create_extra_indexes();
 }
 
+// wxEVT_COMMAND_BUTTON_CLICKED event handler for ID_MAINTENANCE_CMD_7
+void MaintenanceDialog::OnMaintenancePgnReadSpeed( wxCommandEvent& WXUNUSED(event) )
+{
+    db_maintenance_pgn_read_speed_test( pgn_filename.c_str() );
+}
+
+// wxEVT_COMMAND_BUTTON_CLICKED event handler for ID_MAINTENANCE_CMD_8
+void MaintenanceDialog::OnMaintenancePositionIndex( wxCommandEvent& WXUNUSED(event) )
+{
+    db_maintenance_create_position_index();
+}
+
 
 
 
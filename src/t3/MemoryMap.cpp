@@ -0,0 +1,133 @@
+/****************************************************************************
+ *  Read only memory mapped file
+ *  Author:  Bill Forster
+ *  License: MIT license. Full text of license is in associated file LICENSE
+ *  Copyright 2010-2014, Bill Forster <billforsternz at gmail dot com>
+ ****************************************************************************/
+#include "Portability.h"
+#ifdef THC_WINDOWS
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include "MemoryMap.h"
+
+MemoryMap::MemoryMap()
+{
+    data = NULL;
+    len  = 0;
+    file_handle = NULL;
+    map_handle  = NULL;
+}
+
+MemoryMap::~MemoryMap()
+{
+    Close();
+}
+
+#ifdef THC_WINDOWS
+
+bool MemoryMap::Open( const char *filename, bool sequential )
+{
+    Close();
+    HANDLE hfile = CreateFileA( filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                                sequential ? FILE_FLAG_SEQUENTIAL_SCAN : FILE_ATTRIBUTE_NORMAL, NULL );
+    if( hfile == INVALID_HANDLE_VALUE )
+        return false;
+    LARGE_INTEGER size;
+    if( !GetFileSizeEx(hfile,&size) )
+    {
+        CloseHandle(hfile);
+        return false;
+    }
+    len = (size_t)size.QuadPart;
+    if( len == 0 )
+    {
+        CloseHandle(hfile);
+        data = "";     // an empty file maps to an empty, but valid, buffer
+        return true;
+    }
+    HANDLE hmap = CreateFileMappingA( hfile, NULL, PAGE_READONLY, 0, 0, NULL );
+    if( hmap == NULL )
+    {
+        CloseHandle(hfile);
+        len = 0;
+        return false;
+    }
+    data = (const char *)MapViewOfFile( hmap, FILE_MAP_READ, 0, 0, 0 );
+    if( data == NULL )
+    {
+        CloseHandle(hmap);
+        CloseHandle(hfile);
+        len = 0;
+        return false;
+    }
+    file_handle = hfile;
+    map_handle  = hmap;
+    return true;
+}
+
+void MemoryMap::Close()
+{
+    if( map_handle )
+    {
+        UnmapViewOfFile( data );
+        CloseHandle( (HANDLE)map_handle );
+        CloseHandle( (HANDLE)file_handle );
+    }
+    data = NULL;
+    len  = 0;
+    file_handle = NULL;
+    map_handle  = NULL;
+}
+
+#else
+
+bool MemoryMap::Open( const char *filename, bool sequential )
+{
+    Close();
+    int fd = open( filename, O_RDONLY );
+    if( fd < 0 )
+        return false;
+    struct stat st;
+    if( fstat(fd,&st) != 0 )
+    {
+        close(fd);
+        return false;
+    }
+    len = (size_t)st.st_size;
+    if( len == 0 )
+    {
+        close(fd);
+        data = "";     // an empty file maps to an empty, but valid, buffer
+        return true;
+    }
+    void *p = mmap( NULL, len, PROT_READ, MAP_PRIVATE, fd, 0 );
+    close(fd);          // the mapping keeps its own reference to the file
+    if( p == MAP_FAILED )
+    {
+        len = 0;
+        return false;
+    }
+    if( sequential )
+        madvise( p, len, MADV_SEQUENTIAL );
+    data = (const char *)p;
+    map_handle = p;
+    return true;
+}
+
+void MemoryMap::Close()
+{
+    if( map_handle )
+        munmap( map_handle, len );
+    data = NULL;
+    len  = 0;
+    file_handle = NULL;
+    map_handle  = NULL;
+}
+
+#endif
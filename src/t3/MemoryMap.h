@@ -0,0 +1,37 @@
+/****************************************************************************
+ *  Read only memory mapped file
+ *  Author:  Bill Forster
+ *  License: MIT license. Full text of license is in associated file LICENSE
+ *  Copyright 2010-2014, Bill Forster <billforsternz at gmail dot com>
+ ****************************************************************************/
+#ifndef MEMORY_MAP_H
+#define MEMORY_MAP_H
+#include <stddef.h>
+
+class MemoryMap
+{
+public:
+    MemoryMap();
+    ~MemoryMap();
+
+    // Map a whole file read only, return bool okay. Set sequential if
+    //  the file will be read from start to end, as a hint to the OS
+    bool Open( const char *filename, bool sequential=false );
+    void Close();
+
+    bool IsOpen() const         { return data != NULL; }
+    const char *Data() const    { return data; }
+    size_t Length() const       { return len; }
+
+private:
+    const char *data;
+    size_t len;
+    void *file_handle;      // Windows only
+    void *map_handle;       // Windows only
+
+    // Not copyable
+    MemoryMap( const MemoryMap & );
+    MemoryMap & operator=( const MemoryMap & );
+};
+
+#endif // MEMORY_MAP_H
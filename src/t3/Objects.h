@@ -21,6 +21,7 @@ class  Repository;
 class  Book;
 class  Log;
 class  Database;
+class  AnalysisCache;
 class  Session;
 class  Tabs;
 
@@ -37,6 +38,7 @@ public:
     Log          *log;
     Session      *session;
     Database     *db;
+    AnalysisCache *analysis_cache;
     CentralWorkSaver *cws;
 };
 
@@ -70,6 +70,17 @@ void PgnFiles::UpdateKnownFile( std::string &filename, time_t filetime_before, l
     }
 }
 
+// Get the length and time of a known file, return bool okay
+bool PgnFiles::GetFileInfo( int handle, time_t &file_modification_time, long &filelen )
+{
+    std::map<int,PgnFile>::iterator it = files.find(handle);
+    if( it == files.end() )
+        return false;
+    file_modification_time = it->second.file_modification_time;
+    filelen = it->second.filelen;
+    return true;
+}
+
 // Create a file and introduce it into the system
 FILE *PgnFiles::OpenCreate( std::string filename, int &handle )
 {
@@ -58,6 +58,9 @@ public:
     // If a modified file is known, update length and time
     void UpdateKnownFile( std::string &filename, time_t filetime_before, long filelen_before, long delta );
 
+    // Get the length and time of a known file, return bool okay
+    bool GetFileInfo( int handle, time_t &file_modification_time, long &filelen );
+
 private:
     bool IsAvailable( std::map<int,PgnFile>::iterator it );
     std::map<int,PgnFile> files;
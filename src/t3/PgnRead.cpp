@@ -19,9 +19,11 @@ using namespace thc;
 #define nbrof(array) ( sizeof(array) / sizeof((array)[0]) )
 
 // Constructor
-PgnRead::PgnRead( char callback_code )
+PgnRead::PgnRead( char callback_code, void *callback_context )
 {
     this->callback_code = callback_code;
+    this->callback_context = callback_context;
+    nag_value = 0;
     round   [0] = '\0';
     white_elo[0] = '\0';
     black_elo[0] = '\0';
@@ -39,6 +41,7 @@ PgnRead::PgnRead( char callback_code )
     site   [0] = '\0';
     move_order_type[0] = '\0';
     fen_flag = false;
+    zobrist_keys = false;
     nbr_games = 0;
     file_rep = NULL;
     file_inc = NULL;
@@ -132,10 +135,9 @@ bool PgnRead::Process( FILE *infile )
 {
     bool aborted = false;
     char buf[FIELD_BUFLEN+10];
-    static char comment_buf[10000];
     int ch, comment_ch=0, previous_ch=0, push_back=0, len=0, move_number=0;
+    bool header_quoted=false, header_escape=false;     // ']' in a quoted tag value doesn't end the tag
     STATE state=INIT, old_state, save_state=INIT;
-    static int nag_value;
     //fseek(infile,0,SEEK_END);
     //unsigned long file_len=ftell(infile);
     //rewind(infile);
@@ -313,6 +315,7 @@ bool PgnRead::Process( FILE *infile )
                     if( ch == '[' )
                     {
                         state = HEADER;
+                        header_quoted = header_escape = false;
                         push_back = ch;
                     }
                     else if( isascii(ch) && isdigit(ch) )
@@ -332,7 +335,15 @@ bool PgnRead::Process( FILE *infile )
                 {
                     if( len < FIELD_BUFLEN )
                         buf[len++] = (char)ch;
-                    if( ch == ']' )
+                    if( ch == '\n' )
+                        state = PREFIX;
+                    else if( header_escape )
+                        header_escape = false;
+                    else if( header_quoted && ch=='\\' )
+                        header_escape = true;
+                    else if( ch == '"' )
+                        header_quoted = !header_quoted;
+                    else if( ch==']' && !header_quoted )
                         state = PREFIX;
                     break;
                 }
@@ -545,6 +556,218 @@ bool PgnRead::Process( FILE *infile )
     return aborted;
 }
 
+// Characters that end a move or move number token in the buffer scanner
+static inline bool is_token_end( char c )
+{
+    switch( c )
+    {
+        case ' ':
+        case '\t':
+        case '\n':
+        case '\r':
+        case '.':
+        case '(':
+        case ')':
+        case '{':
+        case '}':
+        case '$':
+        case ';':
+        case '[':
+            return true;
+    }
+    return false;
+}
+
+// Buffer scanning version of Process(). Works through the text with pointer
+//  arithmetic, using memchr() to skip over tags and comments. The state is
+//  reduced to "which side moves next" (PRE_MOVE_WHITE, PRE_MOVE_BLACK or
+//  BETWEEN_MOVES when a move number is expected), otherwise follows the same
+//  rules as the character at a time state machine
+bool PgnRead::Process( const char *buf, size_t len )
+{
+    bool aborted = false;
+    char token[FIELD_BUFLEN+10];
+    const char *p   = buf;
+    const char *end = buf+len;
+    int move_number=0;
+    STATE state=BETWEEN_MOVES;
+    bool in_moves=false;    // true once movetext is seen, until game over
+    bool error=false;       // true if this game is abandoned, skip to next tag
+    if( p < end )
+        GameBegin();
+    while( p < end )
+    {
+        char c = *p;
+        switch( c )
+        {
+            case ' ':
+            case '\t':
+            case '\n':
+            case '\r':
+            case '}':
+            {
+                p++;
+                break;
+            }
+
+            // Tag, a tag after movetext starts a new game
+            case '[':
+            {
+                if( in_moves || error )
+                {
+                    if( error )
+                        GameReset();
+                    else
+                        GameOver();
+                    GameBegin();
+                    in_moves = false;
+                    error = false;
+                    state = BETWEEN_MOVES;
+                }
+                // The tag ends at the first ']' outside the quoted value, or
+                //  failing that at the end of the line
+                const char *next = p+1;
+                bool quoted = false;
+                while( next<end && *next!='\n' && (quoted || *next!=']') )
+                {
+                    if( quoted && *next=='\\' && next+1<end && next[1]!='\n' )
+                        next++;     // escaped '"' or '\\'
+                    else if( *next == '"' )
+                        quoted = !quoted;
+                    next++;
+                }
+                if( next<end && *next==']' )
+                    next++;
+                size_t n = next-p;
+                if( n > FIELD_BUFLEN )
+                    n = FIELD_BUFLEN;
+                memcpy( token, p, n );
+                token[n] = '\0';
+                Header( token );
+                p = next;
+                break;
+            }
+
+            // Comments
+            case '{':
+            {
+                const char *close = (const char *)memchr( p, '}', end-p );
+                p = close ? close+1 : end;
+                break;
+            }
+            case ';':
+            {
+                const char *eol = (const char *)memchr( p, '\n', end-p );
+                p = eol ? eol+1 : end;
+                break;
+            }
+
+            // NAG
+            case '$':
+            {
+                p++;
+                while( p<end && isascii(*p) && isdigit(*p) )
+                    p++;
+                break;
+            }
+
+            // Variations
+            case '(':
+            {
+                p++;
+                if( in_moves && !error )
+                    state = Push(state);
+                break;
+            }
+            case ')':
+            {
+                p++;
+                if( in_moves && !error )
+                {
+                    state = Pop();
+                    if( state == ERROR_STATE )
+                        error = true;
+                }
+                break;
+            }
+
+            // Move numbers, moves and results
+            default:
+            {
+                const char *start = p;
+                while( p<end && !is_token_end(*p) )
+                    p++;
+                if( p == start )    // stray '.'
+                {
+                    p++;
+                    break;
+                }
+                if( error )
+                    break;
+                size_t n = p-start;
+                if( n >= FIELD_BUFLEN )
+                {
+                    Error( "Internal buffer overflow" );
+                    error = true;
+                    break;
+                }
+                memcpy( token, start, n );
+                token[n] = '\0';
+                if( TestResult(token) )
+                {
+                    GameOver();
+                    GameBegin();
+                    in_moves = false;
+                    state = BETWEEN_MOVES;
+                }
+                else if( isascii(c) && isdigit(c) )
+                {
+                    in_moves = true;
+                    move_number = atoi(token);
+                    while( p<end && (*p==' ' || *p=='\t' || *p=='\n' || *p=='\r') )
+                        p++;
+                    int nbr_periods=0;
+                    while( p<end && *p=='.' )
+                    {
+                        nbr_periods++;
+                        p++;
+                    }
+                    if( move_number<=0 || nbr_periods==0 )
+                    {
+                        Error( "Bad move number" );
+                        error = true;
+                    }
+                    else
+                        state = (nbr_periods==1 ? PRE_MOVE_WHITE : PRE_MOVE_BLACK);
+                }
+                else if( state==PRE_MOVE_WHITE || state==PRE_MOVE_BLACK )
+                {
+                    bool white = (state==PRE_MOVE_WHITE);
+                    if( !DoMove(white,move_number,token) )
+                        error = true;
+                    else
+                        state = (white ? PRE_MOVE_BLACK : BETWEEN_MOVES);
+                }
+
+                // A move where a move number is expected. As with the character
+                //  at a time reader, a digit in it (eg "Nf3") is taken as the
+                //  start of a bad move number and the game is abandoned, a token
+                //  without digits (eg "O-O") is skipped
+                else if( strpbrk(token,"0123456789") )
+                {
+                    Error( "Bad move number" );
+                    error = true;
+                }
+                break;
+            }
+        }
+    }
+    if( in_moves && !error )
+        GameOver();
+    FileOver();
+    return aborted;
+}
+
 void PgnRead::Header( char *buf )
 {
 /* Examples
@@ -685,8 +908,13 @@ void PgnRead::GameOver()
     STACK_ELEMENT *s;
     s = &stack_array[0];
     if( !fen_flag )
-        hook_gameover( callback_code, event, site, date, round, white, black, result, white_elo, black_elo, eco, s->nbr_moves, s->big_move_array, s->big_hash_array  );
+        hook_gameover( callback_code, callback_context, event, site, date, round, white, black, result, white_elo, black_elo, eco, s->nbr_moves, s->big_move_array, s->big_hash_array  );
     //printf( "GameOver()\n" );
+    GameReset();
+}
+
+void PgnRead::GameReset()
+{
     stack_idx = 0;
     ChessRules temp;
     chess_rules = temp;    // init
@@ -837,9 +1065,12 @@ bool PgnRead::DoMove( bool white, int move_number, char *buf )
         {
             //std::string smove = move.NaturalOut( &chess_rules );
             //ChessPosition old_position = chess_rules;
-            hash = chess_rules.Hash64Update(hash, move );
+            if( !zobrist_keys )
+                hash = chess_rules.Hash64Update(hash, move );
             //db_hash(hash);
             chess_rules.PlayMove( move );
+            if( zobrist_keys )
+                hash = chess_rules.Zobrist();
          /* uint32_t check = chess_rules.HashCalculate();
             if( hash != check )
             {
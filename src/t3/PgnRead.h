@@ -6,6 +6,7 @@
  ****************************************************************************/
 #ifndef PGN_READ_H
 #define PGN_READ_H
+#include <stdio.h>
 #include "thc.h"
 #include <vector>
 #include <algorithm>
@@ -13,7 +14,7 @@
 #define FIELD_BUFLEN 200
 
 // Callback
-void hook_gameover( char callback_code, const char *event, const char *site, const char *date, const char *round,
+void hook_gameover( char callback_code, void *callback_context, const char *event, const char *site, const char *date, const char *round,
                    const char *white, const char *black, const char *result, const char *white_elo, const char *black_elo, const char *eco,
                    int nbr_moves, thc::Move *moves, uint64_t *hashes );
 
@@ -23,12 +24,24 @@ class PgnRead
 public:
 
     // Constructor
-    PgnRead( char callback_code );
+    PgnRead( char callback_code, void *callback_context=NULL );
 
+    // Read games from a file
     bool Process( FILE *infile );
 
+    // Read games from a memory buffer (eg a memory mapped file). Scans the
+    //  buffer directly rather than a character at a time, much faster than
+    //  Process(FILE*) and calls hook_gameover() in the same way
+    bool Process( const char *buf, size_t len );
+
+    // Pass Zobrist keys (thc::ChessRules::Zobrist()) to hook_gameover()
+    //  rather than the older squares only Hash64Update() hashes
+    void UseZobristKeys( bool zobrist ) { zobrist_keys = zobrist; }
+
 private:
     char callback_code;
+    void *callback_context;
+
 
     // PGN parsing stuff, still old school
     char fen    [ FIELD_BUFLEN + 10];
@@ -50,6 +63,8 @@ private:
     char move_order_type[FIELD_BUFLEN + 10];
 
     // Misc
+    char comment_buf[10000];
+    int nag_value;
     bool fen_flag;
     int nbr_games;
     FILE *debug_log_file_txt;
@@ -57,6 +72,7 @@ private:
     FILE *file_inc;
     thc::ChessRules chess_rules;
     uint64_t hash;
+    bool zobrist_keys;
 
     // Object state
     enum STATE
@@ -114,6 +130,7 @@ private:
     bool DoMove( bool white, int move_number, char *buf );
     void GameBegin();
     void GameOver();
+    void GameReset();
     void FileOver();
     void Error( const char *msg );
 
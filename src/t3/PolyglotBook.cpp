@@ -0,0 +1,123 @@
+/****************************************************************************
+ * Polyglot (.bin) opening book reader
+ *  Author:  Bill Forster
+ *  License: MIT license. Full text of license is in associated file LICENSE
+ *  Copyright 2010-2014, Bill Forster <billforsternz at gmail dot com>
+ ****************************************************************************/
+#define _CRT_SECURE_NO_DEPRECATE
+#include <stdio.h>
+#include <string.h>
+#include "Book.h"
+#include "PolyglotBook.h"
+using namespace std;
+using namespace thc;
+
+PolyglotBook::PolyglotBook()
+{
+    entries = NULL;
+    nbr_entries = 0;
+}
+
+// Map a .bin book, Return bool error
+bool PolyglotBook::Load( wxString &error_msg, wxString &bin_file )
+{
+    Close();
+    const char *bin_in = bin_file.c_str();
+    if( !book_map.Open(bin_in) )
+    {
+        error_msg.Printf( "Cannot open %s for reading", bin_in );
+        return true;
+    }
+    if( book_map.Length()==0 || book_map.Length()%ENTRY_SIZE != 0 )
+    {
+        error_msg.Printf( "File %s is not a Polyglot book file", bin_in );
+        Close();
+        return true;
+    }
+    entries = (const unsigned char *)book_map.Data();
+    nbr_entries = (uint32_t)(book_map.Length() / ENTRY_SIZE);
+    return false;
+}
+
+void PolyglotBook::Close()
+{
+    entries = NULL;
+    nbr_entries = 0;
+    play_position_counts.clear();
+    book_map.Close();
+}
+
+uint64_t PolyglotBook::EntryKey( uint32_t idx ) const
+{
+    const unsigned char *p = entries + idx*ENTRY_SIZE;
+    uint64_t key = 0;
+    for( int i=0; i<8; i++ )
+        key = (key<<8) | p[i];
+    return key;
+}
+
+// Lookup moves, weights are returned as BookMove counts, return true
+//  if any moves found
+bool PolyglotBook::Lookup( ChessPosition &pos, vector<BookMove> &bmoves )
+{
+    bmoves.clear();
+    if( !entries )
+        return false;
+
+    // Binary search for the first entry with this key
+    uint64_t key = pos.PolyglotKey();
+    uint32_t lo=0, hi=nbr_entries;
+    while( lo < hi )
+    {
+        uint32_t mid = lo + (hi-lo)/2;
+        if( EntryKey(mid) < key )
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+
+    // Polyglot moves are to file, to rank, from file, from rank, promotion
+    //  (3 bits each). Castling is king captures own rook, eg e1h1
+    ChessRules cr = pos;
+    for( uint32_t idx=lo; idx<nbr_entries && EntryKey(idx)==key; idx++ )
+    {
+        const unsigned char *p = entries + idx*ENTRY_SIZE;
+        unsigned int move   = (p[8]<<8)  | p[9];
+        unsigned int weight = (p[10]<<8) | p[11];
+        unsigned int promotion = (move>>12) & 7;    // 1=knight .. 4=queen
+        if( weight == 0 )
+            continue;   // kept in the book to say don't play it
+        char terse[6];
+        terse[0] = 'a' + ((move>>6)&7);
+        terse[1] = '1' + ((move>>9)&7);
+        terse[2] = 'a' + (move&7);
+        terse[3] = '1' + ((move>>3)&7);
+        terse[4] = (promotion>=1 && promotion<=4) ? "nbrq"[promotion-1] : '\0';
+        terse[5] = '\0';
+        if( 0==memcmp(terse,"e1",2) && pos.squares[e1]=='K' && terse[3]=='1' )
+        {
+            if( terse[2]=='h' )
+                terse[2] = 'g';
+            else if( terse[2]=='a' )
+                terse[2] = 'c';
+        }
+        else if( 0==memcmp(terse,"e8",2) && pos.squares[e8]=='k' && terse[3]=='8' )
+        {
+            if( terse[2]=='h' )
+                terse[2] = 'g';
+            else if( terse[2]=='a' )
+                terse[2] = 'c';
+        }
+        BookMove bm;
+        if( bm.move.TerseIn(&cr,terse) )
+        {
+            bm.count = weight;
+            bm.play_position_count = &play_position_counts[idx];
+            bmoves.push_back(bm);
+        }
+    }
+
+    // Most popular first, like Book::Lookup()
+    sort( bmoves.rbegin(), bmoves.rend() );
+    return bmoves.size() > 0;
+}
@@ -0,0 +1,45 @@
+/****************************************************************************
+ * Polyglot (.bin) opening book reader
+ *  Author:  Bill Forster
+ *  License: MIT license. Full text of license is in associated file LICENSE
+ *  Copyright 2010-2014, Bill Forster <billforsternz at gmail dot com>
+ ****************************************************************************/
+#ifndef POLYGLOT_BOOK_H
+#define POLYGLOT_BOOK_H
+#include "wx/wx.h"
+#include "ChessRules.h"
+#include "MemoryMap.h"
+#include <stdint.h>
+#include <vector>
+#include <map>
+
+struct BookMove;
+
+class PolyglotBook
+{
+public:
+    PolyglotBook();
+
+    // Map a .bin book, Return bool error
+    bool Load( wxString &error_msg, wxString &bin_file );
+    void Close();
+    bool IsLoaded() const { return book_map.IsOpen(); }
+
+    // Lookup moves, weights are returned as BookMove counts, return true
+    //  if any moves found
+    bool Lookup( thc::ChessPosition &pos, std::vector<BookMove> &bmoves );
+
+private:
+
+    // The file is an array of these sorted by key. All fields big endian
+    enum { ENTRY_SIZE = 16 };   // key(8) move(2) weight(2) learn(4)
+    MemoryMap book_map;
+    const unsigned char *entries;
+    uint32_t nbr_entries;
+    uint64_t EntryKey( uint32_t idx ) const;
+
+    // How many times each entry has been played in human-machine sessions
+    std::map<uint32_t,unsigned int> play_position_counts;
+};
+
+#endif // POLYGLOT_BOOK_H
@@ -0,0 +1,408 @@
+/****************************************************************************
+ *  Position index file (.tpi), a memory mapped alternative to the SQLite
+ *  positions_N tables for finding the games that reach a position
+ *  Author:  Bill Forster
+ *  License: MIT license. Full text of license is in associated file LICENSE
+ *  Copyright 2010-2014, Bill Forster <billforsternz at gmail dot com>
+ ****************************************************************************/
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <string.h>
+#include "PositionIndex.h"
+
+#define FAN_OUT_SHIFT 48       // top 16 bits of the hash select a fan out slot
+
+// Unsigned LEB128, 7 bits per byte, low bits first, top bit set if more follow
+static const unsigned char *varint_get( const unsigned char *p, const unsigned char *end, uint32_t &val )
+{
+    val = 0;
+    for( int shift=0; p<end && shift<35; shift+=7 )
+    {
+        unsigned char c = *p++;
+        val |= ((uint32_t)(c&0x7f)) << shift;
+        if( (c&0x80) == 0 )
+            return p;
+    }
+    return NULL;    // truncated or corrupt
+}
+
+static void varint_put( std::vector<unsigned char> &buf, uint32_t val )
+{
+    while( val >= 0x80 )
+    {
+        buf.push_back( (unsigned char)(val|0x80) );
+        val >>= 7;
+    }
+    buf.push_back( (unsigned char)val );
+}
+
+PostingCursor::PostingCursor()
+{
+    begin = end = p = NULL;
+    count = idx = 0;
+    game_id = ply = 0;
+}
+
+void PostingCursor::Rewind()
+{
+    p = begin;
+    idx = 0;
+}
+
+bool PostingCursor::Next( int &game_id, int &ply )
+{
+    if( idx >= count )
+        return false;
+    if( begin == NULL )
+    {
+        // Single game held inline in the key, already in game_id,ply
+        idx++;
+        game_id = this->game_id;
+        ply     = this->ply;
+        return true;
+    }
+    uint32_t delta, val;
+    const unsigned char *q = varint_get( p, end, delta );
+    if( q )
+        q = varint_get( q, end, val );
+    if( !q )
+    {
+        printf( "Position index posting list is corrupt\n" );
+        count = idx;
+        return false;
+    }
+    p = q;
+    this->game_id = (idx==0 ? (int)delta : this->game_id-(int)delta);
+    this->ply     = (int)val;
+    idx++;
+    game_id = this->game_id;
+    ply     = this->ply;
+    return true;
+}
+
+bool PostingCursor::Seek( int idx, int &game_id, int &ply )
+{
+    if( idx<0 || idx>=count )
+        return false;
+    if( idx+1 == this->idx )
+    {
+        game_id = this->game_id;
+        ply     = this->ply;
+        return true;
+    }
+    if( idx < this->idx && begin )
+        Rewind();
+    else if( !begin )
+        this->idx = 0;
+    while( this->idx <= idx )
+    {
+        if( !Next(game_id,ply) )
+            return false;
+    }
+    return true;
+}
+
+PositionIndex::PositionIndex()
+{
+    data = NULL;
+    fan_out = NULL;
+    keys = NULL;
+    nbr_keys = 0;
+    keys_offset = 0;
+    max_game_id = -1;
+    key_kind = 0;
+    nbr_games = -1;
+    change_counter = 0;
+}
+
+bool PositionIndex::Open( const char *filename )
+{
+    Close();
+    if( !mm.Open(filename) )
+        return false;
+    const char *base = mm.Data();
+    size_t len = mm.Length();
+    size_t postings_offset = sizeof(TPI_HEADER) + (TPI_FAN_OUT+1)*sizeof(uint64_t);
+    const TPI_HEADER *header = (const TPI_HEADER *)base;
+    bool ok = (len >= postings_offset);
+    if( ok )
+        ok = (0==memcmp(header->magic,TPI_MAGIC,sizeof(header->magic)) && header->version==TPI_VERSION);
+    if( ok )
+        ok = (header->keys_offset >= postings_offset && header->keys_offset%sizeof(uint64_t) == 0 &&
+              len == header->keys_offset + header->nbr_keys*sizeof(TPI_KEY));
+    if( !ok )
+    {
+        printf( "Position index %s is not valid, rebuild it\n", filename );
+        mm.Close();
+        return false;
+    }
+
+    // FindKey() trusts the fan out table to keep it within the keys, so check
+    //  it starts at zero, never decreases and ends at nbr_keys
+    const uint64_t *slots = (const uint64_t *)(base + sizeof(TPI_HEADER));
+    ok = (slots[0]==0 && slots[TPI_FAN_OUT]==header->nbr_keys);
+    for( unsigned int i=1; ok && i<=TPI_FAN_OUT; i++ )
+        ok = (slots[i-1] <= slots[i]);
+    if( !ok )
+    {
+        printf( "Position index %s has a corrupt fan out table, rebuild it\n", filename );
+        mm.Close();
+        return false;
+    }
+    data        = (const unsigned char *)base;
+    fan_out     = slots;
+    keys        = (const TPI_KEY *)(base + header->keys_offset);
+    nbr_keys    = header->nbr_keys;
+    keys_offset = header->keys_offset;
+    max_game_id = header->max_game_id;
+    key_kind    = (int)header->key_kind;
+    nbr_games   = header->nbr_games;
+    change_counter = header->change_counter;
+    return true;
+}
+
+void PositionIndex::Close()
+{
+    mm.Close();
+    data = NULL;
+    fan_out = NULL;
+    keys = NULL;
+    nbr_keys = 0;
+    keys_offset = 0;
+    max_game_id = -1;
+    key_kind = 0;
+    nbr_games = -1;
+    change_counter = 0;
+}
+
+// Find the key for a hash. The fan out table narrows the search to a few
+//  keys (on average nbr_keys/65536), then a branch free binary search finds
+//  the one we want. The loop has a fixed trip count for a given range size
+//  and no data dependent branches, so it doesn't suffer mispredictions
+const TPI_KEY *PositionIndex::FindKey( uint64_t hash ) const
+{
+    if( !keys )
+        return NULL;
+    unsigned int slot = (unsigned int)(hash>>FAN_OUT_SHIFT);
+    const TPI_KEY *base = keys + fan_out[slot];
+    size_t n = fan_out[slot+1] - fan_out[slot];
+    if( n == 0 )
+        return NULL;
+    while( n > 1 )
+    {
+        size_t half = n/2;
+        base = (base[half-1].hash < hash) ? base+half : base;
+        n -= half;
+    }
+    return base->hash==hash ? base : NULL;
+}
+
+int PositionIndex::Find( uint64_t hash, PostingCursor &cursor ) const
+{
+    cursor = PostingCursor();
+    const TPI_KEY *key = FindKey(hash);
+    if( !key )
+        return 0;
+    if( key->value & TPI_INLINE )
+    {
+        cursor.count   = 1;
+        cursor.game_id = (int)(key->value & 0xffffffff);
+        cursor.ply     = (int)((key->value>>32) & 0x7fffffff);
+        return 1;
+    }
+    if( key->value >= keys_offset )
+        return 0;
+    uint32_t count;
+    const unsigned char *p = varint_get( data+key->value, data+keys_offset, count );
+    if( !p )
+        return 0;
+    cursor.begin = cursor.p = p;
+    cursor.end   = data+keys_offset;
+    cursor.count = (int)count;
+    return cursor.count;
+}
+
+int PositionIndex::Lookup( uint64_t hash, std::vector<int> &game_ids, std::vector<int> *plies ) const
+{
+    PostingCursor cursor;
+    int nbr = Find( hash, cursor );
+    game_ids.resize(nbr);
+    if( plies )
+        plies->resize(nbr);
+    int game_id, ply, i=0;
+    while( i<nbr && cursor.Next(game_id,ply) )
+    {
+        game_ids[i] = game_id;
+        if( plies )
+            (*plies)[i] = ply;
+        i++;
+    }
+    game_ids.resize(i);
+    if( plies )
+        plies->resize(i);
+    return i;
+}
+
+int PositionIndex::Count( uint64_t hash ) const
+{
+    PostingCursor cursor;
+    return Find( hash, cursor );
+}
+
+PositionIndexWriter::PositionIndexWriter()
+{
+    f = NULL;
+    fkeys = NULL;
+    offset = 0;
+    nbr_records = 0;
+    nbr_keys = 0;
+    ok = false;
+}
+
+PositionIndexWriter::~PositionIndexWriter()
+{
+    if( f )
+        fclose(f);
+    if( fkeys )
+        fclose(fkeys);
+}
+
+bool PositionIndexWriter::Write( const void *buf, size_t len )
+{
+    if( ok )
+        ok = (len == fwrite( buf, 1, len, f ));
+    offset += len;
+    return ok;
+}
+
+// Write a placeholder header and fan out table, they are filled in by End()
+bool PositionIndexWriter::Begin( const char *filename )
+{
+    f = fopen( filename, "wb" );
+    fkeys = tmpfile();
+    if( !f || !fkeys )
+    {
+        printf( "Cannot open %s\n", f ? "temporary file" : filename );
+        return false;
+    }
+    ok = true;
+    offset = 0;
+    nbr_records = 0;
+    nbr_keys = 0;
+    same_hash.clear();
+    fan_out.assign( TPI_FAN_OUT+1, 0 );
+    TPI_HEADER header;
+    memset( &header, 0, sizeof(header) );
+    Write( &header, sizeof(header) );
+    Write( &fan_out[0], fan_out.size()*sizeof(uint64_t) );
+    return ok;
+}
+
+bool PositionIndexWriter::Add( const TPI_RECORD &rec )
+{
+    if( !ok )
+        return false;
+    if( same_hash.size() > 0 )
+    {
+        const TPI_RECORD &prev = same_hash.back();
+
+        // Only the earliest ply of a position in a game is kept
+        if( rec.hash==prev.hash && rec.game_id==prev.game_id )
+            return true;
+        if( rec < prev )
+        {
+            printf( "Position index records out of order\n" );
+            ok = false;
+            return false;
+        }
+        if( rec.hash != prev.hash )
+            FlushKey();
+    }
+    same_hash.push_back(rec);
+    return ok;
+}
+
+// Write the key (and posting list if needed) for the games in same_hash
+bool PositionIndexWriter::FlushKey()
+{
+    size_t nbr = same_hash.size();
+    if( nbr == 0 )
+        return ok;
+    TPI_KEY key;
+    key.hash = same_hash[0].hash;
+    if( nbr == 1 )
+        key.value = TPI_INLINE | ((uint64_t)(uint32_t)same_hash[0].ply<<32) | (uint32_t)same_hash[0].game_id;
+    else
+    {
+        key.value = offset;
+        postings_buf.clear();
+        varint_put( postings_buf, (uint32_t)nbr );
+        int prev_game_id = 0;
+        for( size_t i=nbr; i-->0; )
+        {
+            int game_id = same_hash[i].game_id;
+            varint_put( postings_buf, (uint32_t)(i==nbr-1 ? game_id : prev_game_id-game_id) );
+            varint_put( postings_buf, (uint32_t)same_hash[i].ply );
+            prev_game_id = game_id;
+        }
+        Write( &postings_buf[0], postings_buf.size() );
+    }
+    if( ok )
+        ok = (1 == fwrite( &key, sizeof(key), 1, fkeys ));
+
+    // Every slot up to and including this one starts at or before this key
+    unsigned int slot = (unsigned int)(key.hash>>FAN_OUT_SHIFT);
+    fan_out[slot+1] = nbr_keys+1;
+    nbr_keys++;
+    nbr_records += nbr;
+    same_hash.clear();
+    return ok;
+}
+
+bool PositionIndexWriter::End( int max_game_id, int key_kind, int nbr_games, uint32_t change_counter )
+{
+    if( !f )
+        return false;
+    FlushKey();
+
+    // Pad so that the keys are aligned, then append them after the postings
+    static const char zeros[8]={0};
+    Write( zeros, (size_t)((8-offset%8)%8) );
+    uint64_t keys_offset = offset;
+    if( ok )
+        ok = (0 == fseek(fkeys,0,SEEK_SET));
+    TPI_KEY buf[1024];
+    size_t nbr;
+    while( ok && (nbr=fread(buf,sizeof(TPI_KEY),sizeof(buf)/sizeof(buf[0]),fkeys)) > 0 )
+        Write( buf, nbr*sizeof(TPI_KEY) );
+
+    // Convert fan_out[i+1] = end of slot i (or 0 if slot empty) to start offsets
+    for( unsigned int i=1; i<=TPI_FAN_OUT; i++ )
+    {
+        if( fan_out[i] < fan_out[i-1] )
+            fan_out[i] = fan_out[i-1];
+    }
+    TPI_HEADER header;
+    memset( &header, 0, sizeof(header) );
+    memcpy( header.magic, TPI_MAGIC, sizeof(header.magic) );
+    header.version     = TPI_VERSION;
+    header.max_game_id = max_game_id;
+    header.nbr_keys    = nbr_keys;
+    header.nbr_records = nbr_records;
+    header.keys_offset = keys_offset;
+    header.key_kind    = (uint32_t)key_kind;
+    header.nbr_games   = nbr_games;
+    header.change_counter = change_counter;
+    if( ok )
+        ok = (0 == fseek(f,0,SEEK_SET));
+    Write( &header, sizeof(header) );
+    Write( &fan_out[0], fan_out.size()*sizeof(uint64_t) );
+    if( fclose(f) != 0 )
+        ok = false;
+    f = NULL;
+    fclose(fkeys);
+    fkeys = NULL;
+    if( !ok )
+        printf( "Error writing position index\n" );
+    return ok;
+}
@@ -0,0 +1,162 @@
+/****************************************************************************
+ *  Position index file (.tpi), a memory mapped alternative to the SQLite
+ *  positions_N tables for finding the games that reach a position
+ *  Author:  Bill Forster
+ *  License: MIT license. Full text of license is in associated file LICENSE
+ *  Copyright 2010-2014, Bill Forster <billforsternz at gmail dot com>
+ ****************************************************************************/
+#ifndef POSITION_INDEX_H
+#define POSITION_INDEX_H
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+#include "MemoryMap.h"
+
+/*
+ * File layout (all little endian, native alignment);
+ *   TPI_HEADER
+ *   uint64_t fan_out[TPI_FAN_OUT+1]   index of first key whose hash has top
+ *                                      16 bits >= i, fan_out[TPI_FAN_OUT] is
+ *                                      the total number of keys
+ *   postings                           posting lists, see below
+ *   TPI_KEY keys[nbr_keys]             one per distinct hash, sorted by hash
+ *
+ * Most positions are reached by a single game, so a key either holds that
+ *  game inline, or the offset of a posting list. A posting list is a varint
+ *  count followed by count (game_id delta, ply) varint pairs in descending
+ *  game_id order, most recent game first. The first delta is the game_id
+ *  itself, after that each delta is the previous game_id minus this one.
+ *  Popular positions take a byte or two per game rather than a full row.
+ */
+#define TPI_MAGIC   "T3POSIDX"
+#define TPI_VERSION 4
+#define TPI_FAN_OUT 65536
+#define TPI_INLINE  0x8000000000000000ULL  // TPI_KEY value flag, single game inline
+
+struct TPI_HEADER
+{
+    char     magic[8];
+    uint32_t version;
+    int32_t  max_game_id;       // for checking the index matches the database
+    uint64_t nbr_keys;
+    uint64_t nbr_records;       // total (position,game) pairs
+    uint64_t keys_offset;       // file offset of keys, postings end here
+    uint32_t key_kind;          // DB_KEY_KIND of the hashes, as in the database
+    int32_t  nbr_games;         // also for checking, with max_game_id
+    uint32_t change_counter;    // SQLite file change counter, bumped by every write
+    uint32_t reserved;
+};
+
+struct TPI_KEY
+{
+    uint64_t hash;              // db_position_key() of the position
+    uint64_t value;             // TPI_INLINE|ply<<32|game_id, or offset of posting list from start of file
+};
+
+// Input to PositionIndexWriter, and used to sort positions while building
+struct TPI_RECORD
+{
+    uint64_t hash;
+    int32_t  game_id;
+    int32_t  ply;               // first ply the game reaches the position, 1 = after white's first move
+    bool operator <( const TPI_RECORD &other ) const
+    {
+        if( hash != other.hash )
+            return hash < other.hash;
+        if( game_id != other.game_id )
+            return game_id < other.game_id;
+        return ply < other.ply;
+    }
+};
+
+// Streams the games for one position out of a posting list, most recent first
+class PostingCursor
+{
+public:
+    PostingCursor();
+    int  Count() const      { return count; }
+    int  Position() const   { return idx; }     // number of games returned so far
+    bool Next( int &game_id, int &ply );
+    void Rewind();
+
+    // Get the game at position idx in the list. Cheap when moving forward
+    //  or rereading the last game, otherwise decodes from the start again
+    bool Seek( int idx, int &game_id, int &ply );
+
+private:
+    friend class PositionIndex;
+    const unsigned char *begin;     // first (delta,ply) pair
+    const unsigned char *end;
+    const unsigned char *p;
+    int count;
+    int idx;
+    int game_id;
+    int ply;
+};
+
+// Read side, map an index file and look up positions
+class PositionIndex
+{
+public:
+    PositionIndex();
+    bool Open( const char *filename );
+    void Close();
+    bool IsOpen() const     { return keys != NULL; }
+    int  MaxGameId() const  { return max_game_id; }
+    int  KeyKind() const    { return key_kind; }
+    int  NbrGames() const   { return nbr_games; }
+    uint32_t ChangeCounter() const { return change_counter; }
+
+    // Position a cursor on the games that reach a position, returns the
+    //  number of games
+    int Find( uint64_t hash, PostingCursor &cursor ) const;
+
+    // Find the games that reach a position, most recent game first.
+    //  Optionally also return the ply where each game first reaches it.
+    //  Returns the number of games
+    int Lookup( uint64_t hash, std::vector<int> &game_ids, std::vector<int> *plies=NULL ) const;
+
+    // As above, just count them
+    int Count( uint64_t hash ) const;
+
+private:
+    const TPI_KEY *FindKey( uint64_t hash ) const;
+    MemoryMap mm;
+    const unsigned char *data;
+    const uint64_t *fan_out;
+    const TPI_KEY  *keys;
+    uint64_t nbr_keys;
+    uint64_t keys_offset;
+    int max_game_id;
+    int key_kind;
+    int nbr_games;
+    uint32_t change_counter;
+};
+
+// Write side, records must be presented in sorted order
+class PositionIndexWriter
+{
+public:
+    PositionIndexWriter();
+    ~PositionIndexWriter();
+    bool Begin( const char *filename );
+    bool Add( const TPI_RECORD &rec );
+    bool End( int max_game_id, int key_kind, int nbr_games, uint32_t change_counter );
+    uint64_t NbrRecords() const { return nbr_records; }
+    uint64_t NbrKeys() const    { return nbr_keys; }
+
+private:
+    bool FlushKey();
+    bool Write( const void *buf, size_t len );
+    FILE *f;
+    FILE *fkeys;                // keys go to a temporary file until the postings are done
+    std::vector<uint64_t> fan_out;
+    std::vector<TPI_RECORD> same_hash;
+    std::vector<unsigned char> postings_buf;
+    uint64_t offset;
+    uint64_t nbr_records;
+    uint64_t nbr_keys;
+    bool ok;
+};
+
+#endif // POSITION_INDEX_H
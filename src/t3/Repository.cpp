@@ -32,6 +32,7 @@ Repository::Repository( bool use_defaults )
         config->Read("BookFile",             &book.m_file               );
         ReadBool    ("BookEnabled",           book.m_enabled            );
         ReadBool    ("BookSuggest",           book.m_suggest            );
+        ReadBool    ("BookPolyglot",          book.m_polyglot           );
         config->Read("BookLimitMoves",       &book.m_limit_moves        );
         config->Read("BookPostLimitPercent", &book.m_post_limit_percent );
 
@@ -69,6 +70,7 @@ Repository::Repository( bool use_defaults )
         ReadBool    ("EnginePonder",           engine.m_ponder          );
         config->Read("EngineHash",            &engine.m_hash            );
         config->Read("EngineMaxCpuCores",     &engine.m_max_cpu_cores   );
+        config->Read("EngineKibitzCacheDepth",&engine.m_kibitz_cache_depth );
         config->Read("EngineCustom1a",        &engine.m_custom1a        );
         config->Read("EngineCustom1b",        &engine.m_custom1b        );
         config->Read("EngineCustom2a",        &engine.m_custom2a        );
@@ -124,6 +126,7 @@ Repository::~Repository()
     config->Write("BookFile",             book.m_file               );
     config->Write("BookEnabled",          (int)book.m_enabled       );
     config->Write("BookSuggest",          (int)book.m_suggest       );
+    config->Write("BookPolyglot",         (int)book.m_polyglot      );
     config->Write("BookLimitMoves",       book.m_limit_moves        );
     config->Write("BookPostLimitPercent", book.m_post_limit_percent );
 
@@ -195,6 +198,7 @@ Repository::~Repository()
     config->Write("EnginePonder",       (int)engine.m_ponder     );
     config->Write("EngineHash",         engine.m_hash            );
     config->Write("EngineMaxCpuCores",  engine.m_max_cpu_cores   );
+    config->Write("EngineKibitzCacheDepth", engine.m_kibitz_cache_depth );
     config->Write("EngineCustom1a",     engine.m_custom1a        );
     config->Write("EngineCustom1b",     engine.m_custom1b        );
     config->Write("EngineCustom2a",     engine.m_custom2a        );
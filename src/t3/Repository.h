@@ -36,6 +36,7 @@ struct BookConfig
     wxString    m_file;
     bool        m_enabled;
     bool        m_suggest;
+    bool        m_polyglot;         // m_file is a Polyglot .bin book
     int         m_limit_moves;
     int         m_post_limit_percent;
     BookConfig()
@@ -43,6 +44,7 @@ struct BookConfig
         m_file           = "book.pgn";
         m_enabled        = true;
         m_suggest        = false;
+        m_polyglot       = false;
         m_limit_moves    = 8;
         m_post_limit_percent = 50;
     }
@@ -126,6 +128,7 @@ struct EngineConfig
     bool        m_ponder;
     int         m_hash;
     int         m_max_cpu_cores;
+    int         m_kibitz_cache_depth;   // don't kibitz if analysis this deep is cached, 0 = always kibitz
     wxString    m_custom1a;
     wxString    m_custom1b;
     wxString    m_custom2a;
@@ -140,6 +143,7 @@ struct EngineConfig
         m_ponder         = false;
         m_hash           = 64;
         m_max_cpu_cores  = 1;
+        m_kibitz_cache_depth = 0;
         m_custom1a       = "";
         m_custom1b       = "";
         m_custom2a       = "";
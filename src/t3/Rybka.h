@@ -6,12 +6,23 @@
  ****************************************************************************/
 #ifndef RYBKA_H
 #define RYBKA_H
+#include <string>
+#include <thread>
+#include <atomic>
 #include "Portability.h"
 #include "kibitzq.h"
+#include "SpscQueue.h"
 #include "Appdefs.h"
 #include "ChessRules.h"
 #include "wx/wx.h"
 
+// Id of the wxThreadEvent sent to the frame when output from the engine
+//  arrives, it is then processed by Run()
+enum
+{
+    ID_ENGINE_OUTPUT = 10200
+};
+
 class Rybka
 {
 private:
@@ -85,7 +96,7 @@ public:
 private:
     void NewState( const char *comment, RYBKA_STATE new_state );
     void line_out( const char *s );
-    void user_hook_out( const char *s );
+    void ReaderThread();
     const char *user_hook_in();         // Input to Rybka
     bool WaitingForUciok( const char *s );
     void OptionIn( const char *s );
@@ -123,6 +134,16 @@ private:
     thc::ChessPosition pos_kibitz;
     RYBKA_STATE readyok_next_state;
     unsigned long readyok_basetime;
+
+    // Engine process pipes. A reader thread blocks on the output pipe, splits
+    //  it into lines and queues them for Run() on the GUI thread
+    int fd_read;
+    int fd_write;
+    int fd_wake[2];                     // wakes the reader thread to finish
+    std::thread reader;
+    SpscQueue<std::string,1024> lines;
+    std::atomic<bool> reader_eof;       // engine has closed its output
+    std::atomic<bool> wake_posted;      // ID_ENGINE_OUTPUT sent, Run() not called yet
 };
 
 #endif // RYBKA_H
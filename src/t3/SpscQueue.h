@@ -0,0 +1,54 @@
+/****************************************************************************
+ * Fixed size queue for passing items from one thread to one other thread
+ *  without locks
+ *  Author:  Bill Forster
+ *  License: MIT license. Full text of license is in associated file LICENSE
+ *  Copyright 2010-2014, Bill Forster <billforsternz at gmail dot com>
+ ****************************************************************************/
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+#include <atomic>
+
+// Only the producer thread calls Push() and only the consumer thread calls
+//  Pop(). Each index is written by one side only; the release store that
+//  advances it publishes the slot to the other side. N must be a power of two
+template <class T, unsigned int N>
+class SpscQueue
+{
+public:
+    SpscQueue() : put(0), get(0) {}
+
+    // Returns false if the queue is full
+    bool Push( const T &item )
+    {
+        unsigned int temp = put.load(std::memory_order_relaxed);
+        if( temp - get.load(std::memory_order_acquire) >= N )
+            return false;
+        buf[temp&(N-1)] = item;
+        put.store( temp+1, std::memory_order_release );
+        return true;
+    }
+
+    // Returns false if the queue is empty
+    bool Pop( T &item )
+    {
+        unsigned int temp = get.load(std::memory_order_relaxed);
+        if( temp == put.load(std::memory_order_acquire) )
+            return false;
+        item = buf[temp&(N-1)];
+        get.store( temp+1, std::memory_order_release );
+        return true;
+    }
+
+    bool Empty() const
+    {
+        return get.load(std::memory_order_acquire) == put.load(std::memory_order_acquire);
+    }
+
+private:
+    T buf[N];
+    std::atomic<unsigned int> put;     // free running, written by the producer
+    std::atomic<unsigned int> get;     // free running, written by the consumer
+};
+
+#endif // SPSC_QUEUE_H
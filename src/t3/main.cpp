@@ -26,6 +26,7 @@
 #include "DebugPrintf.h"
 #include "Book.h"
 #include "Database.h"
+#include "AnalysisCache.h"
 #include "Objects.h"
 #include "BookDialog.h"
 #include "LogDialog.h"
@@ -91,6 +92,7 @@ public:
     void OnIdle(wxIdleEvent& event);
     void OnMove       (wxMoveEvent &event);
     void OnTimeout    (wxTimerEvent& event);
+    void OnEngineOutput(wxThreadEvent& event);
     void OnQuit       (wxCommandEvent &);
     void OnClose      (wxCloseEvent &);
     void OnAbout      (wxCommandEvent &);
@@ -279,6 +281,7 @@ int ChessApp::OnExit()
     JobEnd();
     if( objs.gl )
     {
+        objs.gl->KibitzCacheFlush();
         delete objs.gl;
         objs.gl = NULL;
     }
@@ -292,6 +295,11 @@ int ChessApp::OnExit()
         delete objs.db;
         objs.db = NULL;
     }
+    if( objs.analysis_cache )
+    {
+        delete objs.analysis_cache;
+        objs.analysis_cache = NULL;
+    }
     if( objs.cws )
     {
         delete objs.cws;
@@ -440,6 +448,7 @@ BEGIN_EVENT_TABLE(ChessFrame, wxFrame)
     EVT_TOOL (ID_BUTTON_RIGHT,     ChessFrame::OnButtonRight)
     EVT_IDLE (ChessFrame::OnIdle)
     EVT_TIMER( TIMER_ID, ChessFrame::OnTimeout)
+    EVT_THREAD( ID_ENGINE_OUTPUT, ChessFrame::OnEngineOutput)
     EVT_MOVE (ChessFrame::OnMove) 
 END_EVENT_TABLE()
 CtrlBoxBookMoves *gbl_book_moves;
@@ -914,6 +923,14 @@ void ChessFrame::OnTimeout( wxTimerEvent& WXUNUSED(event) )
     }
 }
 
+// The engine's reader thread has queued some output, deal with it now
+//  rather than waiting for the next idle event or timeout
+void ChessFrame::OnEngineOutput( wxThreadEvent& WXUNUSED(event) )
+{
+    if( objs.gl )
+        objs.gl->OnIdle();
+}
+
 void ChessFrame::OnFlip (wxCommandEvent &)
 {
     objs.gl->CmdFlip();
@@ -1402,6 +1419,7 @@ void ChessFrame::OnOptionsReset(wxCommandEvent &)
 {
     bool ingame=false;
     bool     old_enabled = objs.repository->book.m_enabled;
+    bool     old_polyglot = objs.repository->book.m_polyglot;
     wxString old_file    = objs.repository->book.m_file;
     wxString old_engine_file  = objs.repository->engine.m_file;
     const char *from = LangCheckDiffBegin();
@@ -1413,6 +1431,7 @@ void ChessFrame::OnOptionsReset(wxCommandEvent &)
     if( objs.repository->engine.m_file != old_engine_file )
         ingame = objs.gl->EngineChanged();
     if( objs.repository->book.m_enabled != old_enabled ||
+        objs.repository->book.m_polyglot != old_polyglot ||
         objs.repository->book.m_file    != old_file )
     {
         if( objs.repository->book.m_enabled )
@@ -1450,6 +1469,7 @@ void ChessFrame::OnBook(wxCommandEvent &)
 {
     BookDialog dialog( objs.repository->book, this );
     bool     old_enabled = objs.repository->book.m_enabled;
+    bool     old_polyglot = objs.repository->book.m_polyglot;
     wxString old_file    = objs.repository->book.m_file;
     if( wxID_OK == dialog.ShowModal() )
     {
@@ -1460,6 +1480,7 @@ void ChessFrame::OnBook(wxCommandEvent &)
             dialog.dat.m_limit_moves,
             dialog.dat.m_post_limit_percent ));
         if( objs.repository->book.m_enabled != old_enabled ||
+            objs.repository->book.m_polyglot != old_polyglot ||
             objs.repository->book.m_file    != old_file )
         {
             if( objs.repository->book.m_enabled )
@@ -0,0 +1,270 @@
+/****************************************************************************
+ * Chess classes - Bitboard view of a position, used to test moves for
+ *  legality without playing them
+ *  Author:  Bill Forster
+ *  License: MIT license. Full text of license is in associated file LICENSE
+ *  Copyright 2010-2014, Bill Forster <billforsternz at gmail dot com>
+ ****************************************************************************/
+#define _CRT_SECURE_NO_DEPRECATE
+#include <stdlib.h>
+#include <string.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#include "Portability.h"
+#include "ChessBitboards.h"
+#include "PrivateChessDefs.h"
+using namespace thc;
+
+// Ray directions, as (file,rank) steps. Rays in the first four directions
+//  run towards lower numbered squares, so the nearest blocker on them is
+//  the highest set bit, the other four (the opposite directions, in the
+//  same order) towards higher numbered squares
+enum { DIR_N, DIR_W, DIR_NE, DIR_NW, DIR_S, DIR_E, DIR_SW, DIR_SE, NBR_DIRS };
+static const int dir_file[NBR_DIRS] = { 0, -1, 1, -1,  0, 1, -1,  1 };
+static const int dir_rank[NBR_DIRS] = { 1,  0, 1,  1, -1, 0, -1, -1 };
+
+// Lookup tables, filled in at startup
+static Bitboard rays[NBR_DIRS][64];
+static Bitboard knight_attacks[64];
+static Bitboard king_attacks[64];
+static Bitboard pawn_attackers[2][64];  // [1] white pawns that attack a square, [0] black
+static Bitboard between[64][64];        // squares strictly between two aligned squares
+static Bitboard line[64][64];           // whole line through two aligned squares
+
+static inline int lowest_bit( Bitboard b )
+{
+#if defined(_MSC_VER) && defined(_WIN64)
+    unsigned long idx;
+    _BitScanForward64( &idx, b );
+    return (int)idx;
+#elif defined(__GNUC__)
+    return __builtin_ctzll(b);
+#else
+    int idx = 0;
+    while( !(b&1) )
+    {
+        b >>= 1;
+        idx++;
+    }
+    return idx;
+#endif
+}
+
+static inline int highest_bit( Bitboard b )
+{
+#if defined(_MSC_VER) && defined(_WIN64)
+    unsigned long idx;
+    _BitScanReverse64( &idx, b );
+    return (int)idx;
+#elif defined(__GNUC__)
+    return 63 - __builtin_clzll(b);
+#else
+    int idx = 0;
+    while( b >>= 1 )
+        idx++;
+    return idx;
+#endif
+}
+
+// Square a (file,rank) step away, or -1 if off the board
+static int step( int sq, int df, int dr )
+{
+    int file = IFILE(sq) + df;
+    int rank = IRANK(sq) + dr;
+    if( file<0 || file>7 || rank<0 || rank>7 )
+        return -1;
+    return (7-rank)*8 + file;
+}
+
+static Bitboard step_mask( int sq, int df, int dr )
+{
+    int dst = step(sq,df,dr);
+    return dst<0 ? 0 : BB(dst);
+}
+
+// Classical ray attacks; the ray beyond the nearest blocker is masked off
+//  using the same ray from the blocker
+static inline Bitboard ray_attacks( int sq, int dir, Bitboard occupied )
+{
+    Bitboard attacks = rays[dir][sq];
+    Bitboard blockers = attacks & occupied;
+    if( blockers )
+    {
+        int blocker = dir<DIR_S ? highest_bit(blockers) : lowest_bit(blockers);
+        attacks ^= rays[dir][blocker];
+    }
+    return attacks;
+}
+
+Bitboard thc::BitboardRookAttacks( int sq, Bitboard occupied )
+{
+    return ray_attacks(sq,DIR_N,occupied) | ray_attacks(sq,DIR_W,occupied) |
+           ray_attacks(sq,DIR_S,occupied) | ray_attacks(sq,DIR_E,occupied);
+}
+
+Bitboard thc::BitboardBishopAttacks( int sq, Bitboard occupied )
+{
+    return ray_attacks(sq,DIR_NE,occupied) | ray_attacks(sq,DIR_NW,occupied) |
+           ray_attacks(sq,DIR_SE,occupied) | ray_attacks(sq,DIR_SW,occupied);
+}
+
+// Static object whose constructor fills in the lookup tables
+static struct BitboardTables
+{
+    BitboardTables()
+    {
+        static const int knight_steps[8][2] = { {1,2},{2,1},{2,-1},{1,-2},{-1,-2},{-2,-1},{-2,1},{-1,2} };
+        memset( between, 0, sizeof(between) );
+        memset( line, 0, sizeof(line) );
+        for( int sq=0; sq<64; sq++ )
+        {
+            knight_attacks[sq] = 0;
+            king_attacks[sq]   = 0;
+            for( int i=0; i<8; i++ )
+            {
+                knight_attacks[sq] |= step_mask( sq, knight_steps[i][0], knight_steps[i][1] );
+                king_attacks[sq]   |= step_mask( sq, dir_file[i], dir_rank[i] );
+            }
+
+            // A white pawn attacks diagonally forward, so the white pawns that
+            //  attack a square are diagonally behind it, and vice versa
+            pawn_attackers[1][sq] = step_mask(sq,-1,-1) | step_mask(sq,1,-1);
+            pawn_attackers[0][sq] = step_mask(sq,-1,1)  | step_mask(sq,1,1);
+            for( int dir=0; dir<NBR_DIRS; dir++ )
+            {
+                rays[dir][sq] = 0;
+                for( int dst=step(sq,dir_file[dir],dir_rank[dir]); dst>=0; dst=step(dst,dir_file[dir],dir_rank[dir]) )
+                    rays[dir][sq] |= BB(dst);
+            }
+        }
+        for( int sq=0; sq<64; sq++ )
+        {
+            for( int dir=0; dir<NBR_DIRS; dir++ )
+            {
+                int opposite = (dir+NBR_DIRS/2) % NBR_DIRS;
+                for( int dst=step(sq,dir_file[dir],dir_rank[dir]); dst>=0; dst=step(dst,dir_file[dir],dir_rank[dir]) )
+                {
+                    between[sq][dst] = rays[dir][sq] & ~rays[dir][dst] & ~BB(dst);
+                    line[sq][dst]    = rays[dir][sq] | rays[opposite][sq] | BB(sq);
+                }
+            }
+        }
+    }
+} bitboard_tables;
+
+void BitboardPosition::Set( const ChessPosition &cp )
+{
+    white = black = 0;
+    pawns = knights = bishops = rooks = queens = kings = 0;
+    for( int sq=0; sq<64; sq++ )
+    {
+        char piece = cp.squares[sq];
+        if( IsEmptySquare(piece) )
+            continue;
+        Bitboard mask = BB(sq);
+        if( IsWhite(piece) )
+            white |= mask;
+        else
+            black |= mask;
+        switch( piece )
+        {
+            case 'P': case 'p': pawns   |= mask; break;
+            case 'N': case 'n': knights |= mask; break;
+            case 'B': case 'b': bishops |= mask; break;
+            case 'R': case 'r': rooks   |= mask; break;
+            case 'Q': case 'q': queens  |= mask; break;
+            case 'K': case 'k': kings   |= mask; break;
+        }
+    }
+    occupied = white | black;
+}
+
+Bitboard BitboardPosition::AttackersTo( int sq, bool by_white, Bitboard occ ) const
+{
+    Bitboard attackers = (knight_attacks[sq] & knights) |
+                         (king_attacks[sq] & kings) |
+                         (pawn_attackers[by_white?1:0][sq] & pawns);
+    Bitboard rooks_queens = rooks | queens;
+    Bitboard bishops_queens = bishops | queens;
+    if( rooks_queens )
+        attackers |= BitboardRookAttacks(sq,occ) & rooks_queens;
+    if( bishops_queens )
+        attackers |= BitboardBishopAttacks(sq,occ) & bishops_queens;
+    return attackers & (by_white ? white : black);
+}
+
+LegalMoveFilter::LegalMoveFilter( const ChessPosition &cp )
+{
+    bb.Set(cp);
+    white      = cp.white;
+    king       = white ? cp.wking_square : cp.bking_square;
+    checkers   = 0;
+    check_mask = 0;
+    pinned     = 0;
+    valid      = (king>=0 && king<64 && cp.squares[king]==(white?'K':'k'));
+    if( !valid )
+        return;
+    Bitboard us   = white ? bb.white : bb.black;
+    Bitboard them = white ? bb.black : bb.white;
+    checkers = bb.AttackersTo( king, !white, bb.occupied );
+    if( checkers == 0 )
+        check_mask = ~(Bitboard)0;
+    else if( (checkers & (checkers-1)) == 0 )
+        check_mask = checkers | between[king][lowest_bit(checkers)];
+    else
+        check_mask = 0;     // double check, only the king can move
+
+    // An enemy slider with exactly one piece between it and our king pins
+    //  that piece if it is one of ours
+    Bitboard snipers = (BitboardRookAttacks(king,0)   & them & (bb.rooks|bb.queens)) |
+                       (BitboardBishopAttacks(king,0) & them & (bb.bishops|bb.queens));
+    while( snipers )
+    {
+        int sniper = lowest_bit(snipers);
+        snipers &= snipers-1;
+        Bitboard blockers = between[king][sniper] & bb.occupied;
+        if( blockers && (blockers & (blockers-1))==0 && (blockers & us) )
+            pinned |= blockers;
+    }
+}
+
+bool LegalMoveFilter::IsLegal( const Move &m ) const
+{
+    int src = m.src;
+    int dst = m.dst;
+    switch( m.special )
+    {
+        // GenMoveList() only castles if the king's start, transit and
+        //  destination squares are not attacked
+        case SPECIAL_WK_CASTLING:
+        case SPECIAL_BK_CASTLING:
+        case SPECIAL_WQ_CASTLING:
+        case SPECIAL_BQ_CASTLING:
+            return true;
+
+        // En passant removes two pieces from a line, so can expose the king
+        //  in ways the pin mask doesn't cover. Just look for attackers
+        case SPECIAL_WEN_PASSANT:
+        case SPECIAL_BEN_PASSANT:
+        {
+            int captured = white ? SOUTH(dst) : NORTH(dst);
+            Bitboard occ = (bb.occupied ^ BB(src) ^ BB(captured)) | BB(dst);
+            return 0 == (bb.AttackersTo(king,!white,occ) & ~BB(captured));
+        }
+        default:
+            break;
+    }
+
+    // King moves, the king mustn't be in the way of attacks along the line
+    //  it is moving on
+    if( src == king )
+        return 0 == bb.AttackersTo( dst, !white, bb.occupied ^ BB(king) );
+
+    // Other pieces must deal with any check and stay on the line of any pin
+    if( (check_mask & BB(dst)) == 0 )
+        return false;
+    if( (pinned & BB(src)) && (line[king][src] & BB(dst)) == 0 )
+        return false;
+    return true;
+}
@@ -0,0 +1,69 @@
+/****************************************************************************
+ * Chess classes - Bitboard view of a position, used to test moves for
+ *  legality without playing them
+ *  Author:  Bill Forster
+ *  License: MIT license. Full text of license is in associated file LICENSE
+ *  Copyright 2010-2014, Bill Forster <billforsternz at gmail dot com>
+ ****************************************************************************/
+#ifndef CHESSBITBOARDS_H
+#define CHESSBITBOARDS_H
+#include "ChessPosition.h"
+#include "Move.h"
+
+// TripleHappyChess
+namespace thc
+{
+
+// Bit n of a Bitboard corresponds to Square n, so a8 is bit 0 and h1 is
+//  bit 63, the same convention as squares[]
+typedef uint64_t Bitboard;
+#define BB(sq) ( ((Bitboard)1) << (sq) )
+
+// Sliding piece attacks from a square, given the occupied squares
+Bitboard BitboardRookAttacks  ( int sq, Bitboard occupied );
+Bitboard BitboardBishopAttacks( int sq, Bitboard occupied );
+
+// The pieces of a position as bitboards. Built from squares[] once per move
+//  list, a single pass over the board that costs little next to generating
+//  the moves, rather than maintained move by move. That leaves PushMove(),
+//  PopMove() and the size of ChessPosition alone, and unlike the Zobrist key
+//  (ChessRules::ZobristRefresh()) there's nothing to refresh after setting up
+//  squares[] directly
+struct BitboardPosition
+{
+    void Set( const ChessPosition &cp );
+
+    // Pieces of one colour that attack a square, given the occupied squares
+    Bitboard AttackersTo( int sq, bool by_white, Bitboard occ ) const;
+
+    Bitboard white, black, occupied;
+    Bitboard pawns, knights, bishops, rooks, queens, kings;
+};
+
+// Decides whether moves from GenMoveList() (which may leave the king in
+//  check) are legal, using check and pin masks worked out once per
+//  position instead of playing each move and looking for attacks on the king
+class LegalMoveFilter
+{
+public:
+    LegalMoveFilter( const ChessPosition &cp );
+
+    // False if the king isn't where the position says it is, in which case
+    //  the filter can't be used
+    bool Valid() const   { return valid; }
+    bool InCheck() const { return checkers != 0; }
+    bool IsLegal( const Move &m ) const;
+
+private:
+    BitboardPosition bb;
+    bool     white;
+    int      king;
+    Bitboard checkers;      // enemy pieces giving check
+    Bitboard check_mask;    // if in check, squares that capture or block the checker
+    Bitboard pinned;        // our pieces pinned against the king
+    bool     valid;
+};
+
+} //namespace thc
+
+#endif //CHESSBITBOARDS_H
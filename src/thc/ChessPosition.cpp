@@ -1264,3 +1264,94 @@ uint64_t ChessPosition::Hash64Update( uint64_t hash_in, Move move )
     return hash;
 }
 
+
+/****************************************************************************
+ * Calculate a full Zobrist key for position
+ ****************************************************************************/
+uint64_t ChessPosition::ZobristCalculate()
+{
+    return Hash64Calculate() ^ ZobristState();
+}
+
+/****************************************************************************
+ * Zobrist key for side to move, castling rights and en passant
+ ****************************************************************************/
+uint64_t ChessPosition::ZobristState()
+{
+    uint64_t key = white ? zobrist_white_to_play : 0;
+
+    // The castling flags are only cleared when something arrives on the king
+    //  or rook square (see ChessRules::PushMove()), so count them only if
+    //  the king and rook are still at home
+    if( wking  && squares[e1]=='K' && squares[h1]=='R' )
+        key ^= zobrist_castling[0];
+    if( wqueen && squares[e1]=='K' && squares[a1]=='R' )
+        key ^= zobrist_castling[1];
+    if( bking  && squares[e8]=='k' && squares[h8]=='r' )
+        key ^= zobrist_castling[2];
+    if( bqueen && squares[e8]=='k' && squares[a8]=='r' )
+        key ^= zobrist_castling[3];
+
+    // The en passant target is set after every two square pawn advance, it
+    //  only makes a difference if an enemy pawn is alongside to capture
+    Square ep = (Square)enpassant_target;
+    if( ep != SQUARE_INVALID )
+    {
+        bool capture = false;
+        int file = IFILE(ep);
+        if( white && IRANK(ep)==5 )
+            capture = (file>0 && squares[SW(ep)]=='P') || (file<7 && squares[SE(ep)]=='P');
+        else if( !white && IRANK(ep)==2 )
+            capture = (file>0 && squares[NW(ep)]=='p') || (file<7 && squares[NE(ep)]=='p');
+        if( capture )
+            key ^= zobrist_enpassant[file];
+    }
+    return key;
+}
+
+/****************************************************************************
+ * Calculate the key used to index Polyglot (.bin) opening books
+ ****************************************************************************/
+uint64_t ChessPosition::PolyglotKey()
+{
+    static const char *kinds = "pPnNbBrRqQkK";     // Polyglot's piece order
+    uint64_t key = 0;
+    for( int sq=0; sq<64; sq++ )
+    {
+        char piece = squares[sq];
+        const char *p = (piece==' ' ? NULL : strchr(kinds,piece));
+        if( p )
+        {
+            int kind = (int)(p-kinds);
+            key ^= polyglot_random[ 64*kind + 8*IRANK(sq) + IFILE(sq) ];
+        }
+    }
+
+    // Castling, same rules as ZobristState()
+    if( wking  && squares[e1]=='K' && squares[h1]=='R' )
+        key ^= polyglot_random[768];
+    if( wqueen && squares[e1]=='K' && squares[a1]=='R' )
+        key ^= polyglot_random[769];
+    if( bking  && squares[e8]=='k' && squares[h8]=='r' )
+        key ^= polyglot_random[770];
+    if( bqueen && squares[e8]=='k' && squares[a8]=='r' )
+        key ^= polyglot_random[771];
+
+    // En passant, only if a pawn is alongside to capture (Polyglot doesn't
+    //  check the capture is legal)
+    Square ep = (Square)enpassant_target;
+    if( ep != SQUARE_INVALID )
+    {
+        bool capture = false;
+        int file = IFILE(ep);
+        if( white && IRANK(ep)==5 )
+            capture = (file>0 && squares[SW(ep)]=='P') || (file<7 && squares[SE(ep)]=='P');
+        else if( !white && IRANK(ep)==2 )
+            capture = (file>0 && squares[NW(ep)]=='p') || (file<7 && squares[NE(ep)]=='p');
+        if( capture )
+            key ^= polyglot_random[772+file];
+    }
+    if( white )
+        key ^= polyglot_random[780];
+    return key;
+}
@@ -186,6 +186,17 @@ public:
     
     // Incremental hash value update (64 bit version)
     uint64_t Hash64Update( uint64_t hash_in, Move move );
+
+    // Calculate a full Zobrist key for position. Hash64Calculate() only covers
+    //  the squares, this also covers side to move, castling rights and en
+    //  passant (if a capture is actually possible)
+    uint64_t ZobristCalculate();
+
+    // The part of ZobristCalculate() not covered by Hash64Calculate()
+    uint64_t ZobristState();
+
+    // Calculate the key used to index Polyglot (.bin) opening books
+    uint64_t PolyglotKey();
  
     // Whos turn is it anyway
     inline bool WhiteToPlay() const { return white; }
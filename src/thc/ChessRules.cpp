@@ -14,6 +14,7 @@
 #include "Portability.h"
 #include "DebugPrintf.h"
 #include "ChessRules.h"
+#include "ChessBitboards.h"
 #include "PrivateChessDefs.h"
 using namespace std;
 using namespace thc;
@@ -192,12 +193,19 @@ void ChessRules::GenLegalMoveList( MOVELIST *list )
     // Generate all moves, including illegal (eg put king in check) moves
     GenMoveList( &list2 );
 
-    // Loop copying the proven good ones
+    // Loop copying the proven good ones. The filter decides without playing
+    //  the moves, unless the king isn't where we think it is
+    LegalMoveFilter filter(*this);
     for( i=j=0; i<list2.count; i++ )
     {
-        PushMove( list2.moves[i] );
-        okay = Evaluate(terminal_score);
-        PopMove( list2.moves[i] );
+        if( filter.Valid() )
+            okay = filter.IsLegal( list2.moves[i] );
+        else
+        {
+            PushMove( list2.moves[i] );
+            okay = Evaluate(terminal_score);
+            PopMove( list2.moves[i] );
+        }
         if( okay )
             list->moves[j++] = list2.moves[i];
     }
@@ -219,9 +227,13 @@ void ChessRules::GenLegalMoveList( MOVELIST *list, bool check[MAXMOVES],
     // Generate all moves, including illegal (eg put king in check) moves
     GenMoveList( &list2 );
 
-    // Loop copying the proven good ones
+    // Loop copying the proven good ones, only the legal ones need to be
+    //  played to find out whether they give check, mate or stalemate
+    LegalMoveFilter filter(*this);
     for( i=j=0; i<list2.count; i++ )
     {
+        if( filter.Valid() && !filter.IsLegal(list2.moves[i]) )
+            continue;
         PushMove( list2.moves[i] );
         okay = Evaluate(terminal_score);
         Square king_to_move = (Square)(white ? wking_square : bking_square );
@@ -272,6 +284,7 @@ bool ChessRules::IsDraw( bool white_asks, DRAWTYPE &result )
         memcpy( save_squares, squares, sizeof(save_squares) );
         unsigned char save_detail_idx = detail_idx;  // must be unsigned char
         bool          save_white      = white;
+        uint64_t      save_zobrist    = zobrist;
         unsigned char idx             = history_idx; // must be unsigned char
         DETAIL_SAVE;
 
@@ -311,6 +324,7 @@ bool ChessRules::IsDraw( bool white_asks, DRAWTYPE &result )
         // Restore current position
         memcpy( squares, save_squares, sizeof(squares) );
         white      = save_white;
+        zobrist    = save_zobrist;
         detail_idx = save_detail_idx;
         DETAIL_RESTORE;
     }
@@ -887,6 +901,9 @@ void ChessRules::BlackPawnMoves( MOVELIST *l, Square square )
  ****************************************************************************/
 void ChessRules::PushMove( Move& m ) 
 {    
+    // Take the moving pieces and the old details out of the Zobrist key
+    zobrist ^= ZobristState() ^ Hash64Update(0,m);
+
     // Push old details onto stack
     DETAIL_PUSH;
 
@@ -1006,6 +1023,9 @@ void ChessRules::PushMove( Move& m )
 
     // Toggle who-to-move
     Toggle();
+
+    // Put the new details into the Zobrist key
+    zobrist ^= ZobristState();
 }    
 
 /****************************************************************************
@@ -1013,6 +1033,9 @@ void ChessRules::PushMove( Move& m )
  ****************************************************************************/
 void ChessRules::PopMove( Move& m ) 
 {    
+    // Take the details out of the Zobrist key
+    zobrist ^= ZobristState();
+
     // Previous detail field
     DETAIL_POP;
 
@@ -1079,6 +1102,9 @@ void ChessRules::PopMove( Move& m )
         squares[a8] = 'r';
         break;
     }    
+
+    // Put the moving pieces and the previous details back into the Zobrist key
+    zobrist ^= ZobristState() ^ Hash64Update(0,m);
 }    
 
 
@@ -1182,8 +1208,15 @@ bool ChessRules::Evaluate( MOVELIST *p, TERMINAL &score_terminal )
 
 		// Work out if the game is over by checking for any legal moves
 		GenMoveList( &list );
+		LegalMoveFilter filter(*this);
 		for( any=i=0 ; i<list.count && any==0 ; i++ )
 		{    
+			if( filter.Valid() )
+			{
+				if( filter.IsLegal(list.moves[i]) )
+					any++;
+				continue;
+			}
 			PushMove( list.moves[i] );
 			my_king = (Square)(white ? bking_square : wking_square);
 			if( !AttackedPiece(my_king) )
@@ -1277,6 +1310,7 @@ void ChessRules::Transform()
             }
         }
     }
+    ZobristRefresh();
 }
 
 
@@ -26,6 +26,7 @@ public:
         history[0].src = a8;   // (look backwards through history stops when src==dst)
         history[0].dst = a8;
         detail_idx =0;
+        zobrist = ZobristCalculate();
     }
 
     // Copy constructor
@@ -102,6 +103,12 @@ public:
 
     // Undo a move
     void PopMove( Move& m );
+
+    // Zobrist key of the position (see ChessPosition::ZobristCalculate()),
+    //  kept up to date by PushMove() and PopMove() so it costs nothing to
+    //  read. Call ZobristRefresh() after changing squares[] etc. directly
+    uint64_t Zobrist() const { return zobrist; }
+    void ZobristRefresh()    { zobrist = ZobristCalculate(); }
     
     // Test fundamental internal assumptions and operations
     void TestInternals();
@@ -140,6 +147,9 @@ protected:
     // Detail stack is a ring array
     DETAIL detail_stack[256];           // must be 256 ..
     unsigned char detail_idx;           // .. so this loops around naturally
+
+    // Zobrist key, see Zobrist()
+    uint64_t zobrist;
 };
 
 } //namespace thc